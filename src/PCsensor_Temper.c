@@ -24,15 +24,16 @@
 #include <errno.h>
 
 #include "usense.h"
+#include "usense-usb.h"
 #include "units.h"
 
 struct temper {
-	struct usb_dev_handle *usb;
+	libusb_device_handle *usb;
 };
 
 #define TEMPER_TIMEOUT	1000
 
-static int send_command(struct usb_dev_handle *usb, unsigned int a, unsigned int b, unsigned int c, unsigned int d, unsigned int e, unsigned int f, unsigned int g, unsigned int h)
+static int send_command(libusb_device_handle *usb, unsigned int a, unsigned int b, unsigned int c, unsigned int d, unsigned int e, unsigned int f, unsigned int g, unsigned int h)
 {
 	unsigned char buf[32];
 	int rc;
@@ -47,8 +48,8 @@ static int send_command(struct usb_dev_handle *usb, unsigned int a, unsigned int
 	buf[6] = g;
 	buf[7] = h;
 
-	rc = usb_control_msg(usb, 0x21, 9, 0x200, 0x01,
-			    (char *) buf, 32, TEMPER_TIMEOUT);
+	rc = usense_usb_control(usb, 0x21, 9, 0x200, 0x01,
+				buf, 32, TEMPER_TIMEOUT);
 	if(rc != 32) {
 		perror("send_command failed");
 		return -1;
@@ -57,7 +58,7 @@ static int send_command(struct usb_dev_handle *usb, unsigned int a, unsigned int
 }
 
 
-static int temp_read(struct usb_dev_handle *usb, int16_t *val)
+static int temp_read(libusb_device_handle *usb, int16_t *val)
 {
 	uint8_t buff[256];
 	uint16_t tmp;
@@ -70,21 +71,21 @@ static int temp_read(struct usb_dev_handle *usb, int16_t *val)
 	buff[3] = 13;
 	buff[6] = 2;
 
-	err = usb_control_msg(usb, 0x21, 9, 0x200, 0x01,
-	                      (void *)buff, 32, TEMPER_TIMEOUT);
+	err = usense_usb_control(usb, 0x21, 9, 0x200, 0x01,
+	                         (void *)buff, 32, TEMPER_TIMEOUT);
 	if (err < 0) return err;
 
 	memset(buff, 0, 32);
 	buff[0] = 0x54;
 
-	err = usb_control_msg(usb, 0x21, 9, 0x200, 0x01,
-	                      (void *)buff, 32, TEMPER_TIMEOUT);
+	err = usense_usb_control(usb, 0x21, 9, 0x200, 0x01,
+	                         (void *)buff, 32, TEMPER_TIMEOUT);
 	if (err < 0) return err;
 
 	memset(buff, 0, 32);
 	for (i = 0; i < 7; i++) {
-		err = usb_control_msg(usb, 0x21, 9, 0x200, 0x01,
-				      (void *)buff, 32, TEMPER_TIMEOUT);
+		err = usense_usb_control(usb, 0x21, 9, 0x200, 0x01,
+					 (void *)buff, 32, TEMPER_TIMEOUT);
 		if (err < 0) return err;
 	}
 
@@ -95,13 +96,13 @@ static int temp_read(struct usb_dev_handle *usb, int16_t *val)
 	buff[3] = 13;
 	buff[6] = 1;
 
-	err = usb_control_msg(usb, 0x21, 9, 0x200, 0x01,
-	                      (void *)buff, 32, TEMPER_TIMEOUT);
+	err = usense_usb_control(usb, 0x21, 9, 0x200, 0x01,
+	                         (void *)buff, 32, TEMPER_TIMEOUT);
 	if (err < 0) return err;
 
 	memset(buff, 0, sizeof(buff));
-	err = usb_control_msg(usb, 0xa1, 1, 0x300, 0x01,
-	                      (void *)buff, 8, TEMPER_TIMEOUT);
+	err = usense_usb_control(usb, 0xa1, 1, 0x300, 0x01,
+	                         (void *)buff, 8, TEMPER_TIMEOUT);
 	if (err < 0) return err;
 
 	/* First byte is Degrees C
@@ -129,6 +130,63 @@ static int temp_read(struct usb_dev_handle *usb, int16_t *val)
 	return 0;
 }
 
+/* The sensor's configuration register. Its R1:R0 bits
+ * (0x60) are the resolution, 9 + R bits, as on a DS75.
+ */
+static int conf_read(libusb_device_handle *usb, uint8_t *conf)
+{
+	uint8_t buff[32];
+	int err;
+
+	memset(buff, 0, sizeof(buff));
+	buff[0] = 10;
+	buff[1] = 11;
+	buff[2] = 12;
+	buff[3] = 13;
+	buff[6] = 2;
+
+	err = usense_usb_control(usb, 0x21, 9, 0x200, 0x01,
+	                         (void *)buff, 32, TEMPER_TIMEOUT);
+	if (err < 0) return err;
+
+	memset(buff, 0, 32);
+	buff[0] = 0x52;
+
+	err = usense_usb_control(usb, 0x21, 9, 0x200, 0x01,
+	                         (void *)buff, 32, TEMPER_TIMEOUT);
+	if (err < 0) return err;
+
+	memset(buff, 0, 32);
+	buff[0] = 10;
+	buff[1] = 11;
+	buff[2] = 12;
+	buff[3] = 13;
+	buff[6] = 1;
+
+	err = usense_usb_control(usb, 0x21, 9, 0x200, 0x01,
+	                         (void *)buff, 32, TEMPER_TIMEOUT);
+	if (err < 0) return err;
+
+	memset(buff, 0, sizeof(buff));
+	err = usense_usb_control(usb, 0xa1, 1, 0x300, 0x01,
+	                         (void *)buff, 8, TEMPER_TIMEOUT);
+	if (err < 0) return err;
+
+	*conf = buff[0];
+
+	return 0;
+}
+
+static void PCsensor_Temper_reading(struct usense_device *dev, int16_t temp)
+{
+	/* Kelvin */
+	char buff[48];
+	double celsius = (double)temp/ 256.0;
+	double kelvin = C_TO_K(celsius);
+	snprintf(buff, sizeof(buff), "%g", kelvin);
+	usense_prop_set(dev, "reading", buff);
+}
+
 static int PCsensor_Temper_update(struct usense_device *dev, void *priv)
 {
 	int16_t temp;
@@ -140,30 +198,35 @@ static int PCsensor_Temper_update(struct usense_device *dev, void *priv)
 	if (err < 0) {
 		fprintf(stderr, "%s: Can't read temperature\n", usense_device_name(dev));
 		return err;
-	} else {
-		/* Kelvin */
-		char buff[48];
-		double celsius = (double)temp/ 256.0;
-		double kelvin = C_TO_K(celsius);
-		snprintf(buff, sizeof(buff), "%g", kelvin);
-		usense_prop_set(dev, "reading", buff);
 	}
 
+	PCsensor_Temper_reading(dev, temp);
+
 	return 0;
 }
 
-static int PCsensor_Temper_attach(struct usense_device *dev, struct usb_dev_handle *usb, void **priv)
+static int PCsensor_Temper_attach(struct usense_device *dev, libusb_device_handle *usb, void **priv)
 {
-	int err;
 	struct temper *temper;
+	uint8_t conf;
+	int err;
 
 	temper = calloc(1, sizeof(*temper));
+	if (temper == NULL)
+		return -ENOMEM;
 	temper->usb = usb;
 
 	/* Set the device and type */
 	usense_prop_set(dev, "device", "PCsensor_Temper");
 	usense_prop_set(dev, "type", "temp");
 
+	/* Still in 12-bit mode from an earlier attach? Reading the
+	 * config is four transfers, against eight to set it.
+	 */
+	err = conf_read(usb, &conf);
+	if (err == 0 && (conf & 0x60) == 0x60)
+		goto configured;
+
 	/* Issue the commands to set the device to 12-bit mode */
 
 	send_command(usb, 10, 11, 12, 13, 0, 0, 2, 0);
@@ -175,6 +238,9 @@ static int PCsensor_Temper_attach(struct usense_device *dev, struct usb_dev_hand
 	send_command(usb, 0, 0, 0, 0, 0, 0, 0, 0);
 	send_command(usb, 0, 0, 0, 0, 0, 0, 0, 0);
 
+configured:
+	usense_prop_set(dev, "PCsensor_Temper.resolution", "12");
+
 	PCsensor_Temper_update(dev, temper);
 
 	*priv = temper;
@@ -189,7 +255,7 @@ static void PCsensor_Temper_release(void *priv)
 	free(temper);
 }
 
-static int PCsensor_Temper_match(struct usb_device_descriptor *desc)
+static int PCsensor_Temper_match(struct libusb_device_descriptor *desc)
 {
 	return (desc->idVendor == 0x1130 &&
 		desc->idProduct == 0x660c &&
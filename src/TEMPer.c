@@ -24,57 +24,77 @@
 #include <errno.h>
 
 #include "usense.h"
+#include "usense-usb.h"
 #include "units.h"
 
 #include "ch341.h"
 #include "i2c.h"
 #include "i2c-algo-bit.h"
+#include "i2c-ch341.h"
 
 struct temper {
-	struct ch341 *ch;
+	libusb_device_handle *usb;
+	int native;		/* Use the CH341's own I2C engine */
+	struct ch341 *ch;	/* ..otherwise, bit-bang through this */
 	struct i2c_adapter adap;
 	struct i2c_algo_bit_data i2c_bit;
+	unsigned int settle_us;	/* TEMPer.settle_us */
+	int failures;		/* Failed reads in a row */
+	int zero;		/* The last read was 0x0000 */
 };
 
+/* Longest settle time we accept, in us */
+#define TEMPER_SETTLE_MAX	100000
+
+/* Bus recovery
+ *
+ * A good read leaves the bus idle, so the next one needs no reset.
+ * After a failed, NAKed or implausible read, the bus is reset before
+ * trying again, and every TEMPER_REOPEN failures in a row the CH341
+ * itself is closed and re-opened.
+ */
+#define TEMPER_TRIES		3	/* Reads per update */
+#define TEMPER_REOPEN		3
+
 static void temper_setsda(void *data, int state)
 {
 	struct ch341 *ch = data;
-	int val;
-	val = ch341_tiocmget(ch);
-	if (state) {
-		val |= TIOCM_RTS;
-	} else {
-		val &= ~TIOCM_RTS;
-	}
-	ch341_tiocmset(ch, val);
+
+	if (state)
+		ch341_tiocmbis(ch, TIOCM_RTS);
+	else
+		ch341_tiocmbic(ch, TIOCM_RTS);
 }
 
 static void temper_setscl(void *data, int state)
 {
 	struct ch341 *ch = data;
-	int val;
 
-	val = ch341_tiocmget(ch);
-	if (state) {
-		val |= TIOCM_DTR;
-	} else {
-		val &= ~TIOCM_DTR;
-	}
-	ch341_tiocmset(ch, val);
+	if (state)
+		ch341_tiocmbis(ch, TIOCM_DTR);
+	else
+		ch341_tiocmbic(ch, TIOCM_DTR);
 }
 
+/* Release SDA, then sample it on CTS. This is the only
+ * callback that reads from the adapter.
+ */
 static int  temper_getsda(void *data)
 {
 	struct ch341 *ch = data;
 	int val;
 
 	temper_setsda(data, 1);
-	usleep(100);
 	val = ch341_tiocmget(ch);
 
 	return ((val & TIOCM_CTS) != 0);
 }
 
+static int temper_flush(void *data)
+{
+	return ch341_flush(data);
+}
+
 #define REG_TEMP	0
 #define REG_CONFIG	1
 #define REG_THYST	2
@@ -87,9 +107,9 @@ static int  temper_getsda(void *data)
  * Improvided a little by framing between
  * a START, repeated START, and a STOP condition.
  *
- * Call this before any set of operations.
+ * Call this to recover the bus, after a failed operation.
  */
-static int temp_reset(struct i2c_adapter *adap)
+static void temp_reset(struct i2c_adapter *adap)
 {
 	struct i2c_algo_bit_data *bit = adap->algo_data;
 	int i;
@@ -97,35 +117,36 @@ static int temp_reset(struct i2c_adapter *adap)
 	/* Send a START condition */
 	bit->setscl(bit->data, 1);
 	bit->setsda(bit->data, 1);
-	usleep(500);
+	udelay(bit->udelay);
 	bit->setsda(bit->data, 0);
-	usleep(500);
+	udelay(bit->udelay);
 	bit->setscl(bit->data, 0);
 
-	/* Send out a 1Khz waveform of
-	 * 9 clock pulses
+	/* Send out 9 clock pulses. Every line change
+	 * is a USB round trip, so this is already well
+	 * below the LM75's maximum clock rate.
 	 */
 	bit->setsda(bit->data, 1);
 	for (i = 0; i < 9; i++) {
 		bit->setscl(bit->data, 1);
-		usleep(500);
+		udelay(bit->udelay);
 		bit->setscl(bit->data, 0);
-		usleep(500);
+		udelay(bit->udelay);
 	}
 
 	/* Send out START condition again */
 	bit->setscl(bit->data, 1);
-	usleep(500);
+	udelay(bit->udelay);
 	bit->setsda(bit->data, 0);
-	usleep(500);
+	udelay(bit->udelay);
 	bit->setscl(bit->data, 0);
-	usleep(500);
+	udelay(bit->udelay);
 
 	/* And send STOP condition */
 	bit->setscl(bit->data, 1);
-	usleep(500);
+	udelay(bit->udelay);
 	bit->setsda(bit->data, 1);
-	usleep(500);
+	udelay(bit->udelay);
 }
 
 static int temp_cfg_read(struct i2c_adapter *adap, uint8_t *val)
@@ -187,46 +208,115 @@ static int temp_read(struct i2c_adapter *adap, int reg, int16_t *val)
 	return err;
 }
 
-static int TEMPer_update(struct usense_device *dev, void *priv)
+/* Bits 3..0 of the temperature are always clear, so 0xffff is
+ * SDA stuck high. 0x0000 could be 0C, or SDA stuck low, so it
+ * has to be read twice in a row.
+ */
+static int temp_plausible(struct temper *temper, int16_t temp)
+{
+	int zero = temper->zero;
+
+	temper->zero = (temp == 0);
+	if (temp & 0x000f)
+		return 0;
+	return (temp != 0 || zero);
+}
+
+static void TEMPer_publish(struct usense_device *dev, int16_t temp)
+{
+	/* temp is in 1/256 C; the reading is in Kelvin */
+	char buff[48];
+	double kelvin = C_TO_K(temp / 256.0);
+
+	snprintf(buff, sizeof(buff), "%g", kelvin);
+	usense_prop_set(dev, "reading", buff);
+}
+
+static int TEMPer_on_prop_set(struct usense_device *dev, void *priv, const char *key, const char *val)
 {
-	int16_t temp;
 	struct temper *temper = priv;
-	int err;
+	unsigned long ul;
+	char *tmp;
 
-	/* Reset device */
-	temp_reset(&temper->adap);
+	if (strcmp(key, "TEMPer.settle_us") != 0 || temper->native)
+		return -EINVAL;
 
-	/* Dump temp */
-	err = temp_read(&temper->adap, REG_TEMP, &temp);
-	if (err < 0) {
-		fprintf(stderr, "%s: Can't read temperature\n", usense_device_name(dev));
+	ul = strtoul(val, &tmp, 0);
+	if (tmp == val || *tmp != 0 || val[0] == '-' || ul > TEMPER_SETTLE_MAX)
 		return -EINVAL;
-	} else {
-		/* microKelvin */
-		char buff[48];
-		double kelvin = C_TO_K(temp / 256.0);
-		snprintf(buff, sizeof(buff), "%g", kelvin);
-		usense_prop_set(dev, "reading", buff);
-	}
 
+	/* Picked up by the next update */
+	__atomic_store_n(&temper->settle_us, ul, __ATOMIC_RELAXED);
 	return 0;
 }
 
-static int TEMPer_attach(struct usense_device *dev, struct usb_dev_handle *usb, void **priv)
+static int TEMPer_open_bus(struct temper *temper);
+static void TEMPer_close_bus(struct temper *temper);
+
+/* Before retrying a read */
+static int TEMPer_recover(struct usense_device *dev, struct temper *temper)
 {
-	/* Connect to ch341 */
 	int err;
-	struct temper *temper;
-	struct ch341 *ch;
-	uint8_t cfg;
+
+	usense_device_retry(dev);
+
+	/* Also if the last re-open failed */
+	if (temper->failures % TEMPER_REOPEN == 0 || temper->adap.algo_data == NULL) {
+		TEMPer_close_bus(temper);
+		err = TEMPer_open_bus(temper);
+		if (err < 0) {
+			fprintf(stderr, "%s: Can't re-open the CH341\n", usense_device_name(dev));
+			return err;
+		}
+	}
+
+	/* The I2C engine frames every transfer itself */
+	if (!temper->native)
+		temp_reset(&temper->adap);
+
+	return 0;
+}
+
+static int TEMPer_update(struct usense_device *dev, void *priv)
+{
+	struct temper *temper = priv;
 	int16_t temp;
+	int err, i;
+
+	if (temper->ch != NULL)
+		ch341_set_settle(temper->ch, __atomic_load_n(&temper->settle_us, __ATOMIC_RELAXED));
+
+	for (i = 0; i < TEMPER_TRIES; i++) {
+		if (temper->failures > 0) {
+			err = TEMPer_recover(dev, temper);
+			if (err < 0)
+				return err;
+		}
+
+		err = temp_read(&temper->adap, REG_TEMP, &temp);
+		if (err >= 0 && temp_plausible(temper, temp)) {
+			temper->failures = 0;
+			TEMPer_publish(dev, temp);
+			return 0;
+		}
+
+		temper->failures++;
+	}
 
-	ch = ch341_open(usb);
+	fprintf(stderr, "%s: Can't read temperature\n", usense_device_name(dev));
+	return -EIO;
+}
+
+/* Bit-bang the bus through the modem lines */
+static int TEMPer_add_bit_bus(struct temper *temper)
+{
+	struct ch341 *ch;
+
+	ch = ch341_open(temper->usb);
 	if (ch == NULL) {
 		return -ENODEV;
 	}
 
-	temper = calloc(1, sizeof(*temper));
 	temper->ch = ch;
 
 	temper->i2c_bit.data = ch;
@@ -234,42 +324,121 @@ static int TEMPer_attach(struct usense_device *dev, struct usb_dev_handle *usb,
 	temper->i2c_bit.setscl = temper_setscl;
 	temper->i2c_bit.getsda = temper_getsda;
 	temper->i2c_bit.getscl = NULL;
-	temper->i2c_bit.udelay = 50;	/* in ms */
+	temper->i2c_bit.flush = temper_flush;
+	/* Each line change is a USB round trip, far slower than
+	 * the LM75's bit time, so don't wait on top of that.
+	 */
+	temper->i2c_bit.udelay = 0;	/* in us */
 	temper->i2c_bit.timeout = 1000;	/* in ms */
 
-	temper->adap.timeout = 1000;
-	temper->adap.retries = 3;
+	/* Only wait on the line changes where SDA is sampled */
+	ch341_set_queued(ch, 1);
+	ch341_set_settle(ch, __atomic_load_n(&temper->settle_us, __ATOMIC_RELAXED));
+
 	strncpy(&temper->adap.name[0], "ch341-i2c", sizeof(temper->adap.name));
 	temper->adap.algo_data = &temper->i2c_bit;
 	i2c_bit_add_bus(&temper->adap);
 
-	/* Reset device */
-	temp_reset(&temper->adap);
+	return 0;
+}
 
-	/* Read config */
+static int TEMPer_open_bus(struct temper *temper)
+{
+	temper->adap.timeout = 1000;
+	temper->adap.retries = 3;
+
+	if (temper->native) {
+		strncpy(&temper->adap.name[0], "ch341-stream", sizeof(temper->adap.name));
+		return i2c_ch341_add_bus(&temper->adap, temper->usb);
+	}
+
+	return TEMPer_add_bit_bus(temper);
+}
+
+static void TEMPer_close_bus(struct temper *temper)
+{
+	if (temper->ch != NULL) {
+		ch341_close(temper->ch);
+		temper->ch = NULL;
+	} else if (temper->adap.algo_data != NULL) {
+		i2c_ch341_del_bus(&temper->adap);
+	}
+	temper->adap.algo_data = NULL;
+}
+
+static void TEMPer_release(void *priv)
+{
+	struct temper *temper = priv;
+
+	TEMPer_close_bus(temper);
+	free(temper);
+}
+
+static int TEMPer_attach(struct usense_device *dev, libusb_device_handle *usb, void **priv)
+{
+	/* Connect to ch341 */
+	int err;
+	struct temper *temper;
+	uint8_t cfg;
+	char product[8];
+
+	temper = calloc(1, sizeof(*temper));
+	if (temper == NULL) {
+		return -ENOMEM;
+	}
+
+	temper->usb = usb;
+
+	/* Only a CH341 in its I2C mode has the I2C engine.
+	 * Otherwise, fall back to bit-banging.
+	 */
+	product[0] = 0;
+	usense_prop_get(dev, "usb.product", product, sizeof(product));
+	temper->native = (strtoul(product, NULL, 16) == CH341_I2C_PRODUCT);
+
+	err = TEMPer_open_bus(temper);
+	if (err < 0) {
+		free(temper);
+		return err;
+	}
+
+	/* Read config. The bus is usually idle, so only
+	 * reset the device if that fails.
+	 */
 	cfg = 0;
 	err = temp_cfg_read(&temper->adap, &cfg);
+	if (err < 0) {
+		usense_device_retry(dev);
+		if (!temper->native)
+			temp_reset(&temper->adap);
+		err = temp_cfg_read(&temper->adap, &cfg);
+	}
 	if (err < 0) {
 		fprintf(stderr, "%s: Can't get current configuration.\n", usense_device_name(dev));
-		ch341_close(ch);
+		TEMPer_release(temper);
 		return -EINVAL;
 	}
 
+	/* Already in 12 bit mode? Nothing to write. */
 	if (cfg != 0x60) {
 		err = temp_cfg_write(&temper->adap, 0x60);
 	}
 	if (err < 0) {
 		fprintf(stderr, "%s: Can't configure 12bit resolution\n", usense_device_name(dev));
-		ch341_close(ch);
+		TEMPer_release(temper);
 		return -EINVAL;
 	} else {
 		usense_prop_set(dev, "TEMPer.resolution","12");
 	}
 
 	/* Set the device and type */
+	if (!temper->native)
+		usense_prop_set(dev, "TEMPer.settle_us", "0");
+	usense_prop_set(dev, "TEMPer.bus", temper->adap.name);
 	usense_prop_set(dev, "device", "TEMPer");
 	usense_prop_set(dev, "type", "temp");
 
+	/* The config read just worked, so no need for a reset */
 	TEMPer_update(dev, temper);
 
 	*priv = temper;
@@ -277,16 +446,16 @@ static int TEMPer_attach(struct usense_device *dev, struct usb_dev_handle *usb,
 	return 0;
 }
 
-static void TEMPer_release(void *priv)
+static int TEMPer_match(struct libusb_device_descriptor *desc)
 {
-	struct temper *temper = priv;
-
-	ch341_close(temper->ch);
-	free(temper);
-}
+	/* A CH341 in I2C mode is usually a generic programmer, with
+	 * no LM75 behind it, so only claim it if asked to.
+	 */
+	if ((desc->idVendor == 0x4348 || desc->idVendor == 0x1a86) &&
+	    desc->idProduct == CH341_I2C_PRODUCT &&
+	    desc->bNumConfigurations == 1)
+		return getenv("USENSE_CH341_I2C") != NULL;
 
-static int TEMPer_match(struct usb_device_descriptor *desc)
-{
 	return (desc->idVendor == 0x4348 &&
 		desc->idProduct == 0x5523 &&
 		desc->iManufacturer == 0 &&
@@ -300,4 +469,5 @@ const struct usense_probe _usense_probe_TEMPer = {
 	.probe = { .usb = { .match = TEMPer_match, .attach = TEMPer_attach, } },
 	.release = TEMPer_release,
 	.update = TEMPer_update,
+	.on_prop_set = TEMPer_on_prop_set,
 };
@@ -24,8 +24,9 @@
 #include <unistd.h>
 #include <stdint.h>
 
-#include <usb.h>
+#include <libusb.h>
 
+#include "usense-usb.h"
 #include "ch341.h"
 
 #define DEFAULT_BAUD_RATE 9600
@@ -62,11 +63,15 @@
 #define CH341_BAUDBASE_DIVMAX 3
 
 struct ch341 {
-	struct usb_dev_handle *dev;
+	libusb_device_handle *dev;
 	unsigned baud_rate; /* set baud rate */
 	uint8_t line_control; /* set line control value RTS/DTR */
 	uint8_t line_status; /* active status of modem control inputs */
 	uint8_t multi_status_change; /* status changed multiple since last call */
+	uint8_t line_unknown; /* last line_control write failed */
+	unsigned int settle_us; /* extra wait after a modem line change */
+	int queued; /* queue line changes, see ch341_set_queued() */
+	struct usense_usb_queue queue;
 };
 
 static int ch341_control_out(struct ch341 *priv, uint8_t request,
@@ -74,11 +79,10 @@ static int ch341_control_out(struct ch341 *priv, uint8_t request,
 {
 	int r;
 
-	r = usb_control_msg(priv->dev,
-			    USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT,
-			    request,
-			    value, index, NULL, 0, DEFAULT_TIMEOUT);
-	usleep(100);
+	r = usense_usb_control(priv->dev,
+			       LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+			       request,
+			       value, index, NULL, 0, DEFAULT_TIMEOUT);
 	return r;
 }
 
@@ -88,11 +92,10 @@ static int ch341_control_in(struct ch341 *priv,
 {
 	int r;
 
-	r = usb_control_msg(priv->dev,
-			    USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN,
-			    request,
-			    value, index, buf, bufsize, DEFAULT_TIMEOUT);
-	usleep(100);
+	r = usense_usb_control(priv->dev,
+			       LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN,
+			       request,
+			       value, index, buf, bufsize, DEFAULT_TIMEOUT);
 	return r;
 }
 
@@ -127,9 +130,25 @@ static int ch341_set_baudrate(struct ch341 *priv)
 	return r;
 }
 
+/* The control transfer only completes once the chip has taken
+ * the request, so the lines are already driven when it returns.
+ * Slow wiring (long leads, weak pull-ups) may want to wait a little
+ * longer before the next sample, see ch341_set_settle().
+ */
 static int ch341_set_handshake(struct ch341 *priv, uint8_t control)
 {
-	return ch341_control_out(priv, 0xa4, ~control, 0);
+	int r;
+
+	/* A settle time has to follow the change itself */
+	if (priv->queued && !priv->settle_us)
+		return usense_usb_control_queue(&priv->queue,
+						LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+						0xa4, ~control, 0, NULL, 0, DEFAULT_TIMEOUT);
+
+	r = ch341_control_out(priv, 0xa4, ~control, 0);
+	if (r >= 0 && priv->settle_us)
+		usense_usb_delay(priv->settle_us);
+	return r;
 }
 
 static int ch341_get_status(struct ch341 *priv)
@@ -207,12 +226,15 @@ out:
 	return r;
 }
 
-static struct ch341 *ch341_acquire(struct usb_dev_handle *usb)
+static struct ch341 *ch341_acquire(libusb_device_handle *usb)
 {
 	struct ch341 *priv;
 
 	priv = calloc(1, sizeof(*priv));
+	if (priv == NULL)
+		return NULL;
 	priv->dev = usb;
+	priv->queue.usb = usb;
 	return priv;
 }
 
@@ -223,6 +245,9 @@ static void ch341_release(struct ch341 *priv)
 
 void ch341_close(struct ch341 *priv)
 {
+	ch341_flush(priv);
+	priv->queued = 0;
+
 	/* drop DTR and RTS */
 	priv->line_control = 0;
 	ch341_set_handshake(priv, 0);
@@ -231,7 +256,7 @@ void ch341_close(struct ch341 *priv)
 
 
 /* open this device, set default parameters */
-struct ch341 *ch341_open(struct usb_dev_handle *usb)
+struct ch341 *ch341_open(libusb_device_handle *usb)
 {
 	struct ch341 *priv;
 	int r;
@@ -244,31 +269,13 @@ struct ch341 *ch341_open(struct usb_dev_handle *usb)
 	priv->baud_rate = DEFAULT_BAUD_RATE;
 	priv->line_control = CH341_BIT_RTS | CH341_BIT_DTR;
 
+	/* This already ends with the baud rate and handshake set */
 	r = ch341_configure(priv);
 	if (r < 0) {
 		ch341_release(priv);
 		return NULL;
 	}
 
-
-	priv->baud_rate = DEFAULT_BAUD_RATE;
-	priv->line_control = CH341_BIT_RTS | CH341_BIT_DTR;
-
-	r = ch341_configure(priv);
-	if (r)
-		goto out;
-
-	r = ch341_set_handshake(priv, priv->line_control);
-	if (r)
-		goto out;
-
-	r = ch341_set_baudrate(priv);
-out:
-	if (r) {
-		ch341_close(priv);
-		return NULL;
-	}
-
 	return priv;
 }
 
@@ -302,23 +309,75 @@ void ch341_set_termios(struct ch341 *priv, struct termios *termios, struct termi
 	 */
 }
 
+void ch341_set_settle(struct ch341 *priv, unsigned int usec)
+{
+	priv->settle_us = usec;
+}
+
+/* Queued line changes are sent back to back, without waiting
+ * for each to complete. They are applied in order, and
+ * ch341_tiocmget() waits for them all before it samples.
+ */
+void ch341_set_queued(struct ch341 *priv, int queued)
+{
+	if (!queued)
+		ch341_flush(priv);
+	priv->queued = queued;
+}
+
+int ch341_flush(struct ch341 *priv)
+{
+	int r;
+
+	r = usense_usb_flush(&priv->queue);
+	if (r < 0)
+		priv->line_unknown = 1;
+
+	return r;
+}
+
+static uint8_t ch341_control_bits(unsigned int val)
+{
+	return ((val & TIOCM_RTS) ? CH341_BIT_RTS : 0) |
+	       ((val & TIOCM_DTR) ? CH341_BIT_DTR : 0);
+}
+
+/* DTR and RTS are outputs, so line_control is their state and
+ * they can be changed without reading anything back. Nothing is
+ * sent if they already have the requested levels.
+ */
+static int ch341_update_lines(struct ch341 *priv, uint8_t control)
+{
+	int r;
+
+	if (control == priv->line_control && !priv->line_unknown)
+		return 0;
+
+	priv->line_control = control;
+	r = ch341_set_handshake(priv, control);
+	priv->line_unknown = (r < 0);
+
+	return r;
+}
+
 int ch341_tiocmset(struct ch341 *priv, unsigned int val)
 {
 	uint8_t control;
 
-	if (val & TIOCM_RTS)
-		priv->line_control |= CH341_BIT_RTS;
-	else
-		priv->line_control &= ~CH341_BIT_RTS;
+	control = priv->line_control & ~(CH341_BIT_RTS | CH341_BIT_DTR);
+	control |= ch341_control_bits(val);
 
-	if (val & TIOCM_DTR)
-		priv->line_control |= CH341_BIT_DTR;
-	else
-		priv->line_control &= ~CH341_BIT_DTR;
+	return ch341_update_lines(priv, control);
+}
 
-	control = priv->line_control;
+int ch341_tiocmbis(struct ch341 *priv, unsigned int val)
+{
+	return ch341_update_lines(priv, priv->line_control | ch341_control_bits(val));
+}
 
-	return ch341_set_handshake(priv, control);
+int ch341_tiocmbic(struct ch341 *priv, unsigned int val)
+{
+	return ch341_update_lines(priv, priv->line_control & ~ch341_control_bits(val));
 }
 
 static void ch341_poll(struct ch341 *priv)
@@ -326,7 +385,7 @@ static void ch341_poll(struct ch341 *priv)
 	char data[256];
 	int status;
 
-	status = usb_interrupt_read(priv->dev, 0x81, data, sizeof(data), 1);
+	status = usense_usb_interrupt(priv->dev, 0x81, data, sizeof(data), 1);
 	if (status >= 4) {
 		priv->line_status = (~(data[2])) & CH341_BITS_MODEM_STAT;
 	}
@@ -338,6 +397,8 @@ int ch341_tiocmget(struct ch341 *priv)
 	uint8_t status;
 	unsigned int result;
 
+	/* The inputs have to see the outputs' latest state */
+	ch341_flush(priv);
 	ch341_poll(priv);
 	mcr = priv->line_control;
 	status = priv->line_status;
@@ -43,12 +43,19 @@
 
 struct ch341;
 
-struct ch341 *ch341_open(struct usb_dev_handle *usb);
+struct ch341 *ch341_open(struct libusb_device_handle *usb);
 void ch341_close(struct ch341 *priv);
 
 void ch341_set_termios(struct ch341 *priv, struct termios *termios, struct termios *old_termios);
 
+void ch341_set_settle(struct ch341 *priv, unsigned int usec);
+void ch341_set_queued(struct ch341 *priv, int queued);
+int ch341_flush(struct ch341 *priv);
+
+/* Only ch341_tiocmget() reads from the device, to sample the inputs */
 int ch341_tiocmset(struct ch341 *priv, unsigned int val);
+int ch341_tiocmbis(struct ch341 *priv, unsigned int val);
+int ch341_tiocmbic(struct ch341 *priv, unsigned int val);
 int ch341_tiocmget(struct ch341 *priv);
 
 #endif /* CH341_H */
@@ -17,14 +17,28 @@
 #include <strings.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
-#include <usb.h>
+#include <libusb.h>
 
 #include "usense.h"
+#include "usense-usb.h"
 #include "units.h"
 
 struct gotemp {
-	usb_dev_handle *usb;
+	libusb_device_handle *usb;
+
+	/* The Go!Temp streams packets on its own, so we keep an
+	 * interrupt transfer in flight, and update() takes the
+	 * newest one.
+	 */
+	struct libusb_transfer *xfer;
+	pthread_mutex_t lock;
+	int fresh;		/* A packet arrived since the last update() */
+	int stopped;		/* 'xfer' is no longer in flight */
+	int cancel;		/* ..and shouldn't be */
+	int err;		/* Why it stopped */
+	int16_t measurement;	/* From the newest packet */
 
 	/* This is close to the structure I found in Greg's Code
 	 * NOTE: This is in little endian format!
@@ -43,9 +57,52 @@ static int gotemp_on_prop_set(struct usense_device *dev, void *priv, const char
 	return -EINVAL;
 }
 
+static void LIBUSB_CALL gotemp_packet(struct libusb_transfer *xfer)
+{
+	struct gotemp *gotemp = xfer->user_data;
+	int err, len;
+
+	len = usense_usb_status(xfer);
+
+	pthread_mutex_lock(&gotemp->lock);
+	if (len == sizeof(gotemp->packet)) {
+		gotemp->measurement = gotemp->packet.measurement0;
+		gotemp->fresh = 1;
+	}
+
+	/* Timeouts and short packets are harmless, resubmit.
+	 * Anything else (a stall, an overflow, an I/O error) would
+	 * only fail again, so stop and report it.
+	 */
+	err = (len >= 0 || len == -ETIMEDOUT) ? 0 : len;
+	if (err == 0 && !gotemp->cancel)
+		err = usense_usb_submit(xfer);
+	if (err < 0 || gotemp->cancel) {
+		gotemp->err = (err < 0) ? err : -ECANCELED;
+		gotemp->stopped = 1;
+	}
+	pthread_mutex_unlock(&gotemp->lock);
+}
+
 void gotemp_release(void *priv)
 {
 	struct gotemp *gotemp = priv;
+	int stopped;
+
+	if (gotemp->xfer != NULL) {
+		pthread_mutex_lock(&gotemp->lock);
+		gotemp->cancel = 1;
+		stopped = gotemp->stopped;
+		pthread_mutex_unlock(&gotemp->lock);
+
+		if (!stopped) {
+			usense_usb_cancel(gotemp->xfer);
+			usense_usb_wait(&gotemp->stopped, 0);
+		}
+		libusb_free_transfer(gotemp->xfer);
+	}
+
+	pthread_mutex_destroy(&gotemp->lock);
 	free(gotemp);
 }
 
@@ -57,30 +114,40 @@ int gotemp_update(struct usense_device *dev, void *priv)
 	struct gotemp *gotemp = priv;
 	double kelvin;
 	char buff[64];
-	int len;
+	int16_t measurement = 0;
+	int err;
 
 	assert(sizeof(gotemp->packet) == 8);
 
-	do {
-		len = usb_interrupt_read(gotemp->usb, 0x81, (void *)&gotemp->packet, sizeof(gotemp->packet), 1000);
-		if (len < 0 || len != sizeof(gotemp->packet)) {
-			if (len == -EAGAIN) {
-				continue;
-			}
-			return -EINVAL;
-		}
-	} while (0);
+	pthread_mutex_lock(&gotemp->lock);
+	err = gotemp->stopped ? gotemp->err : 0;
+	pthread_mutex_unlock(&gotemp->lock);
+	if (err < 0)
+		return err;
+
+	/* Nothing new since last time? Wait for the next packet. */
+	usense_usb_wait(&gotemp->fresh, 1000);
+
+	pthread_mutex_lock(&gotemp->lock);
+	if (gotemp->fresh) {
+		measurement = gotemp->measurement;
+		gotemp->fresh = 0;
+	} else {
+		err = gotemp->stopped ? gotemp->err : -ETIMEDOUT;
+	}
+	pthread_mutex_unlock(&gotemp->lock);
+	if (err < 0)
+		return err;
 
-	kelvin = C_TO_K(((double) gotemp->packet.measurement0) * conversion);
+	kelvin = C_TO_K(((double) measurement) * conversion);
 	snprintf(buff, sizeof(buff), "%g", kelvin);
 	return usense_prop_set(dev, "reading", buff);
 }
 
-static int gotemp_attach(struct usense_device *dev, struct usb_dev_handle *usb, void **priv)
+static int gotemp_attach(struct usense_device *dev, libusb_device_handle *usb, void **priv)
 {
 	int err;
 	struct gotemp *gotemp;
-	char buff[USENSE_PROP_MAX];
 
 	gotemp = calloc(1, sizeof(*gotemp));
 	if (gotemp == NULL) {
@@ -88,14 +155,31 @@ static int gotemp_attach(struct usense_device *dev, struct usb_dev_handle *usb,
 	}
 
 	gotemp->usb = usb;
+	pthread_mutex_init(&gotemp->lock, NULL);
+
+	gotemp->xfer = libusb_alloc_transfer(0);
+	if (gotemp->xfer == NULL) {
+		gotemp_release(gotemp);
+		return -ENOMEM;
+	}
+
+	libusb_fill_interrupt_transfer(gotemp->xfer, usb, 0x81,
+				       (void *)&gotemp->packet, sizeof(gotemp->packet),
+				       gotemp_packet, gotemp, 0);
+	err = usense_usb_submit(gotemp->xfer);
+	if (err < 0) {
+		gotemp->stopped = 1;
+		gotemp_release(gotemp);
+		return err;
+	}
 
 	/* Set the device and type */
 	usense_prop_set(dev, "device", "gotemp");
 	usense_prop_set(dev, "type", "temp");
 
-	/* Do a dummy update first */
-	gotemp_update(dev, gotemp);
-
+	/* The transfer is already in flight, so this is
+	 * the first packet the device sends.
+	 */
 	err = gotemp_update(dev, gotemp);
 	if (err < 0) {
 		gotemp_release(gotemp);
@@ -106,7 +190,7 @@ static int gotemp_attach(struct usense_device *dev, struct usb_dev_handle *usb,
 	return 0;
 }
 
-static int gotemp_match(struct usb_device_descriptor *desc)
+static int gotemp_match(struct libusb_device_descriptor *desc)
 {
 	return (desc->idVendor == 0x08f7 &&
 		desc->idProduct == 0x0002 &&
@@ -513,7 +513,7 @@ static int bit_xfer(struct i2c_adapter *i2c_adap,
 {
 	struct i2c_msg *pmsg;
 	struct i2c_algo_bit_data *adap = i2c_adap->algo_data;
-	int i, ret;
+	int i, ret, err;
 	unsigned short nak_ok;
 
 	bit_dbg(3, &i2c_adap->dev, "emitting start condition\n");
@@ -564,6 +564,11 @@ static int bit_xfer(struct i2c_adapter *i2c_adap,
 bailout:
 	bit_dbg(3, &i2c_adap->dev, "emitting stop condition\n");
 	i2c_stop(adap);
+	if (adap->flush != NULL) {
+		err = adap->flush(adap->data);
+		if (err < 0 && ret >= 0)
+			ret = err;
+	}
 	return ret;
 }
 
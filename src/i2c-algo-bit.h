@@ -37,6 +37,13 @@ struct i2c_algo_bit_data {
 	int  (*getsda) (void *data);
 	int  (*getscl) (void *data);
 
+	/* Optional. Adapters may queue setsda/setscl changes, as long
+	 * as getsda/getscl see them all applied first. This waits for
+	 * the rest at the end of each transfer, and returns -errno if
+	 * any of them failed.
+	 */
+	int  (*flush) (void *data);
+
 	/* local settings */
 	int udelay;		/* half clock cycle time in us,
 				   minimum 2 us for fast-mode I2C,
@@ -0,0 +1,273 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libusb.h>
+
+#include "usense-usb.h"
+#include "i2c.h"
+#include "i2c-ch341.h"
+
+#define CH341_I2C_EP_OUT	(LIBUSB_ENDPOINT_OUT | 2)
+#define CH341_I2C_EP_IN		(LIBUSB_ENDPOINT_IN | 2)
+#define CH341_I2C_TIMEOUT	1000	/* ms */
+
+/* Stream commands are sent in 32 byte packets. Each packet
+ * starts with CH341_CMD_I2C_STREAM, and runs to CH341_I2C_END
+ * or to the end of the packet.
+ */
+#define CH341_I2C_PACKET	32
+#define CH341_I2C_PACKETS	8	/* Most we send in one transaction */
+#define CH341_I2C_IN_MAX	(CH341_I2C_PACKET * CH341_I2C_PACKETS)	/* ..and read back */
+#define CH341_I2C_CHUNK		29	/* Most bytes per OUT or IN command */
+
+#define CH341_CMD_I2C_STREAM	0xaa
+
+#define CH341_I2C_STA		0x74	/* START */
+#define CH341_I2C_STO		0x75	/* STOP */
+#define CH341_I2C_OUT		0x80	/* | n: write n bytes. With n = 0, write
+					 * one byte, and return its ACK */
+#define CH341_I2C_IN		0xc0	/* | n: read n bytes, ACKing each. With
+					 * n = 0, read one byte and NAK it */
+#define CH341_I2C_SET		0x60	/* | speed */
+#define CH341_I2C_END		0x00
+
+#define CH341_I2C_100KHZ	0x01
+#define CH341_I2C_NAK		0x80	/* In the byte an OUT returns */
+
+struct ch341_i2c {
+	libusb_device_handle *usb;
+	uint8_t out[CH341_I2C_PACKET * CH341_I2C_PACKETS];
+	int len;		/* Bytes in out[] */
+	int in;			/* ..and to read back */
+};
+
+static void ch341_i2c_begin(struct ch341_i2c *ch)
+{
+	ch->len = 0;
+	ch->in = 0;
+}
+
+/* Append a command, starting a new packet if it won't fit
+ * in this one with its END.
+ */
+static int ch341_i2c_cmd(struct ch341_i2c *ch, const uint8_t *cmd, int n)
+{
+	int used = ch->len % CH341_I2C_PACKET;
+
+	if (used == 0 || used + n + 1 > CH341_I2C_PACKET) {
+		if (used != 0) {
+			memset(&ch->out[ch->len], CH341_I2C_END, CH341_I2C_PACKET - used);
+			ch->len += CH341_I2C_PACKET - used;
+		}
+		if (ch->len + 1 + n + 1 > sizeof(ch->out))
+			return -E2BIG;
+		ch->out[ch->len++] = CH341_CMD_I2C_STREAM;
+	}
+
+	memcpy(&ch->out[ch->len], cmd, n);
+	ch->len += n;
+
+	return 0;
+}
+
+static int ch341_i2c_cmd1(struct ch341_i2c *ch, uint8_t cmd)
+{
+	return ch341_i2c_cmd(ch, &cmd, 1);
+}
+
+/* Account for 'n' more bytes coming back */
+static int ch341_i2c_expect(struct ch341_i2c *ch, int n)
+{
+	if (ch->in + n > CH341_I2C_IN_MAX)
+		return -E2BIG;
+	ch->in += n;
+	return 0;
+}
+
+/* There is always room for this, see ch341_i2c_cmd() */
+static void ch341_i2c_end(struct ch341_i2c *ch)
+{
+	ch->out[ch->len++] = CH341_I2C_END;
+}
+
+/* Send the commands, and read back 'ch->in' bytes */
+static int ch341_i2c_run(struct ch341_i2c *ch, uint8_t *in)
+{
+	int err, got;
+
+	err = usense_usb_bulk(ch->usb, CH341_I2C_EP_OUT, ch->out, ch->len, CH341_I2C_TIMEOUT);
+	if (err < 0)
+		return err;
+	if (err != ch->len)
+		return -EIO;
+
+	for (got = 0; got < ch->in; got += err) {
+		err = usense_usb_bulk(ch->usb, CH341_I2C_EP_IN, &in[got], ch->in - got, CH341_I2C_TIMEOUT);
+		if (err < 0)
+			return err;
+		if (err == 0)
+			return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+/* The whole transaction, START to STOP, as one set of commands */
+static int ch341_i2c_build(struct ch341_i2c *ch, struct i2c_msg *msgs, int num)
+{
+	uint8_t cmd[CH341_I2C_CHUNK + 1];
+	struct i2c_msg *msg;
+	int err, i, j, n;
+
+	ch341_i2c_begin(ch);
+
+	err = ch341_i2c_cmd1(ch, CH341_I2C_SET | CH341_I2C_100KHZ);
+
+	for (i = 0; i < num && err == 0; i++) {
+		msg = &msgs[i];
+
+		/* Address, with its ACK returned */
+		err = ch341_i2c_cmd1(ch, CH341_I2C_STA);
+		cmd[0] = CH341_I2C_OUT;
+		cmd[1] = (msg->addr << 1) | ((msg->flags & I2C_M_RD) ? 1 : 0);
+		if (err == 0)
+			err = ch341_i2c_cmd(ch, cmd, 2);
+		if (err == 0)
+			err = ch341_i2c_expect(ch, 1);
+
+		if (msg->flags & I2C_M_RD) {
+			/* ACK all but the last byte */
+			for (j = 0; j + 1 < msg->len && err == 0; j += n) {
+				n = msg->len - 1 - j;
+				if (n > CH341_I2C_CHUNK)
+					n = CH341_I2C_CHUNK;
+				err = ch341_i2c_cmd1(ch, CH341_I2C_IN | n);
+				if (err == 0)
+					err = ch341_i2c_expect(ch, n);
+			}
+			if (msg->len > 0 && err == 0) {
+				err = ch341_i2c_cmd1(ch, CH341_I2C_IN);
+				if (err == 0)
+					err = ch341_i2c_expect(ch, 1);
+			}
+		} else {
+			for (j = 0; j < msg->len && err == 0; j += n) {
+				n = msg->len - j;
+				if (n > CH341_I2C_CHUNK)
+					n = CH341_I2C_CHUNK;
+				cmd[0] = CH341_I2C_OUT | n;
+				memcpy(&cmd[1], &msg->buf[j], n);
+				err = ch341_i2c_cmd(ch, cmd, n + 1);
+			}
+		}
+	}
+
+	if (err == 0)
+		err = ch341_i2c_cmd1(ch, CH341_I2C_STO);
+	if (err == 0)
+		ch341_i2c_end(ch);
+
+	return err;
+}
+
+static int ch341_i2c_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+	struct ch341_i2c *ch = adap->algo_data;
+	uint8_t in[CH341_I2C_IN_MAX];
+	int err, i, pos, tries;
+
+	for (i = 0; i < num; i++) {
+		if (msgs[i].flags & ~I2C_M_RD)
+			return -EOPNOTSUPP;
+	}
+
+	err = ch341_i2c_build(ch, msgs, num);
+	if (err < 0)
+		return err;
+
+	/* Retry if the slave didn't answer, as i2c-algo-bit does */
+	for (tries = 0; tries <= adap->retries; tries++) {
+		err = ch341_i2c_run(ch, in);
+		if (err < 0)
+			return err;
+
+		for (i = 0, pos = 0; i < num; i++) {
+			if (in[pos++] & CH341_I2C_NAK)
+				break;
+			if (msgs[i].flags & I2C_M_RD) {
+				memcpy(msgs[i].buf, &in[pos], msgs[i].len);
+				pos += msgs[i].len;
+			}
+		}
+		if (i == num)
+			return num;
+	}
+
+	return -EREMOTEIO;
+}
+
+static uint32_t ch341_i2c_func(struct i2c_adapter *adap)
+{
+	return I2C_FUNC_I2C;
+}
+
+static const struct i2c_algorithm ch341_i2c_algo = {
+	.master_xfer	= ch341_i2c_xfer,
+	.functionality	= ch341_i2c_func,
+};
+
+int i2c_ch341_add_bus(struct i2c_adapter *adap, libusb_device_handle *usb)
+{
+	struct ch341_i2c *ch;
+	int err;
+
+	ch = calloc(1, sizeof(*ch));
+	if (ch == NULL)
+		return -ENOMEM;
+
+	ch->usb = usb;
+
+	/* Set the bus speed. This doesn't prove there is an engine: a
+	 * chip in serial mode takes the bulk write as serial data.
+	 */
+	ch341_i2c_begin(ch);
+	ch341_i2c_cmd1(ch, CH341_I2C_SET | CH341_I2C_100KHZ);
+	ch341_i2c_end(ch);
+	err = ch341_i2c_run(ch, NULL);
+	if (err < 0) {
+		free(ch);
+		return err;
+	}
+
+	adap->algo = &ch341_i2c_algo;
+	adap->algo_data = ch;
+
+	return i2c_add_adapter(adap);
+}
+
+void i2c_ch341_del_bus(struct i2c_adapter *adap)
+{
+	free(adap->algo_data);
+	adap->algo_data = NULL;
+}
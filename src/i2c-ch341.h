@@ -0,0 +1,43 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef I2C_CH341_H
+#define I2C_CH341_H
+
+#include <libusb.h>
+
+#include "i2c.h"
+
+/* USB product ID of a CH341 strapped for its I2C (and EPP/SPI)
+ * mode. In its serial mode (0x5523) there is no I2C engine, and
+ * the bus has to be bit-banged through the modem lines.
+ */
+#define CH341_I2C_PRODUCT	0x5512
+
+/* I2C through the CH341's own I2C engine
+ *
+ * Each i2c_xfer() is one bulk write of stream commands, and
+ * one bulk read of whatever the slave returned, rather than a
+ * control transfer for every SCL and SDA edge.
+ */
+int i2c_ch341_add_bus(struct i2c_adapter *adap, libusb_device_handle *usb);
+void i2c_ch341_del_bus(struct i2c_adapter *adap);
+
+#endif /* I2C_CH341_H */
@@ -29,6 +29,8 @@
 
 #include <sys/time.h>
 
+#include "usense-usb.h"
+
 struct i2c_adapter;
 
 /**
@@ -129,7 +131,7 @@ static inline int i2c_add_adapter(struct i2c_adapter *adap) { return 0; }
 
 static inline void udelay(unsigned long delay)
 {
-	usleep(delay);
+	usense_usb_delay(delay);
 }
 
 #define KERN_WARNING	""
@@ -167,7 +169,7 @@ static inline int time_after_eq(unsigned long now, unsigned long finish)
 	return (now >= finish);
 }
 
-static inline void cond_resched(void) { usleep(100); }
-static inline void yield(void) { usleep(100); }
+static inline void cond_resched(void) { usense_usb_delay(100); }
+static inline void yield(void) { usense_usb_delay(100); }
 
 #endif /* I2C_H */
@@ -20,6 +20,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 
 #include "usense.h"
 
@@ -36,40 +43,31 @@ static int list_devices(struct usense *usense)
 	return 0;
 }
 
-static const char *nth_device(struct usense *usense, int n)
-{
-	struct usense_device *dev;
-	static char buff[PATH_MAX];
-	const char *cp = NULL;
-	const char *name;
-
-	for (name = usense_next(usense, NULL); name != NULL && n > 0; name = usense_next(usense, name), n--);
-
-	if (name != NULL) {
-		strncpy(buff, name, sizeof(buff));
-		buff[sizeof(buff)-1] = 0;
-		cp = buff;
-	}
-
-	return cp;
-}
-
-
 static int list_device_props(struct usense_device *dev)
 {
-	char value[PATH_MAX];
-	const char *key;
+	char *buff = NULL;
+	size_t len = 4096;
 	int err;
 
-	for (key = usense_prop_first(dev); key != NULL; key = usense_prop_next(dev, key)) {
-		err = usense_prop_get(dev, key, value, sizeof(value));
-		if (err < 0) {
-			continue;
+	do {
+		char *tmp;
+
+		tmp = realloc(buff, len);
+		if (tmp == NULL) {
+			free(buff);
+			return EXIT_FAILURE;
 		}
-		printf("%s=%s\n", key, value);
-	}
+		buff = tmp;
 
-	return EXIT_SUCCESS;
+		err = usense_prop_snapshot(dev, buff, len);
+		len *= 2;
+	} while (err == -ENOSPC);
+
+	if (err >= 0)
+		fputs(buff, stdout);
+	free(buff);
+
+	return (err < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int show_device_prop(struct usense_device *dev, const char *prop_name)
@@ -100,8 +98,403 @@ int set_device_prop(struct usense_device *dev, const char *prop_name, const char
 	return EXIT_SUCCESS;
 }
 
+/* Read the published snapshot - no USB access at all */
+static int show_shm(int argc, char **argv)
+{
+	struct usense_shm *shm;
+	struct usense_shm_reading r;
+	int i, id, n, err = EXIT_SUCCESS;
+	char *cp;
+
+	shm = usense_shm_open(NULL);
+	if (shm == NULL) {
+		fprintf(stderr, "%s: Can't open %s: %s\n", program, USENSE_SHM_PATH, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	n = usense_shm_devices(shm);
+
+	if (argc == 0) {
+		/* List all */
+		for (id = 0; id < n; id++) {
+			if (usense_shm_read(shm, id, &r) < 0 || r.status == -ENODEV)
+				continue;
+			if (r.status < 0)
+				printf("%s %s\n", r.device, strerror(-r.status));
+			else
+				printf("%s %s\n", r.device, r.reading);
+		}
+	}
+
+	for (i = 0; i < argc; i++) {
+		id = strtol(argv[i], &cp, 0);
+		if (*cp != 0) {
+			for (id = 0; id < n; id++) {
+				if (usense_shm_read(shm, id, &r) == 0 &&
+				    strcmp(r.device, argv[i]) == 0)
+					break;
+			}
+		}
+
+		if (id < 0 || id >= n || usense_shm_read(shm, id, &r) < 0 ||
+		    r.status == -ENODEV) {
+			fprintf(stderr, "%s: No such sensor '%s'\n", program, argv[i]);
+			err = EXIT_FAILURE;
+			continue;
+		}
+
+		if (r.status < 0) {
+			fprintf(stderr, "%s: %s\n", r.device, strerror(-r.status));
+			err = EXIT_FAILURE;
+			continue;
+		}
+
+		printf("%s\n", r.reading);
+	}
+
+	usense_shm_close(shm);
+
+	return err;
+}
+
+/* Sample every device in the background, and publish
+ * the readings for --shm, until we're told to stop.
+ */
+static int publish(struct usense *usense, const sigset_t *sigs)
+{
+	int err, sig;
+
+	usense_open_all(usense);
+
+	err = usense_shm_publish(usense, NULL);
+	if (err < 0) {
+		fprintf(stderr, "%s: Can't publish to %s: %s\n", program, USENSE_SHM_PATH, strerror(-err));
+		usense_stop(usense);
+		return EXIT_FAILURE;
+	}
+
+	sigwait(sigs, &sig);
+
+	usense_stop(usense);
+
+	return EXIT_SUCCESS;
+}
+
+/* Open the named devices, or all of them if none are named,
+ * for usense_read(). Returns how many, or -1.
+ */
+static int open_samples(struct usense *usense, int argc, char **argv, struct usense_sample **samplep)
+{
+	struct usense_sample *sample;
+	struct usense_device *dev;
+	const char *name;
+	int i, id, n = 0, max = argc;
+	char *cp;
+
+	if (argc == 0) {
+		usense_open_all(usense);
+		for (name = usense_next(usense, NULL); name != NULL; name = usense_next(usense, name))
+			max++;
+	}
+
+	sample = calloc(max + 1, sizeof(*sample));
+	if (sample == NULL)
+		return -1;
+
+	if (argc == 0) {
+		for (name = usense_next(usense, NULL); name != NULL && n < max; name = usense_next(usense, name)) {
+			dev = usense_open(usense, name);
+			if (dev != NULL)
+				sample[n++].dev = dev;
+		}
+	}
+
+	for (i = 0; i < argc; i++) {
+		dev = NULL;
+		name = argv[i];
+		id = strtol(name, &cp, 0);
+		if (*cp == 0)
+			dev = usense_open_id(usense, id);
+		if (dev == NULL)
+			dev = usense_open(usense, name);
+		if (dev == NULL) {
+			fprintf(stderr, "%s: No such sensor '%s'\n", program, name);
+			free(sample);
+			return -1;
+		}
+		sample[n++].dev = dev;
+	}
+
+	*samplep = sample;
+	return n;
+}
+
+/* Fixed size binary records, for pipelines
+ *
+ * See 'Binary stream format' in usense.h
+ */
+static int stream(struct usense *usense, int argc, char **argv)
+{
+	struct usense_stream_header hdr;
+	struct usense_stream_device desc;
+	struct usense_stream_record *rec = NULL;
+	struct usense_sample *sample = NULL;
+	struct timespec next, now;
+	unsigned long interval = USENSE_MONITOR_INTERVAL;
+	int i, n, err = EXIT_FAILURE;
+	char *cp;
+
+	if (argc > 0) {
+		interval = strtoul(argv[0], &cp, 0);
+		if (*cp != 0 || interval == 0) {
+			fprintf(stderr, "%s: Invalid interval '%s'\n", program, argv[0]);
+			goto out;
+		}
+	}
+
+	/* We sample on our own schedule */
+	usense_monitor_interval(usense, 0);
+
+	/* Any devices follow the interval */
+	n = open_samples(usense, (argc > 1) ? argc - 1 : 0, argv + 1, &sample);
+	if (n < 0)
+		goto out;
+
+	rec = calloc(n + 1, sizeof(*rec));
+	if (rec == NULL)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = USENSE_STREAM_MAGIC;
+	hdr.version = USENSE_STREAM_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.device_size = sizeof(desc);
+	hdr.record_size = sizeof(*rec);
+	hdr.devices = n;
+	hdr.interval_ms = interval;
+	fwrite(&hdr, sizeof(hdr), 1, stdout);
+
+	for (i = 0; i < n; i++) {
+		memset(&desc, 0, sizeof(desc));
+		desc.id = usense_device_id(sample[i].dev);
+		strncpy(desc.name, usense_device_name(sample[i].dev), sizeof(desc.name) - 1);
+		usense_prop_get(sample[i].dev, "device", desc.device, sizeof(desc.device));
+		usense_prop_get(sample[i].dev, "units", desc.units, sizeof(desc.units));
+		fwrite(&desc, sizeof(desc), 1, stdout);
+	}
+
+	if (fflush(stdout) != 0)
+		goto out;
+
+	if (n == 0) {
+		fprintf(stderr, "%s: No sensors to stream\n", program);
+		goto out;
+	}
+
+	/* A closed pipe is how the reader says it's done */
+	signal(SIGPIPE, SIG_IGN);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (;;) {
+		usense_read(usense, sample, n);
+
+		for (i = 0; i < n; i++) {
+			rec[i].id = usense_device_id(sample[i].dev);
+			rec[i].status = sample[i].status;
+			rec[i].mono_ns = sample[i].sampled_ns;
+			rec[i].real_ns = sample[i].timestamp.tv_sec * 1000000000ULL + sample[i].timestamp.tv_nsec;
+			rec[i].value = sample[i].value;
+		}
+
+		if (fwrite(rec, sizeof(*rec), n, stdout) != (size_t)n || fflush(stdout) != 0) {
+			if (errno == EPIPE)
+				err = EXIT_SUCCESS;
+			break;
+		}
+
+		/* Schedule from the previous deadline, so we
+		 * don't drift. If we've fallen behind, skip ahead.
+		 */
+		next.tv_sec += interval / 1000;
+		next.tv_nsec += (interval % 1000) * 1000000;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > next.tv_sec ||
+		    (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec))
+			next = now;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	}
+
+out:
+	free(sample);
+	free(rec);
+	usense_stop(usense);
+
+	return err;
+}
+
+/* Sample on a timer, one line per sample
+ *
+ * The timerfd is periodic, so the schedule doesn't drift with
+ * the time spent sampling. If we fall behind, missed periods
+ * are skipped.
+ */
+static int watch(struct usense *usense, int argc, char **argv)
+{
+	struct usense_sample *sample = NULL;
+	struct itimerspec its;
+	unsigned long interval;
+	uint64_t expired;
+	char units[USENSE_PROP_MAX], when[32];
+	struct tm tm;
+	int i, n, fd = -1, err = EXIT_FAILURE;
+	char *cp;
+
+	interval = (argc > 0) ? strtoul(argv[0], &cp, 0) : 0;
+	if (argc < 1 || *cp != 0 || interval == 0) {
+		fprintf(stderr, "%s: Usage: --watch <msec> [device...]\n", program);
+		goto out;
+	}
+
+	/* We sample on our own schedule */
+	usense_monitor_interval(usense, 0);
+
+	n = open_samples(usense, argc - 1, argv + 1, &sample);
+	if (n <= 0) {
+		if (n == 0)
+			fprintf(stderr, "%s: No sensors to watch\n", program);
+		goto out;
+	}
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: timerfd: %s\n", program, strerror(errno));
+		goto out;
+	}
+
+	its.it_interval.tv_sec = interval / 1000;
+	its.it_interval.tv_nsec = (interval % 1000) * 1000000;
+	its.it_value.tv_sec = 0;
+	its.it_value.tv_nsec = 1;	/* First sample now */
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		fprintf(stderr, "%s: timerfd: %s\n", program, strerror(errno));
+		goto out;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		if (read(fd, &expired, sizeof(expired)) != sizeof(expired)) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		usense_read(usense, sample, n);
+
+		for (i = 0; i < n; i++) {
+			gmtime_r(&sample[i].timestamp.tv_sec, &tm);
+			strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+			if (sample[i].status < 0) {
+				printf("%s %s error: %s\n", (sample[i].timestamp.tv_sec == 0) ? "-" : when,
+				       usense_device_name(sample[i].dev), strerror(-sample[i].status));
+				continue;
+			}
+
+			if (usense_prop_get(sample[i].dev, "units", units, sizeof(units)) < 0)
+				units[0] = 0;
+			printf("%s.%03ldZ %s %g %s\n", when, sample[i].timestamp.tv_nsec / 1000000,
+			       usense_device_name(sample[i].dev), sample[i].value, units);
+		}
+
+		if (fflush(stdout) != 0) {
+			if (errno == EPIPE)
+				err = EXIT_SUCCESS;
+			break;
+		}
+	}
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(sample);
+	usense_stop(usense);
+
+	return err;
+}
+
+/* Ask usensed, in one round trip */
+static int client_main(struct usense_client *client, int argc, char **argv)
+{
+	char buff[USENSE_PROP_MAX];
+	int i, n, err = EXIT_SUCCESS;
+	char *cp;
+
+	if (argc == 1) {
+		usense_client_request(client, "list");
+	} else if (argc == 2) {
+		usense_client_request(client, "snapshot %s", argv[1]);
+	} else {
+		for (i = 2; i < argc; i++) {
+			cp = strchr(argv[i], '=');
+			if (cp == NULL)
+				usense_client_request(client, "get %s %s", argv[1], argv[i]);
+			else
+				usense_client_request(client, "set %s %.*s %s", argv[1],
+						      (int)(cp - argv[i]), argv[i], cp + 1);
+		}
+	}
+
+	if (usense_client_flush(client) < 0) {
+		fprintf(stderr, "%s: Lost usensed: %s\n", program, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	for (i = (argc > 2) ? 2 : argc - 1; i < argc; i++) {
+		n = usense_client_reply(client, buff, sizeof(buff));
+		if (n == -ENODEV) {
+			fprintf(stderr, "%s: No such sensor '%s'\n", program, argv[1]);
+			return EXIT_FAILURE;
+		}
+		if (n < 0 && argc <= 2) {
+			fprintf(stderr, "%s: %s\n", program, buff);
+			return EXIT_FAILURE;
+		}
+
+		if (argc <= 2) {
+			/* List, or all properties of a device */
+			for (; n > 0; n--) {
+				if (usense_client_line(client, buff, sizeof(buff)) < 0)
+					return EXIT_FAILURE;
+				printf("%s\n", buff);
+			}
+		} else if (strchr(argv[i], '=') == NULL) {
+			if (n < 0) {
+				fprintf(stderr, "%s: No such property \"%s\"\n", argv[1], argv[i]);
+				err = EXIT_FAILURE;
+			} else {
+				printf("%s\n", buff);
+			}
+		} else if (n < 0) {
+			cp = strchr(argv[i], '=');
+			fprintf(stderr, "%s: Can't set property \"%.*s\" to \"%s\"\n", argv[1],
+				(int)(cp - argv[i]), argv[i], cp + 1);
+			err = EXIT_FAILURE;
+		}
+	}
+
+	return err;
+}
+
 int main(int argc, char **argv)
 {
+	struct usense_client *client;
+	sigset_t sigs;
 	struct usense *usense;
 	struct usense_device *dev;
 	int i, err = 0;
@@ -110,6 +503,30 @@ int main(int argc, char **argv)
 
 	program = argv[0];
 
+	if (argc > 1 && strcmp(argv[1], "--shm") == 0)
+		return show_shm(argc - 2, argv + 2);
+
+	/* If usensed is running, let it do the work.
+	 * USENSE_DIRECT=1 goes straight to the hardware.
+	 */
+	if ((argc == 1 || strncmp(argv[1], "--", 2) != 0) && getenv("USENSE_DIRECT") == NULL) {
+		client = usense_client_connect(NULL);
+		if (client != NULL) {
+			err = client_main(client, argc, argv);
+			usense_client_close(client);
+			return err;
+		}
+	}
+
+	/* Block these before the monitor thread starts,
+	 * so only sigwait() sees them.
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	if (argc > 1 && strcmp(argv[1], "--publish") == 0)
+		pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
 	usense = usense_start();
 	if (usense == NULL) {
 		fprintf(stderr, "%s: Can't create a new usense monitor\n", program);
@@ -121,16 +538,25 @@ int main(int argc, char **argv)
 		return list_devices(usense);
 	}
 
+	if (strcmp(argv[1], "--publish") == 0)
+		return publish(usense, &sigs);
+
+	if (strcmp(argv[1], "--stream") == 0)
+		return stream(usense, argc - 2, argv + 2);
+
+	if (strcmp(argv[1], "--watch") == 0)
+		return watch(usense, argc - 2, argv + 2);
+
 	devname = argv[1];
 
+	dev = NULL;
 	i = strtol(devname, &cp, 0);
 	if (*cp == 0) {
-		devname = nth_device(usense, i);
-		if (devname == NULL)
-			devname = argv[1];
+		dev = usense_open_id(usense, i);
 	}
 
-	dev = usense_open(usense, devname);
+	if (dev == NULL)
+		dev = usense_open(usense, devname);
 	if (dev == NULL) {
 		fprintf(stderr, "%s: No such sensor '%s'\n", program, devname);
 		return EXIT_FAILURE;
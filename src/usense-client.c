@@ -0,0 +1,275 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "usense.h"
+
+#define USENSE_CLIENT_QUEUE	16	/* Change records held while waiting for a reply */
+
+struct usense_client {
+	int fd;
+	char in[USENSE_PROP_MAX + 256];	/* Partial reply lines */
+	size_t in_len;
+	char *out;		/* Requests not yet sent */
+	size_t out_len, out_size;
+	struct usense_change queue[USENSE_CLIENT_QUEUE];
+	int queue_head, queue_count;
+};
+
+struct usense_client *usense_client_connect(const char *path)
+{
+	struct usense_client *client;
+	struct sockaddr_un sun;
+	int err;
+
+	if (path == NULL)
+		path = USENSE_SOCKET_PATH;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	client = calloc(1, sizeof(*client));
+	if (client == NULL)
+		return NULL;
+
+	client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (client->fd < 0) {
+		free(client);
+		return NULL;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (connect(client->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		err = errno;
+		close(client->fd);
+		free(client);
+		errno = err;
+		return NULL;
+	}
+
+	return client;
+}
+
+void usense_client_close(struct usense_client *client)
+{
+	if (client == NULL)
+		return;
+
+	close(client->fd);
+	free(client->out);
+	free(client);
+}
+
+int usense_client_fd(struct usense_client *client)
+{
+	return client->fd;
+}
+
+int usense_client_request(struct usense_client *client, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *tmp;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(client->out + client->out_len,
+			      client->out_size - client->out_len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			return -EINVAL;
+
+		/* Room for the '\n' too? */
+		if (client->out_len + n + 1 < client->out_size)
+			break;
+
+		size = client->out_size ? client->out_size * 2 : 1024;
+		while (size < client->out_len + n + 2)
+			size *= 2;
+		tmp = realloc(client->out, size);
+		if (tmp == NULL)
+			return -ENOMEM;
+		client->out = tmp;
+		client->out_size = size;
+	}
+
+	/* Requests are one line each */
+	if (memchr(client->out + client->out_len, '\n', n) != NULL)
+		return -EINVAL;
+
+	client->out_len += n;
+	client->out[client->out_len++] = '\n';
+
+	return 0;
+}
+
+int usense_client_flush(struct usense_client *client)
+{
+	size_t pos = 0;
+	ssize_t n;
+
+	while (pos < client->out_len) {
+		n = send(client->fd, client->out + pos, client->out_len - pos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		pos += n;
+	}
+	client->out_len = 0;
+
+	return 0;
+}
+
+/* Next line from the daemon, without the '\n' */
+static int usense_client_getline(struct usense_client *client, char *buff, size_t len)
+{
+	char *nl;
+	size_t n;
+	ssize_t got;
+	int err;
+
+	err = usense_client_flush(client);
+	if (err < 0)
+		return err;
+
+	while ((nl = memchr(client->in, '\n', client->in_len)) == NULL) {
+		if (client->in_len == sizeof(client->in))
+			return -EPROTO;
+
+		got = recv(client->fd, client->in + client->in_len,
+			   sizeof(client->in) - client->in_len, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0)
+			return -errno;
+		if (got == 0)
+			return -ECONNRESET;
+		client->in_len += got;
+	}
+
+	*nl = 0;
+	n = nl - client->in;
+	if (len > 0) {
+		strncpy(buff, client->in, len);
+		buff[len - 1] = 0;
+	}
+
+	client->in_len -= n + 1;
+	memmove(client->in, nl + 1, client->in_len);
+
+	return n;
+}
+
+/* ">name prop generation" */
+static int usense_client_parse_change(const char *line, struct usense_change *change)
+{
+	memset(change, 0, sizeof(*change));
+	if (sscanf(line, ">%63s %63s %u", change->device, change->prop, &change->generation) != 3)
+		return -EPROTO;
+
+	return 0;
+}
+
+int usense_client_reply(struct usense_client *client, char *buff, size_t len)
+{
+	struct usense_change *change;
+	char line[sizeof(client->in)];
+	char *cp;
+	int err;
+
+	for (;;) {
+		err = usense_client_getline(client, line, sizeof(line));
+		if (err < 0)
+			return err;
+
+		switch (line[0]) {
+		case '+':
+			if (len > 0) {
+				strncpy(buff, line + 1, len);
+				buff[len - 1] = 0;
+			}
+			return 0;
+		case '*':
+			if (len > 0)
+				buff[0] = 0;
+			return strtol(line + 1, NULL, 10);
+		case '-':
+			err = strtol(line + 1, &cp, 10);
+			if (len > 0) {
+				strncpy(buff, (*cp == ' ') ? cp + 1 : cp, len);
+				buff[len - 1] = 0;
+			}
+			return (err > 0) ? -err : -EIO;
+		case '>':
+			/* A change record got here first. Hold on to
+			 * it, dropping the oldest if we have to.
+			 */
+			if (client->queue_count == USENSE_CLIENT_QUEUE) {
+				client->queue_head = (client->queue_head + 1) % USENSE_CLIENT_QUEUE;
+				client->queue_count--;
+			}
+			change = &client->queue[(client->queue_head + client->queue_count) % USENSE_CLIENT_QUEUE];
+			if (usense_client_parse_change(line, change) == 0)
+				client->queue_count++;
+			break;
+		default:
+			return -EPROTO;
+		}
+	}
+}
+
+int usense_client_line(struct usense_client *client, char *buff, size_t len)
+{
+	return usense_client_getline(client, buff, len);
+}
+
+int usense_client_change(struct usense_client *client, struct usense_change *change)
+{
+	char line[sizeof(client->in)];
+	int err;
+
+	if (client->queue_count > 0) {
+		*change = client->queue[client->queue_head];
+		client->queue_head = (client->queue_head + 1) % USENSE_CLIENT_QUEUE;
+		client->queue_count--;
+		return 0;
+	}
+
+	err = usense_client_getline(client, line, sizeof(line));
+	if (err < 0)
+		return err;
+
+	return usense_client_parse_change(line, change);
+}
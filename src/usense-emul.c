@@ -0,0 +1,1092 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* Emulated USB backend
+ *
+ * Selected with USENSE_BACKEND=emul. It emulates each of the
+ * supported sensors at the protocol level, so usense and the
+ * drivers can be run, and timed, without any hardware:
+ *
+ *  gotemp   - Vernier Go!Temp, streaming 8 byte interrupt packets
+ *  pcsensor - PCsensor TEMPer, with its HID report command sequence
+ *  temper   - CH341, with an LM75 at I2C address 0x4f bit-banged
+ *             through its DTR (SCL), RTS (SDA) and CTS (SDA in) lines
+ *  ch341a   - CH341 in its I2C mode, with the same LM75 behind its
+ *             I2C stream commands
+ *
+ * Set up with:
+ *
+ *  USENSE_EMUL=gotemp,pcsensor,temper   Devices, on bus 1 (the default)
+ *  USENSE_EMUL=gotemp,pcsensor@500      ..the PCsensor plugged in 500ms later
+ *  USENSE_EMUL_LATENCY_US=1000          Time each transfer takes
+ *  USENSE_EMUL_CLOCK=virtual            ..or 'real'
+ *  USENSE_EMUL_TEMP=22.0                Temperature, in C
+ *
+ * On the virtual clock, transfers and driver delays advance a
+ * clock of our own rather than sleeping: anyone waiting on a
+ * transfer skips straight to its completion. So delay-heavy
+ * paths such as the TEMPer's bit-banged I2C run far faster than
+ * real time, while still accounting for the time they would take.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "usense-usb.h"
+
+#define EMUL_DEVS_MAX		16
+#define EMUL_LATENCY_US		1000	/* One full speed frame */
+#define EMUL_CONTROL_US		125	/* Each queued control transfer after that */
+#define EMUL_TEMP		22.0
+#define EMUL_DRIFT_MS		600000	/* Temperature drifts +/- 0.5C over this */
+#define EMUL_GOTEMP_MS		100	/* Go!Temp packet interval */
+
+#define LM75_SLAVE		0x4f
+
+/* CH341 modem control bits, as sent by ch341_set_handshake() */
+#define CH341_BIT_DTR		(1 << 5)
+#define CH341_BIT_RTS		(1 << 6)
+#define CH341_BIT_CTS		0x01
+
+/* CH341 I2C stream commands, see i2c-ch341.c */
+#define CH341_I2C_PACKET	32
+#define CH341_CMD_I2C_STREAM	0xaa
+#define CH341_I2C_STA		0x74
+#define CH341_I2C_STO		0x75
+#define CH341_I2C_END		0x00
+
+/* I2C slave, driven one line change at a time */
+struct lm75 {
+	int scl, sda;		/* As driven by the master */
+	int sda_out;		/* ..and by us. The bus is open drain. */
+	enum {
+		LM75_IDLE,
+		LM75_ADDR,
+		LM75_WRITE,
+		LM75_READ,
+	} state;
+	int bit;		/* Bits shifted this byte */
+	int ack;		/* In the ACK clock */
+	int rw;
+	int master_ack;
+	uint8_t shift;
+	int bytes;		/* Written, or read, since the address */
+	uint8_t out;		/* Byte being read */
+
+	uint8_t ptr;
+	uint8_t conf;
+	int16_t thyst, tos;
+	int16_t temp;		/* Latched at each START */
+};
+
+struct emul_dev;
+
+struct emul_model {
+	const char *name;
+	uint16_t vendor, product;
+	uint8_t manufacturer, product_string;
+	int interfaces;
+	/* Length transferred, or -1 to stall */
+	int (*control)(struct emul_dev *dev, uint8_t type, uint8_t request,
+		       uint16_t value, uint16_t index, uint8_t *data, int len);
+	/* Length transferred, or -1 to stall. May push back 'due'. */
+	int (*interrupt)(struct emul_dev *dev, uint8_t endpoint,
+			 uint8_t *data, int len, uint64_t *due);
+	/* Length transferred, or -1 to stall */
+	int (*bulk)(struct emul_dev *dev, uint8_t endpoint, uint8_t *data, int len);
+};
+
+struct emul_dev {
+	const struct emul_model *model;
+	uint8_t address;
+	int refs;
+	int opened;
+	unsigned int claimed;	/* Interface mask */
+	uint64_t control_due;	/* Of the last control transfer */
+	double offset;		/* C, so each device reads differently */
+	uint64_t plugged;	/* Real time it appears, in ns */
+
+	/* gotemp */
+	uint8_t counter;
+	uint64_t next_packet;
+
+	/* pcsensor */
+	int command;		/* Between the begin and end reports */
+	int bits;		/* Resolution */
+	int16_t latched;
+
+	/* temper */
+	uint8_t control;	/* DTR/RTS */
+	struct lm75 lm75;
+
+	/* ch341a */
+	uint8_t i2c_in[256];	/* For the next bulk read */
+	int i2c_len;
+};
+
+struct emul_xfer {
+	struct emul_xfer *next;
+	struct libusb_transfer *xfer;
+	uint64_t due;		/* On the emulator's clock */
+	enum libusb_transfer_status status;
+	int actual;
+};
+
+static struct {
+	pthread_mutex_t lock;	/* Recursive: callbacks resubmit */
+	pthread_cond_t cond;	/* Something completed, or was submitted */
+	int virtual;
+	uint64_t clock;		/* Virtual time, in ns */
+	uint64_t latency;	/* Per transfer, in ns */
+	double temp;
+	struct emul_dev dev[EMUL_DEVS_MAX];
+	int devs;
+	struct emul_xfer *pending;	/* By due time */
+} emul;
+
+static uint64_t emul_real_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Call with emul.lock held */
+static uint64_t emul_now(void)
+{
+	return emul.virtual ? emul.clock : emul_real_ns();
+}
+
+/* In C, at 'now' */
+static double emul_temp(struct emul_dev *dev, uint64_t now)
+{
+	uint64_t phase = (now / 1000000) % EMUL_DRIFT_MS;
+	double tri;
+
+	/* Triangle wave, 0 to 1 and back */
+	if (phase < EMUL_DRIFT_MS / 2)
+		tri = (double)phase / (EMUL_DRIFT_MS / 2);
+	else
+		tri = 2.0 - (double)phase / (EMUL_DRIFT_MS / 2);
+
+	return emul.temp + dev->offset + tri - 0.5;
+}
+
+/* In 1/256ths of a degree C, with 'bits' of resolution (9 = 0.5C) */
+static int16_t emul_temp_reg(struct emul_dev *dev, uint64_t now, int bits)
+{
+	int step = 256 >> (bits - 8);
+	double t = emul_temp(dev, now) * 256.0;
+	int v;
+
+	v = (int)(t / step) * step;
+	if (t < 0 && v != t)
+		v -= step;
+
+	return v;
+}
+
+/************** Go!Temp **************/
+
+static int gotemp_interrupt(struct emul_dev *dev, uint8_t endpoint,
+			    uint8_t *data, int len, uint64_t *due)
+{
+	int16_t raw;
+	int i;
+
+	if (endpoint != (LIBUSB_ENDPOINT_IN | 1) || len < 8)
+		return -1;
+
+	/* One packet per interval, whenever it is asked for */
+	if (dev->next_packet > *due)
+		*due = dev->next_packet;
+	dev->next_packet = *due + EMUL_GOTEMP_MS * 1000000ULL;
+
+	/* 1/128ths of a degree C, little endian */
+	raw = (int16_t)(emul_temp(dev, *due) * 128.0);
+
+	data[0] = 3;
+	data[1] = dev->counter++;
+	for (i = 0; i < 3; i++) {
+		data[2 + i * 2] = raw & 0xff;
+		data[3 + i * 2] = (raw >> 8) & 0xff;
+	}
+
+	return 8;
+}
+
+/************** PCsensor TEMPer **************/
+
+static int pcsensor_control(struct emul_dev *dev, uint8_t type, uint8_t request,
+			    uint16_t value, uint16_t index, uint8_t *data, int len)
+{
+	static const uint8_t begin[4] = { 10, 11, 12, 13 };
+	int16_t t;
+
+	/* HID SET_REPORT */
+	if (type == 0x21 && request == 9 && value == 0x200) {
+		if (len < 8)
+			return -1;
+
+		if (memcmp(data, begin, 4) == 0) {
+			/* 2 starts a command, 1 ends it */
+			dev->command = (data[6] == 2) ? -1 : 0;
+			return len;
+		}
+
+		/* The first report after a begin is the command */
+		if (dev->command == -1) {
+			dev->command = data[0];
+			if (dev->command == 0x54)
+				dev->latched = emul_temp_reg(dev, emul_now(), dev->bits);
+			else if (dev->command == 0x43)
+				dev->bits = 12;
+			else if (dev->command == 0x52)	/* Config, R1:R0 as on a DS75 */
+				dev->latched = ((dev->bits - 9) << 5) << 8;
+		}
+
+		return len;
+	}
+
+	/* HID GET_REPORT */
+	if (type == 0xa1 && request == 1 && value == 0x300) {
+		if (len < 8)
+			return -1;
+
+		t = dev->latched;
+		memset(data, 0, len);
+		data[0] = (t >> 8) & 0xff;
+		data[1] = t & 0xff;
+		data[2] = 0x31;
+		return 8;
+	}
+
+	return -1;
+}
+
+/************** CH341 + LM75 **************/
+
+static void lm75_load(struct lm75 *lm)
+{
+	int16_t reg;
+
+	switch (lm->ptr & 3) {
+	case 0: reg = lm->temp; break;
+	case 1: lm->out = lm->conf; return;
+	case 2: reg = lm->thyst; break;
+	default: reg = lm->tos; break;
+	}
+
+	/* Two byte registers, MSB first, repeating */
+	lm->out = (lm->bytes & 1) ? (reg & 0xff) : ((reg >> 8) & 0xff);
+}
+
+static void lm75_write(struct lm75 *lm, uint8_t val)
+{
+	int16_t *reg;
+
+	if (lm->bytes == 0) {
+		lm->ptr = val & 3;
+		return;
+	}
+
+	switch (lm->ptr & 3) {
+	case 1: lm->conf = val; return;
+	case 2: reg = &lm->thyst; break;
+	case 3: reg = &lm->tos; break;
+	default: return;	/* Read-only */
+	}
+
+	if (lm->bytes == 1)
+		*reg = (*reg & 0x00ff) | (val << 8);
+	else if (lm->bytes == 2)
+		*reg = (*reg & 0xff00) | val;
+}
+
+/* SCL rose: sample SDA */
+static void lm75_rise(struct lm75 *lm)
+{
+	int sda = lm->sda && lm->sda_out;
+
+	switch (lm->state) {
+	case LM75_ADDR:
+	case LM75_WRITE:
+		if (!lm->ack) {
+			lm->shift = (lm->shift << 1) | sda;
+			lm->bit++;
+		}
+		break;
+	case LM75_READ:
+		if (lm->ack)
+			lm->master_ack = !sda;
+		break;
+	default:
+		break;
+	}
+}
+
+/* SCL fell: drive SDA for the next bit */
+static void lm75_fall(struct lm75 *lm)
+{
+	switch (lm->state) {
+	case LM75_ADDR:
+		if (lm->ack) {
+			lm->ack = 0;
+			lm->bit = 0;
+			lm->bytes = 0;
+			if (lm->rw) {
+				lm->state = LM75_READ;
+				lm75_load(lm);
+				lm->sda_out = (lm->out >> 7) & 1;
+				lm->bit = 1;
+			} else {
+				lm->state = LM75_WRITE;
+				lm->sda_out = 1;
+			}
+		} else if (lm->bit == 8) {
+			if ((lm->shift >> 1) == LM75_SLAVE) {
+				lm->rw = lm->shift & 1;
+				lm->ack = 1;
+				lm->sda_out = 0;
+			} else {
+				lm->state = LM75_IDLE;
+			}
+		}
+		break;
+	case LM75_WRITE:
+		if (lm->ack) {
+			lm->ack = 0;
+			lm->bit = 0;
+			lm->sda_out = 1;
+		} else if (lm->bit == 8) {
+			lm75_write(lm, lm->shift);
+			lm->bytes++;
+			lm->ack = 1;
+			lm->sda_out = 0;
+		}
+		break;
+	case LM75_READ:
+		if (lm->ack) {
+			lm->ack = 0;
+			if (lm->master_ack) {
+				lm->bytes++;
+				lm75_load(lm);
+				lm->sda_out = (lm->out >> 7) & 1;
+				lm->bit = 1;
+			} else {
+				lm->state = LM75_IDLE;
+				lm->sda_out = 1;
+			}
+		} else if (lm->bit == 8) {
+			/* Let go, for the master's ACK */
+			lm->ack = 1;
+			lm->sda_out = 1;
+		} else {
+			lm->sda_out = (lm->out >> (7 - lm->bit)) & 1;
+			lm->bit++;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void lm75_lines(struct emul_dev *dev, int scl, int sda)
+{
+	struct lm75 *lm = &dev->lm75;
+	int was = lm->sda && lm->sda_out;
+
+	if (sda != lm->sda) {
+		lm->sda = sda;
+		if (lm->scl && was != (sda && lm->sda_out)) {
+			if (sda) {
+				/* STOP */
+				lm->state = LM75_IDLE;
+				lm->sda_out = 1;
+			} else {
+				/* START, or repeated START */
+				lm->state = LM75_ADDR;
+				lm->bit = 0;
+				lm->ack = 0;
+				lm->sda_out = 1;
+				lm->temp = emul_temp_reg(dev, emul_now(), 9 + ((lm->conf >> 5) & 3));
+			}
+		}
+	}
+
+	if (scl != lm->scl) {
+		lm->scl = scl;
+		if (scl)
+			lm75_rise(lm);
+		else
+			lm75_fall(lm);
+	}
+}
+
+/* Modem status, as the CH341 reports it: inverted */
+static uint8_t ch341_status(struct emul_dev *dev)
+{
+	struct lm75 *lm = &dev->lm75;
+	uint8_t status = 0;
+
+	if (lm->sda && lm->sda_out)
+		status |= CH341_BIT_CTS;
+
+	return ~status;
+}
+
+static int ch341_control(struct emul_dev *dev, uint8_t type, uint8_t request,
+			 uint16_t value, uint16_t index, uint8_t *data, int len)
+{
+	if ((type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+		if (len < 2)
+			return -1;
+
+		switch (request) {
+		case 0x5f:	/* Version */
+			data[0] = 0x27;
+			data[1] = 0x00;
+			return 2;
+		case 0x95:	/* Read registers */
+			if (value == 0x0706) {
+				data[0] = ch341_status(dev);
+				data[1] = 0xee;
+			} else {
+				data[0] = 0x56;
+				data[1] = 0x00;
+			}
+			return 2;
+		default:
+			return -1;
+		}
+	}
+
+	switch (request) {
+	case 0xa4:	/* Modem control, inverted */
+		dev->control = ~value & 0xff;
+		lm75_lines(dev, (dev->control & CH341_BIT_DTR) != 0,
+			   (dev->control & CH341_BIT_RTS) != 0);
+		return 0;
+	case 0xa1:	/* Serial init */
+	case 0x9a:	/* Write registers */
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int ch341_interrupt(struct emul_dev *dev, uint8_t endpoint,
+			   uint8_t *data, int len, uint64_t *due)
+{
+	if (endpoint != (LIBUSB_ENDPOINT_IN | 1) || len < 4)
+		return -1;
+
+	data[0] = 0x08;
+	data[1] = 0x7d;
+	data[2] = ch341_status(dev);
+	data[3] = 0xee;
+
+	return 4;
+}
+
+/************** CH341 in I2C mode + LM75 **************/
+
+/* One SCL clock. Returns SDA, sampled while SCL is high. */
+static int ch341a_clock(struct emul_dev *dev, int sda)
+{
+	struct lm75 *lm = &dev->lm75;
+	int in;
+
+	lm75_lines(dev, 0, sda);
+	lm75_lines(dev, 1, sda);
+	in = lm->sda && lm->sda_out;
+	lm75_lines(dev, 0, sda);
+
+	return in;
+}
+
+/* Returns 1 if the slave ACKed */
+static int ch341a_out(struct emul_dev *dev, uint8_t val)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		ch341a_clock(dev, (val >> i) & 1);
+
+	return !ch341a_clock(dev, 1);
+}
+
+static uint8_t ch341a_in(struct emul_dev *dev, int ack)
+{
+	uint8_t val = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		val = (val << 1) | ch341a_clock(dev, 1);
+	ch341a_clock(dev, !ack);
+
+	return val;
+}
+
+static int ch341a_push(struct emul_dev *dev, uint8_t val)
+{
+	if (dev->i2c_len == sizeof(dev->i2c_in))
+		return -1;
+	dev->i2c_in[dev->i2c_len++] = val;
+	return 0;
+}
+
+/* Run one packet of stream commands */
+static int ch341a_stream(struct emul_dev *dev, const uint8_t *data, int len)
+{
+	int i, n, err = 0;
+	uint8_t cmd;
+
+	if (len < 1 || data[0] != CH341_CMD_I2C_STREAM)
+		return -1;
+
+	for (i = 1; i < len && err == 0; ) {
+		cmd = data[i++];
+		n = cmd & 0x3f;
+
+		if (cmd == CH341_I2C_END) {
+			break;
+		} else if (cmd == CH341_I2C_STA) {
+			lm75_lines(dev, 0, 1);
+			lm75_lines(dev, 1, 1);
+			lm75_lines(dev, 1, 0);
+			lm75_lines(dev, 0, 0);
+		} else if (cmd == CH341_I2C_STO) {
+			lm75_lines(dev, 0, 0);
+			lm75_lines(dev, 1, 0);
+			lm75_lines(dev, 1, 1);
+		} else if ((cmd & 0xf0) == 0x60 || (cmd & 0xf0) == 0x40) {
+			/* Bus speed, or a delay */
+		} else if ((cmd & 0xc0) == 0x80) {
+			/* OUT n bytes, or one with its ACK returned */
+			if (i + (n ? n : 1) > len)
+				return -1;
+			if (n == 0) {
+				err = ch341a_push(dev, ch341a_out(dev, data[i++]) ? 0x00 : 0x80);
+			} else {
+				for (; n > 0; n--)
+					ch341a_out(dev, data[i++]);
+			}
+		} else if ((cmd & 0xc0) == 0xc0) {
+			/* IN n bytes ACKed, or one NAKed */
+			if (n == 0)
+				err = ch341a_push(dev, ch341a_in(dev, 0));
+			for (; n > 0 && err == 0; n--)
+				err = ch341a_push(dev, ch341a_in(dev, 1));
+		} else {
+			return -1;
+		}
+	}
+
+	return err;
+}
+
+static int ch341a_bulk(struct emul_dev *dev, uint8_t endpoint, uint8_t *data, int len)
+{
+	int i;
+
+	if (endpoint == (LIBUSB_ENDPOINT_IN | 2)) {
+		if (len > dev->i2c_len)
+			len = dev->i2c_len;
+		memcpy(data, dev->i2c_in, len);
+		dev->i2c_len -= len;
+		memmove(dev->i2c_in, &dev->i2c_in[len], dev->i2c_len);
+		return len;
+	}
+
+	if (endpoint != (LIBUSB_ENDPOINT_OUT | 2))
+		return -1;
+
+	for (i = 0; i < len; i += CH341_I2C_PACKET) {
+		if (ch341a_stream(dev, &data[i], (len - i < CH341_I2C_PACKET) ? len - i : CH341_I2C_PACKET) < 0)
+			return -1;
+	}
+
+	return len;
+}
+
+static const struct emul_model emul_model[] = {
+	{
+		.name = "gotemp",
+		.vendor = 0x08f7, .product = 0x0002,
+		.manufacturer = 1, .product_string = 2,
+		.interfaces = 1,
+		.interrupt = gotemp_interrupt,
+	}, {
+		.name = "pcsensor",
+		.vendor = 0x1130, .product = 0x660c,
+		.manufacturer = 1, .product_string = 2,
+		.interfaces = 2,
+		.control = pcsensor_control,
+	}, {
+		.name = "temper",
+		.vendor = 0x4348, .product = 0x5523,
+		.manufacturer = 0, .product_string = 2,
+		.interfaces = 1,
+		.control = ch341_control,
+		.interrupt = ch341_interrupt,
+	}, {
+		.name = "ch341a",
+		.vendor = 0x1a86, .product = 0x5512,
+		.manufacturer = 0, .product_string = 2,
+		.interfaces = 1,
+		.bulk = ch341a_bulk,
+	},
+};
+
+/************** Backend **************/
+
+static void emul_add(const char *name, int len, unsigned int plug_ms)
+{
+	struct emul_dev *dev;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(emul_model) / sizeof(emul_model[0]); i++) {
+		if (strlen(emul_model[i].name) == len &&
+		    strncmp(emul_model[i].name, name, len) == 0)
+			break;
+	}
+	if (i == sizeof(emul_model) / sizeof(emul_model[0])) {
+		fprintf(stderr, "usense: No emulated '%.*s' device\n", len, name);
+		return;
+	}
+	if (emul.devs == EMUL_DEVS_MAX)
+		return;
+
+	dev = &emul.dev[emul.devs];
+	dev->model = &emul_model[i];
+	dev->address = emul.devs + 1;
+	dev->offset = emul.devs * 0.75;
+	dev->plugged = emul_real_ns() + plug_ms * 1000000ULL;
+	dev->bits = 9;
+	dev->control = CH341_BIT_DTR | CH341_BIT_RTS;
+	dev->lm75.scl = dev->lm75.sda = dev->lm75.sda_out = 1;
+	dev->lm75.thyst = 75 << 8;
+	dev->lm75.tos = 80 << 8;
+	emul.devs++;
+}
+
+static int emul_init(void)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	const char *cp, *end, *at;
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&emul.lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&emul.cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	cp = getenv("USENSE_EMUL_CLOCK");
+	emul.virtual = (cp == NULL || strcmp(cp, "real") != 0);
+	emul.clock = emul_real_ns();
+
+	cp = getenv("USENSE_EMUL_LATENCY_US");
+	emul.latency = ((cp != NULL) ? strtoul(cp, NULL, 0) : EMUL_LATENCY_US) * 1000ULL;
+
+	cp = getenv("USENSE_EMUL_TEMP");
+	emul.temp = (cp != NULL) ? strtod(cp, NULL) : EMUL_TEMP;
+
+	cp = getenv("USENSE_EMUL");
+	if (cp == NULL)
+		cp = "gotemp,pcsensor,temper";
+	for (; *cp != 0; cp = end) {
+		end = strchr(cp, ',');
+		if (end == NULL)
+			end = cp + strlen(cp);
+		at = memchr(cp, '@', end - cp);
+		if (at != NULL)
+			emul_add(cp, at - cp, strtoul(at + 1, NULL, 0));
+		else if (end > cp)
+			emul_add(cp, end - cp, 0);
+		if (*end == ',')
+			end++;
+	}
+
+	return 0;
+}
+
+static ssize_t emul_get_device_list(libusb_device ***list)
+{
+	uint64_t now = emul_real_ns();
+	int i, n = 0;
+
+	*list = calloc(emul.devs + 1, sizeof(**list));
+	if (*list == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	pthread_mutex_lock(&emul.lock);
+	for (i = 0; i < emul.devs; i++) {
+		/* Not plugged in yet */
+		if (emul.dev[i].plugged > now)
+			continue;
+		emul.dev[i].refs++;
+		(*list)[n++] = (libusb_device *)&emul.dev[i];
+	}
+	pthread_mutex_unlock(&emul.lock);
+
+	return n;
+}
+
+static libusb_device *emul_ref_device(libusb_device *udev)
+{
+	struct emul_dev *dev = (struct emul_dev *)udev;
+
+	pthread_mutex_lock(&emul.lock);
+	dev->refs++;
+	pthread_mutex_unlock(&emul.lock);
+
+	return udev;
+}
+
+/* The devices live as long as the process */
+static void emul_unref_device(libusb_device *udev)
+{
+	struct emul_dev *dev = (struct emul_dev *)udev;
+
+	pthread_mutex_lock(&emul.lock);
+	dev->refs--;
+	pthread_mutex_unlock(&emul.lock);
+}
+
+static void emul_free_device_list(libusb_device **list)
+{
+	int i;
+
+	for (i = 0; list[i] != NULL; i++)
+		emul_unref_device(list[i]);
+	free(list);
+}
+
+static int emul_get_device_descriptor(libusb_device *udev, struct libusb_device_descriptor *desc)
+{
+	struct emul_dev *dev = (struct emul_dev *)udev;
+
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = LIBUSB_DT_DEVICE_SIZE;
+	desc->bDescriptorType = LIBUSB_DT_DEVICE;
+	desc->bcdUSB = 0x0110;
+	desc->bMaxPacketSize0 = 8;
+	desc->idVendor = dev->model->vendor;
+	desc->idProduct = dev->model->product;
+	desc->iManufacturer = dev->model->manufacturer;
+	desc->iProduct = dev->model->product_string;
+	desc->bNumConfigurations = 1;
+
+	return 0;
+}
+
+static uint8_t emul_get_bus_number(libusb_device *udev)
+{
+	return 1;
+}
+
+static uint8_t emul_get_device_address(libusb_device *udev)
+{
+	return ((struct emul_dev *)udev)->address;
+}
+
+static int emul_get_interfaces(libusb_device *udev)
+{
+	return ((struct emul_dev *)udev)->model->interfaces;
+}
+
+static int emul_open(libusb_device *udev, libusb_device_handle **usb)
+{
+	struct emul_dev *dev = (struct emul_dev *)udev;
+
+	pthread_mutex_lock(&emul.lock);
+	dev->opened++;
+	pthread_mutex_unlock(&emul.lock);
+
+	*usb = (libusb_device_handle *)dev;
+	return 0;
+}
+
+static void emul_close(libusb_device_handle *usb)
+{
+	struct emul_dev *dev = (struct emul_dev *)usb;
+
+	pthread_mutex_lock(&emul.lock);
+	if (--dev->opened == 0)
+		dev->claimed = 0;
+	pthread_mutex_unlock(&emul.lock);
+}
+
+static int emul_detach_kernel_driver(libusb_device_handle *usb, int iface)
+{
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int emul_claim_interface(libusb_device_handle *usb, int iface)
+{
+	struct emul_dev *dev = (struct emul_dev *)usb;
+	int err = 0;
+
+	pthread_mutex_lock(&emul.lock);
+	if (iface < 0 || iface >= dev->model->interfaces)
+		err = LIBUSB_ERROR_NOT_FOUND;
+	else
+		dev->claimed |= 1 << iface;
+	pthread_mutex_unlock(&emul.lock);
+
+	return err;
+}
+
+/* Call with emul.lock held */
+static void emul_queue(struct emul_xfer *ex)
+{
+	struct emul_xfer **pex;
+
+	for (pex = &emul.pending; *pex != NULL && (*pex)->due <= ex->due; pex = &(*pex)->next);
+	ex->next = *pex;
+	*pex = ex;
+
+	pthread_cond_broadcast(&emul.cond);
+}
+
+/* The device sees the transfer as soon as it is submitted,
+ * and it completes 'latency' later. Control transfers share
+ * the default pipe, so queued ones complete one after another.
+ */
+static int emul_submit_transfer(struct libusb_transfer *xfer)
+{
+	struct emul_dev *dev = (struct emul_dev *)xfer->dev_handle;
+	const struct emul_model *model = dev->model;
+	struct libusb_control_setup *setup;
+	struct emul_xfer *ex;
+	int len = -1;
+
+	ex = calloc(1, sizeof(*ex));
+	if (ex == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	pthread_mutex_lock(&emul.lock);
+	ex->xfer = xfer;
+	ex->due = emul_now() + emul.latency;
+
+	switch (xfer->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		if (ex->due < dev->control_due + EMUL_CONTROL_US * 1000ULL)
+			ex->due = dev->control_due + EMUL_CONTROL_US * 1000ULL;
+		dev->control_due = ex->due;
+		setup = libusb_control_transfer_get_setup(xfer);
+		if (model->control != NULL)
+			len = model->control(dev, setup->bmRequestType, setup->bRequest,
+					     libusb_le16_to_cpu(setup->wValue),
+					     libusb_le16_to_cpu(setup->wIndex),
+					     libusb_control_transfer_get_data(xfer),
+					     libusb_le16_to_cpu(setup->wLength));
+		/* OUT transfers take all that was sent */
+		if (len == 0 && (setup->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
+			len = libusb_le16_to_cpu(setup->wLength);
+		break;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		if (model->interrupt != NULL)
+			len = model->interrupt(dev, xfer->endpoint, xfer->buffer, xfer->length, &ex->due);
+		break;
+	case LIBUSB_TRANSFER_TYPE_BULK:
+		if (model->bulk != NULL)
+			len = model->bulk(dev, xfer->endpoint, xfer->buffer, xfer->length);
+		break;
+	default:
+		break;
+	}
+
+	if (len < 0) {
+		ex->status = LIBUSB_TRANSFER_STALL;
+	} else {
+		ex->status = LIBUSB_TRANSFER_COMPLETED;
+		ex->actual = len;
+	}
+
+	emul_queue(ex);
+	pthread_mutex_unlock(&emul.lock);
+
+	return 0;
+}
+
+static int emul_cancel_transfer(struct libusb_transfer *xfer)
+{
+	struct emul_xfer **pex, *ex;
+	int err = LIBUSB_ERROR_NOT_FOUND;
+
+	pthread_mutex_lock(&emul.lock);
+	for (pex = &emul.pending; *pex != NULL; pex = &(*pex)->next) {
+		if ((*pex)->xfer == xfer) {
+			ex = *pex;
+			*pex = ex->next;
+			ex->status = LIBUSB_TRANSFER_CANCELLED;
+			ex->actual = 0;
+			ex->due = 0;
+			emul_queue(ex);
+			err = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&emul.lock);
+
+	return err;
+}
+
+/* Complete whatever is due. Waiting callers on the virtual
+ * clock jump it forward to the next completion instead.
+ */
+static int emul_handle_events(struct timeval *tv, int *completed)
+{
+	uint64_t deadline = UINT64_MAX, wake, real;
+	struct libusb_transfer *xfer;
+	struct emul_xfer *ex;
+	struct timespec ts;
+	int handled = 0, block;
+
+	block = (tv == NULL || tv->tv_sec != 0 || tv->tv_usec != 0);
+	if (tv != NULL)
+		deadline = emul_real_ns() + tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+
+	pthread_mutex_lock(&emul.lock);
+	for (;;) {
+		if (completed != NULL && *completed)
+			break;
+
+		ex = emul.pending;
+		if (ex != NULL && ex->due <= emul_now()) {
+			emul.pending = ex->next;
+
+			/* Callbacks run with the lock held, so
+			 * waiters see 'completed' change under it.
+			 */
+			xfer = ex->xfer;
+			xfer->status = ex->status;
+			xfer->actual_length = ex->actual;
+			free(ex);
+			xfer->callback(xfer);
+			pthread_cond_broadcast(&emul.cond);
+			handled++;
+			continue;
+		}
+
+		if (handled > 0 || !block)
+			break;
+
+		if (ex != NULL && emul.virtual) {
+			emul.clock = ex->due;
+			continue;
+		}
+
+		/* Wait for a completion, a submit, or a timeout */
+		real = emul_real_ns();
+		if (real >= deadline)
+			break;
+		wake = deadline;
+		if (ex != NULL && ex->due < wake)
+			wake = ex->due;
+		if (wake == UINT64_MAX) {
+			pthread_cond_wait(&emul.cond, &emul.lock);
+		} else {
+			ts.tv_sec = wake / 1000000000ULL;
+			ts.tv_nsec = wake % 1000000000ULL;
+			pthread_cond_timedwait(&emul.cond, &emul.lock, &ts);
+		}
+	}
+	pthread_mutex_unlock(&emul.lock);
+
+	return 0;
+}
+
+static int emul_get_pollfds(struct pollfd *pfd, int max)
+{
+	return 0;
+}
+
+/* On the virtual clock, only waiters move time on */
+static int emul_get_next_timeout(struct timeval *tv)
+{
+	uint64_t now, due;
+
+	pthread_mutex_lock(&emul.lock);
+	if (emul.virtual || emul.pending == NULL) {
+		pthread_mutex_unlock(&emul.lock);
+		return 0;
+	}
+	due = emul.pending->due;
+	now = emul_now();
+	pthread_mutex_unlock(&emul.lock);
+
+	due = (due > now) ? due - now : 0;
+	tv->tv_sec = due / 1000000000ULL;
+	tv->tv_usec = (due % 1000000000ULL) / 1000;
+
+	return 1;
+}
+
+static void emul_delay(unsigned int usec)
+{
+	if (!emul.virtual) {
+		usleep(usec);
+		return;
+	}
+
+	pthread_mutex_lock(&emul.lock);
+	emul.clock += usec * 1000ULL;
+	pthread_mutex_unlock(&emul.lock);
+}
+
+const struct usense_usb_backend usense_usb_emul = {
+	.name = "emul",
+	.init = emul_init,
+	.get_device_list = emul_get_device_list,
+	.free_device_list = emul_free_device_list,
+	.ref_device = emul_ref_device,
+	.unref_device = emul_unref_device,
+	.get_device_descriptor = emul_get_device_descriptor,
+	.get_bus_number = emul_get_bus_number,
+	.get_device_address = emul_get_device_address,
+	.get_interfaces = emul_get_interfaces,
+	.open = emul_open,
+	.close = emul_close,
+	.detach_kernel_driver = emul_detach_kernel_driver,
+	.claim_interface = emul_claim_interface,
+	.submit_transfer = emul_submit_transfer,
+	.cancel_transfer = emul_cancel_transfer,
+	.handle_events = emul_handle_events,
+	.get_pollfds = emul_get_pollfds,
+	.get_next_timeout = emul_get_next_timeout,
+	.delay = emul_delay,
+};
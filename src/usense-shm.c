@@ -0,0 +1,311 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "usense.h"
+#include "usense-shm.h"
+
+struct usense_shm {
+	struct usense_shm_header *hdr;
+	struct usense_shm_entry *entry;
+	size_t size;
+	char *path;		/* Writer only */
+	int full;		/* ..and an id didn't fit */
+};
+
+/* Copy a string into shared memory, a byte at a time */
+static void usense_shm_store_text(char *dst, const char *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len - 1 && src != NULL && src[i] != 0; i++)
+		__atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+	for (; i < len; i++)
+		__atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+}
+
+static void usense_shm_load_text(char *dst, const char *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	dst[len - 1] = 0;
+}
+
+/* The file is built under a temporary name, and renamed into
+ * place, so readers never see it half initialized.
+ */
+struct usense_shm *usense_shm_create(const char *path, unsigned int entries)
+{
+	struct usense_shm *shm;
+	char tmp[PATH_MAX], *cp;
+	void *map;
+	int fd, err;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	shm = calloc(1, sizeof(*shm));
+	if (shm == NULL)
+		return NULL;
+
+	shm->path = strdup(path);
+	if (shm->path == NULL) {
+		free(shm);
+		return NULL;
+	}
+
+	/* ie /run/usense */
+	cp = strrchr(tmp, '/');
+	if (cp != NULL && cp != tmp) {
+		*cp = 0;
+		mkdir(tmp, 0755);
+		*cp = '/';
+	}
+
+	shm->size = sizeof(struct usense_shm_header) + entries * sizeof(struct usense_shm_entry);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		goto fail;
+
+	if (ftruncate(fd, shm->size) < 0) {
+		err = errno;
+		close(fd);
+		unlink(tmp);
+		errno = err;
+		goto fail;
+	}
+
+	map = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		unlink(tmp);
+		errno = err;
+		goto fail;
+	}
+
+	shm->hdr = map;
+	shm->entry = (struct usense_shm_entry *)(shm->hdr + 1);
+	shm->hdr->version = USENSE_SHM_VERSION;
+	shm->hdr->header_size = sizeof(struct usense_shm_header);
+	shm->hdr->entry_size = sizeof(struct usense_shm_entry);
+	shm->hdr->entries = entries;
+	shm->hdr->pid = getpid();
+	__atomic_store_n(&shm->hdr->magic, USENSE_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	if (rename(tmp, path) < 0) {
+		err = errno;
+		munmap(map, shm->size);
+		unlink(tmp);
+		errno = err;
+		goto fail;
+	}
+
+	return shm;
+
+fail:
+	free(shm->path);
+	free(shm);
+	return NULL;
+}
+
+/* Entries have one writer each (the device's lock holder),
+ * so only the seqlock is needed to keep readers consistent.
+ */
+void usense_shm_update(struct usense_shm *shm, int id, const char *name,
+		       const char *units, const char *text, double value,
+		       uint64_t sampled_ns, const struct timespec *sampled_at,
+		       int status)
+{
+	struct usense_shm_entry *ent;
+	uint32_t seq, devs;
+
+	if (id < 0)
+		return;
+
+	/* More devices at once than there are entries */
+	if ((unsigned int)id >= shm->hdr->entries) {
+		if (!__atomic_exchange_n(&shm->full, 1, __ATOMIC_RELAXED))
+			fprintf(stderr, "usense: %s: Only room for %u devices, the rest aren't published\n",
+				shm->path, shm->hdr->entries);
+		return;
+	}
+
+	ent = &shm->entry[id];
+
+	seq = ent->seq;
+	__atomic_store_n(&ent->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&ent->status, status, __ATOMIC_RELAXED);
+	__atomic_store(&ent->value, &value, __ATOMIC_RELAXED);
+	__atomic_store_n(&ent->sampled_ns, sampled_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&ent->sampled_sec, sampled_at->tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&ent->sampled_nsec, sampled_at->tv_nsec, __ATOMIC_RELAXED);
+	usense_shm_store_text(ent->name, name, sizeof(ent->name));
+	usense_shm_store_text(ent->units, units, sizeof(ent->units));
+	usense_shm_store_text(ent->text, text, sizeof(ent->text));
+
+	__atomic_store_n(&ent->seq, seq + 2, __ATOMIC_RELEASE);
+
+	/* Grow the range readers scan */
+	devs = __atomic_load_n(&shm->hdr->devs, __ATOMIC_RELAXED);
+	while ((uint32_t)id >= devs &&
+	       !__atomic_compare_exchange_n(&shm->hdr->devs, &devs, id + 1, 0,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+/* Mark everything gone, for readers that still have it mapped */
+void usense_shm_destroy(struct usense_shm *shm)
+{
+	struct timespec ts = { 0, 0 };
+	uint32_t i;
+
+	if (shm == NULL)
+		return;
+
+	unlink(shm->path);
+
+	for (i = 0; i < shm->hdr->devs; i++) {
+		if (shm->entry[i].seq != 0)
+			usense_shm_update(shm, i, NULL, NULL, NULL, 0.0, 0, &ts, -ENODEV);
+	}
+	__atomic_store_n(&shm->hdr->pid, 0, __ATOMIC_RELEASE);
+
+	munmap(shm->hdr, shm->size);
+	free(shm->path);
+	free(shm);
+}
+
+/************** Readers **************/
+
+struct usense_shm *usense_shm_open(const char *path)
+{
+	const struct usense_shm_header *hdr;
+	struct usense_shm *shm;
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	if (path == NULL)
+		path = USENSE_SHM_PATH;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+
+	hdr = map;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != USENSE_SHM_MAGIC ||
+	    hdr->version != USENSE_SHM_VERSION ||
+	    hdr->header_size != sizeof(struct usense_shm_header) ||
+	    hdr->entry_size != sizeof(struct usense_shm_entry) ||
+	    hdr->header_size + (size_t)hdr->entries * hdr->entry_size > (size_t)st.st_size) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	shm = calloc(1, sizeof(*shm));
+	if (shm == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	shm->hdr = map;
+	shm->entry = (struct usense_shm_entry *)(shm->hdr + 1);
+	shm->size = st.st_size;
+
+	return shm;
+}
+
+int usense_shm_devices(struct usense_shm *shm)
+{
+	return __atomic_load_n(&shm->hdr->devs, __ATOMIC_ACQUIRE);
+}
+
+int usense_shm_read(struct usense_shm *shm, int id, struct usense_shm_reading *r)
+{
+	const struct usense_shm_entry *ent;
+	uint32_t seq;
+
+	if (id < 0 || (unsigned int)id >= shm->hdr->entries)
+		return -EINVAL;
+
+	ent = &shm->entry[id];
+
+	do {
+		seq = __atomic_load_n(&ent->seq, __ATOMIC_ACQUIRE);
+		if (seq == 0)
+			return -ENOENT;
+		if (seq & 1)
+			continue;
+
+		r->status = __atomic_load_n(&ent->status, __ATOMIC_RELAXED);
+		__atomic_load(&ent->value, &r->value, __ATOMIC_RELAXED);
+		r->timestamp.tv_sec = __atomic_load_n(&ent->sampled_sec, __ATOMIC_RELAXED);
+		r->timestamp.tv_nsec = __atomic_load_n(&ent->sampled_nsec, __ATOMIC_RELAXED);
+		usense_shm_load_text(r->device, ent->name, sizeof(r->device));
+		usense_shm_load_text(r->units, ent->units, sizeof(r->units));
+		usense_shm_load_text(r->reading, ent->text, sizeof(r->reading));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&ent->seq, __ATOMIC_RELAXED) != seq);
+
+	return 0;
+}
+
+void usense_shm_close(struct usense_shm *shm)
+{
+	if (shm == NULL)
+		return;
+
+	munmap(shm->hdr, shm->size);
+	free(shm);
+}
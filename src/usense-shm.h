@@ -0,0 +1,74 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef USENSE_SHM_H
+#define USENSE_SHM_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "usense.h"
+
+/* Shared memory snapshot layout
+ *
+ * A header, then one entry per device id. Everything is
+ * cache line aligned, so a reader of one entry never shares
+ * a line with the writer of another.
+ *
+ * Each entry is a seqlock: 'seq' is odd while the entry is
+ * being written, and 0 if it never has been.
+ */
+#define USENSE_SHM_MAGIC	0x534e5355	/* "USNS" */
+#define USENSE_SHM_VERSION	2
+#define USENSE_SHM_ENTRIES	256
+
+#define USENSE_SHM_ALIGN	__attribute__((aligned(64)))
+
+struct usense_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint32_t entries;	/* Capacity */
+	uint32_t devs;		/* Highest id in use, plus one */
+	int32_t pid;		/* Writer */
+} USENSE_SHM_ALIGN;
+
+struct usense_shm_entry {
+	uint32_t seq;
+	int32_t status;		/* 0, or -errno */
+	double value;		/* In 'units' */
+	uint64_t sampled_ns;	/* CLOCK_MONOTONIC of the sample */
+	int64_t sampled_sec;	/* ..and its CLOCK_REALTIME */
+	int64_t sampled_nsec;
+	char name[32];
+	char units[USENSE_UNITS_MAX];
+	char text[32];		/* 'value', as 'reading' shows it */
+} USENSE_SHM_ALIGN;
+
+/* Writer side, used by usense.c */
+struct usense_shm *usense_shm_create(const char *path, unsigned int entries);
+void usense_shm_update(struct usense_shm *shm, int id, const char *name,
+		       const char *units, const char *text, double value,
+		       uint64_t sampled_ns, const struct timespec *sampled_at,
+		       int status);
+void usense_shm_destroy(struct usense_shm *shm);
+
+#endif /* USENSE_SHM_H */
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdint.h>
+
+#include "usense-stats.h"
+
+static int usense_hist_index(uint64_t ns)
+{
+	int e;
+
+	if (ns < USENSE_HIST_SUB)
+		return ns;
+
+	if (ns >= (1ULL << USENSE_HIST_MAX_BITS))
+		ns = (1ULL << USENSE_HIST_MAX_BITS) - 1;
+
+	e = 63 - __builtin_clzll(ns);
+	return (e - USENSE_HIST_SUB_BITS + 1) * USENSE_HIST_SUB +
+	       ((ns >> (e - USENSE_HIST_SUB_BITS)) & (USENSE_HIST_SUB - 1));
+}
+
+/* The largest value that lands in 'index' */
+static uint64_t usense_hist_value(int index)
+{
+	int e, shift;
+
+	if (index < USENSE_HIST_SUB)
+		return index;
+
+	e = index / USENSE_HIST_SUB + USENSE_HIST_SUB_BITS - 1;
+	shift = e - USENSE_HIST_SUB_BITS;
+	return (((uint64_t)USENSE_HIST_SUB + index % USENSE_HIST_SUB + 1) << shift) - 1;
+}
+
+void usense_hist_add(struct usense_hist *hist, uint64_t ns)
+{
+	if (hist->count == 0 || ns < hist->min)
+		hist->min = ns;
+	if (ns > hist->max)
+		hist->max = ns;
+	hist->count++;
+	hist->sum += ns;
+	hist->bucket[usense_hist_index(ns)]++;
+}
+
+uint64_t usense_hist_percentile(const struct usense_hist *hist, double pct)
+{
+	uint64_t want, seen = 0, ns;
+	int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	want = (uint64_t)(hist->count * pct / 100.0 + 0.5);
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < USENSE_HIST_BUCKETS; i++) {
+		seen += hist->bucket[i];
+		if (seen >= want)
+			break;
+	}
+
+	/* Never report more than was seen */
+	ns = usense_hist_value(i);
+	return (ns > hist->max) ? hist->max : ns;
+}
+
+void usense_hist_cumulative(const struct usense_hist *hist, const uint64_t *le,
+			    uint64_t *count, int n)
+{
+	uint64_t seen = 0;
+	int i = 0, j;
+
+	for (j = 0; j < n; j++) {
+		/* Everything, once past the largest */
+		if (hist->count == 0 || le[j] >= hist->max) {
+			count[j] = hist->count;
+			continue;
+		}
+
+		for (; i < USENSE_HIST_BUCKETS && usense_hist_value(i) <= le[j]; i++)
+			seen += hist->bucket[i];
+		count[j] = seen;
+	}
+}
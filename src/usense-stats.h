@@ -0,0 +1,58 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef USENSE_STATS_H
+#define USENSE_STATS_H
+
+#include <stdint.h>
+
+/* Latency histogram
+ *
+ * Log-linear buckets, as in HdrHistogram: each power of two
+ * is split into 16 linear sub-buckets, so any value is
+ * recorded to within 1/16 (6.25%). Recording is O(1), and
+ * covers 1ns to about 4.9 hours in 2.6KB.
+ */
+#define USENSE_HIST_SUB_BITS	4
+#define USENSE_HIST_SUB		(1 << USENSE_HIST_SUB_BITS)
+#define USENSE_HIST_MAX_BITS	44	/* Largest value, log2 of ns */
+#define USENSE_HIST_BUCKETS	((USENSE_HIST_MAX_BITS - USENSE_HIST_SUB_BITS + 1) * USENSE_HIST_SUB)
+
+struct usense_hist {
+	uint64_t count;
+	uint64_t sum, min, max;		/* In ns */
+	uint32_t bucket[USENSE_HIST_BUCKETS];
+};
+
+void usense_hist_add(struct usense_hist *hist, uint64_t ns);
+
+/* The value 'pct' percent of samples are at or below, to
+ * within the bucket's resolution, in ns. 0 if empty.
+ */
+uint64_t usense_hist_percentile(const struct usense_hist *hist, double pct);
+
+/* How many samples are at or below each of le[0..n-1], which
+ * must be ascending. Only whole buckets count, so each is up
+ * to a bucket's resolution low.
+ */
+void usense_hist_cumulative(const struct usense_hist *hist, const uint64_t *le,
+			    uint64_t *count, int n);
+
+#endif /* USENSE_STATS_H */
@@ -0,0 +1,713 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "usense-usb.h"
+
+static libusb_context *usb_ctx;
+static pthread_once_t usb_once = PTHREAD_ONCE_INIT;
+static int usb_err;
+static const struct usense_usb_backend *usb;
+
+/* Handles with stats attached. There are only ever a few. */
+static pthread_mutex_t usb_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usense_usb_account {
+	libusb_device_handle *usb;
+	struct usense_usb_stats *stats;
+} *usb_account;
+static int usb_accounts;
+
+/************** libusb backend **************/
+
+static int libusb_backend_init(void)
+{
+	int err;
+
+	err = libusb_init(&usb_ctx);
+	if (err < 0)
+		usb_ctx = NULL;
+
+	return err;
+}
+
+static ssize_t libusb_backend_get_device_list(libusb_device ***list)
+{
+	return libusb_get_device_list(usb_ctx, list);
+}
+
+static void libusb_backend_free_device_list(libusb_device **list)
+{
+	libusb_free_device_list(list, 1);
+}
+
+static int libusb_backend_get_interfaces(libusb_device *dev)
+{
+	struct libusb_config_descriptor *config;
+	int err, n;
+
+	err = libusb_get_active_config_descriptor(dev, &config);
+	if (err < 0)
+		return err;
+	n = config->bNumInterfaces;
+	libusb_free_config_descriptor(config);
+
+	return n;
+}
+
+static int libusb_backend_handle_events(struct timeval *tv, int *completed)
+{
+	if (tv == NULL)
+		return libusb_handle_events_completed(usb_ctx, completed);
+
+	return libusb_handle_events_timeout_completed(usb_ctx, tv, completed);
+}
+
+static int libusb_backend_get_pollfds(struct pollfd *pfd, int max)
+{
+	const struct libusb_pollfd **fds;
+	int i;
+
+	fds = libusb_get_pollfds(usb_ctx);
+	if (fds == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; fds[i] != NULL; i++) {
+		if (i < max) {
+			pfd[i].fd = fds[i]->fd;
+			pfd[i].events = fds[i]->events;
+			pfd[i].revents = 0;
+		}
+	}
+	libusb_free_pollfds(fds);
+
+	return i;
+}
+
+static int libusb_backend_get_next_timeout(struct timeval *tv)
+{
+	return libusb_get_next_timeout(usb_ctx, tv);
+}
+
+static void libusb_backend_delay(unsigned int usec)
+{
+	usleep(usec);
+}
+
+static const struct usense_usb_backend usense_usb_libusb = {
+	.name = "libusb",
+	.init = libusb_backend_init,
+	.get_device_list = libusb_backend_get_device_list,
+	.free_device_list = libusb_backend_free_device_list,
+	.ref_device = libusb_ref_device,
+	.unref_device = libusb_unref_device,
+	.get_device_descriptor = libusb_get_device_descriptor,
+	.get_bus_number = libusb_get_bus_number,
+	.get_device_address = libusb_get_device_address,
+	.get_interfaces = libusb_backend_get_interfaces,
+	.open = libusb_open,
+	.close = libusb_close,
+	.detach_kernel_driver = libusb_detach_kernel_driver,
+	.claim_interface = libusb_claim_interface,
+	.submit_transfer = libusb_submit_transfer,
+	.cancel_transfer = libusb_cancel_transfer,
+	.handle_events = libusb_backend_handle_events,
+	.get_pollfds = libusb_backend_get_pollfds,
+	.get_next_timeout = libusb_backend_get_next_timeout,
+	.delay = libusb_backend_delay,
+};
+
+/************** Backend selection **************/
+
+static void usense_usb_init_once(void)
+{
+	const char *name = getenv("USENSE_BACKEND");
+	int err;
+
+	if (name != NULL && strcmp(name, usense_usb_emul.name) == 0)
+		usb = &usense_usb_emul;
+	else
+		usb = &usense_usb_libusb;
+
+	err = usb->init();
+	if (err < 0)
+		usb_err = usense_usb_errno(err);
+}
+
+/* Safe to call from any thread, any number of times */
+int usense_usb_init(void)
+{
+	pthread_once(&usb_once, usense_usb_init_once);
+
+	return usb_err;
+}
+
+libusb_context *usense_usb_context(void)
+{
+	return usb_ctx;
+}
+
+const char *usense_usb_backend(void)
+{
+	return (usb != NULL) ? usb->name : NULL;
+}
+
+/* Only once usense_usb_init() has worked */
+static int usense_usb_ready(void)
+{
+	return usb != NULL && usb_err == 0;
+}
+
+ssize_t usense_usb_device_list(libusb_device ***list)
+{
+	ssize_t n;
+
+	if (usense_usb_init() < 0)
+		return usb_err;
+
+	n = usb->get_device_list(list);
+	return (n < 0) ? usense_usb_errno(n) : n;
+}
+
+void usense_usb_free_device_list(libusb_device **list)
+{
+	usb->free_device_list(list);
+}
+
+libusb_device *usense_usb_ref(libusb_device *dev)
+{
+	return usb->ref_device(dev);
+}
+
+void usense_usb_unref(libusb_device *dev)
+{
+	usb->unref_device(dev);
+}
+
+int usense_usb_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	return usense_usb_errno(usb->get_device_descriptor(dev, desc));
+}
+
+int usense_usb_bus(libusb_device *dev)
+{
+	return usb->get_bus_number(dev);
+}
+
+int usense_usb_address(libusb_device *dev)
+{
+	return usb->get_device_address(dev);
+}
+
+int usense_usb_interfaces(libusb_device *dev)
+{
+	return usense_usb_errno(usb->get_interfaces(dev));
+}
+
+int usense_usb_open(libusb_device *dev, libusb_device_handle **handle)
+{
+	int err;
+
+	err = usb->open(dev, handle);
+	if (err < 0)
+		*handle = NULL;
+
+	return usense_usb_errno(err);
+}
+
+void usense_usb_close(libusb_device_handle *handle)
+{
+	usense_usb_account(handle, NULL);
+	usb->close(handle);
+}
+
+int usense_usb_detach(libusb_device_handle *handle, int iface)
+{
+	return usense_usb_errno(usb->detach_kernel_driver(handle, iface));
+}
+
+int usense_usb_claim(libusb_device_handle *handle, int iface)
+{
+	return usense_usb_errno(usb->claim_interface(handle, iface));
+}
+
+/************** Transfer accounting **************/
+
+int usense_usb_account(libusb_device_handle *handle, struct usense_usb_stats *stats)
+{
+	struct usense_usb_account *tmp;
+	int i, err = 0;
+
+	pthread_mutex_lock(&usb_stats_lock);
+	for (i = 0; i < usb_accounts; i++) {
+		if (usb_account[i].usb == handle)
+			break;
+	}
+
+	if (stats == NULL) {
+		if (i < usb_accounts)
+			usb_account[i] = usb_account[--usb_accounts];
+	} else if (i < usb_accounts) {
+		usb_account[i].stats = stats;
+	} else {
+		tmp = realloc(usb_account, sizeof(*tmp) * (usb_accounts + 1));
+		if (tmp == NULL) {
+			err = -ENOMEM;
+		} else {
+			usb_account = tmp;
+			usb_account[usb_accounts].usb = handle;
+			usb_account[usb_accounts].stats = stats;
+			usb_accounts++;
+		}
+	}
+	pthread_mutex_unlock(&usb_stats_lock);
+
+	return err;
+}
+
+static struct usense_usb_stats *usense_usb_stats_of(libusb_device_handle *handle)
+{
+	struct usense_usb_stats *stats = NULL;
+	int i;
+
+	pthread_mutex_lock(&usb_stats_lock);
+	for (i = 0; i < usb_accounts; i++) {
+		if (usb_account[i].usb == handle) {
+			stats = usb_account[i].stats;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&usb_stats_lock);
+
+	return stats;
+}
+
+int usense_usb_submit(struct libusb_transfer *xfer)
+{
+	struct usense_usb_stats *stats;
+	int err;
+
+	err = usense_usb_errno(usb->submit_transfer(xfer));
+
+	stats = usense_usb_stats_of(xfer->dev_handle);
+	if (stats != NULL) {
+		pthread_mutex_lock(&stats->lock);
+		stats->transfers++;
+		if (err < 0)
+			stats->errors++;
+		pthread_mutex_unlock(&stats->lock);
+	}
+
+	return err;
+}
+
+int usense_usb_cancel(struct libusb_transfer *xfer)
+{
+	return usense_usb_errno(usb->cancel_transfer(xfer));
+}
+
+void usense_usb_delay(unsigned int usec)
+{
+	if (usec == 0)
+		return;
+	if (usense_usb_ready())
+		usb->delay(usec);
+	else
+		usleep(usec);
+}
+
+int usense_usb_errno(int err)
+{
+	switch (err) {
+	case LIBUSB_SUCCESS:		return 0;
+	case LIBUSB_ERROR_IO:		return -EIO;
+	case LIBUSB_ERROR_INVALID_PARAM: return -EINVAL;
+	case LIBUSB_ERROR_ACCESS:	return -EACCES;
+	case LIBUSB_ERROR_NO_DEVICE:	return -ENODEV;
+	case LIBUSB_ERROR_NOT_FOUND:	return -ENOENT;
+	case LIBUSB_ERROR_BUSY:		return -EBUSY;
+	case LIBUSB_ERROR_TIMEOUT:	return -ETIMEDOUT;
+	case LIBUSB_ERROR_OVERFLOW:	return -EOVERFLOW;
+	case LIBUSB_ERROR_PIPE:		return -EPIPE;
+	case LIBUSB_ERROR_INTERRUPTED:	return -EINTR;
+	case LIBUSB_ERROR_NO_MEM:	return -ENOMEM;
+	case LIBUSB_ERROR_NOT_SUPPORTED: return -ENOSYS;
+	default:			return (err > 0) ? err : -EIO;
+	}
+}
+
+int usense_usb_status(const struct libusb_transfer *xfer)
+{
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:	return xfer->actual_length;
+	case LIBUSB_TRANSFER_TIMED_OUT:	return -ETIMEDOUT;
+	case LIBUSB_TRANSFER_CANCELLED:	return -ECANCELED;
+	case LIBUSB_TRANSFER_STALL:	return -EPIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:	return -ENODEV;
+	case LIBUSB_TRANSFER_OVERFLOW:	return -EOVERFLOW;
+	default:			return -EIO;
+	}
+}
+
+static uint64_t usense_usb_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t usense_usb_now_ms(void)
+{
+	return usense_usb_now_ns() / 1000000;
+}
+
+int usense_usb_wait(int *completed, unsigned int timeout)
+{
+	uint64_t deadline = usense_usb_now_ms() + timeout;
+
+	while (!*completed) {
+		struct timeval tv;
+		uint64_t now;
+		int err;
+
+		if (timeout == 0) {
+			err = usb->handle_events(NULL, completed);
+		} else {
+			now = usense_usb_now_ms();
+			if (now >= deadline)
+				return -ETIMEDOUT;
+			tv.tv_sec = (deadline - now) / 1000;
+			tv.tv_usec = ((deadline - now) % 1000) * 1000;
+			err = usb->handle_events(&tv, completed);
+		}
+
+		if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED)
+			return usense_usb_errno(err);
+	}
+
+	return 0;
+}
+
+int usense_usb_handle_events(void)
+{
+	struct timeval tv = { 0, 0 };
+
+	if (!usense_usb_ready())
+		return 0;
+
+	return usense_usb_errno(usb->handle_events(&tv, NULL));
+}
+
+int usense_usb_pollfds(struct pollfd *pfd, int max)
+{
+	if (!usense_usb_ready())
+		return 0;
+
+	return usense_usb_errno(usb->get_pollfds(pfd, max));
+}
+
+int usense_usb_timeout(void)
+{
+	struct timeval tv;
+
+	if (!usense_usb_ready() || usb->get_next_timeout(&tv) != 1)
+		return -1;
+
+	return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+/* Blocking transfers, on top of the async ones
+ *
+ * A transfer can't be freed until the event loop has reaped it.
+ * If the loop keeps failing, it is orphaned instead, and frees
+ * itself if it ever completes. So it has its own copy of the data.
+ */
+#define USENSE_USB_REAP_TRIES	10
+#define USENSE_USB_REAP_MS	100
+
+enum {
+	USENSE_USB_SYNC_ORPHANED = -1,
+	USENSE_USB_SYNC_PENDING = 0,
+	USENSE_USB_SYNC_DONE = 1,
+};
+
+struct usense_usb_sync {
+	int state;
+	int result;
+	unsigned char buffer[];
+};
+
+static struct usense_usb_sync *usense_usb_sync_new(size_t len)
+{
+	struct usense_usb_sync *sync;
+
+	sync = malloc(sizeof(*sync) + len);
+	if (sync == NULL)
+		return NULL;
+
+	sync->state = USENSE_USB_SYNC_PENDING;
+	sync->result = 0;
+
+	return sync;
+}
+
+static void usense_usb_sync_free(struct libusb_transfer *xfer)
+{
+	free(xfer->user_data);
+	libusb_free_transfer(xfer);
+}
+
+static void LIBUSB_CALL usense_usb_sync_cb(struct libusb_transfer *xfer)
+{
+	struct usense_usb_sync *sync = xfer->user_data;
+	int pending = USENSE_USB_SYNC_PENDING;
+
+	sync->result = usense_usb_status(xfer);
+	if (!__atomic_compare_exchange_n(&sync->state, &pending, USENSE_USB_SYNC_DONE, 0,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		usense_usb_sync_free(xfer);
+}
+
+/* Submit a transfer filled in with a usense_usb_sync, and wait
+ * for it. Anything read is copied to 'data', and the transfer
+ * is freed.
+ */
+static int usense_usb_run(struct libusb_transfer *xfer, void *data)
+{
+	struct usense_usb_sync *sync = xfer->user_data;
+	struct usense_usb_stats *stats;
+	int err, tries, orphaned = 0;
+	int pending = USENSE_USB_SYNC_PENDING;
+	uint64_t start;
+
+	stats = usense_usb_stats_of(xfer->dev_handle);
+	start = usense_usb_now_ns();
+
+	err = usense_usb_errno(usb->submit_transfer(xfer));
+	if (err == 0) {
+		err = usense_usb_wait(&sync->state, 0);
+
+		/* The event loop failed. Cancel, and give it a
+		 * few more chances to reap the transfer.
+		 */
+		for (tries = 0; err < 0 && tries < USENSE_USB_REAP_TRIES; tries++) {
+			usense_usb_cancel(xfer);
+			err = usense_usb_wait(&sync->state, USENSE_USB_REAP_MS);
+		}
+
+		if (err < 0 && __atomic_compare_exchange_n(&sync->state, &pending,
+							   USENSE_USB_SYNC_ORPHANED, 0,
+							   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			orphaned = 1;
+		else
+			err = sync->result;
+	}
+
+	if (!orphaned) {
+		if (err > 0 && data != NULL) {
+			if (xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+				memcpy(data, sync->buffer + LIBUSB_CONTROL_SETUP_SIZE, err);
+			else
+				memcpy(data, sync->buffer, err);
+		}
+		usense_usb_sync_free(xfer);
+	}
+
+	if (stats != NULL) {
+		pthread_mutex_lock(&stats->lock);
+		stats->transfers++;
+		if (err < 0)
+			stats->errors++;
+		else
+			stats->bytes += err;
+		usense_hist_add(&stats->latency, usense_usb_now_ns() - start);
+		pthread_mutex_unlock(&stats->lock);
+	}
+
+	return err;
+}
+
+int usense_usb_control(libusb_device_handle *usb, uint8_t type, uint8_t request,
+		       uint16_t value, uint16_t index,
+		       void *data, uint16_t len, unsigned int timeout)
+{
+	struct usense_usb_sync *sync;
+	struct libusb_transfer *xfer;
+
+	xfer = libusb_alloc_transfer(0);
+	sync = usense_usb_sync_new(LIBUSB_CONTROL_SETUP_SIZE + len);
+	if (xfer == NULL || sync == NULL) {
+		free(sync);
+		if (xfer != NULL)
+			libusb_free_transfer(xfer);
+		return -ENOMEM;
+	}
+
+	libusb_fill_control_setup(sync->buffer, type, request, value, index, len);
+	if ((type & LIBUSB_ENDPOINT_IN) == 0 && len > 0)
+		memcpy(sync->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+
+	libusb_fill_control_transfer(xfer, usb, sync->buffer, usense_usb_sync_cb, sync, timeout);
+
+	return usense_usb_run(xfer, (type & LIBUSB_ENDPOINT_IN) ? data : NULL);
+}
+
+/* Queued transfers complete on whichever thread runs the
+ * event loop, so 'pending' and 'err' are only touched atomically.
+ */
+static void LIBUSB_CALL usense_usb_queue_cb(struct libusb_transfer *xfer)
+{
+	struct usense_usb_queue *q = xfer->user_data;
+	int err, none = 0;
+
+	err = usense_usb_status(xfer);
+	if (err < 0)
+		__atomic_compare_exchange_n(&q->err, &none, err, 0,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+	free(xfer->buffer);
+	libusb_free_transfer(xfer);
+
+	__atomic_sub_fetch(&q->pending, 1, __ATOMIC_RELEASE);
+}
+
+/* Run the event loop until no more than 'max' are pending. Another
+ * thread may be the one to complete them, so don't block for long.
+ */
+static void usense_usb_drain(struct usense_usb_queue *q, int max)
+{
+	struct timeval tv;
+
+	while (__atomic_load_n(&q->pending, __ATOMIC_ACQUIRE) > max) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 10000;
+		usb->handle_events(&tv, NULL);
+	}
+}
+
+int usense_usb_control_queue(struct usense_usb_queue *q, uint8_t type, uint8_t request,
+			     uint16_t value, uint16_t index,
+			     const void *data, uint16_t len, unsigned int timeout)
+{
+	struct libusb_transfer *xfer;
+	unsigned char *buff;
+	int err;
+
+	if (type & LIBUSB_ENDPOINT_IN)
+		return -EINVAL;
+
+	usense_usb_drain(q, USENSE_USB_QUEUE_MAX - 1);
+
+	xfer = libusb_alloc_transfer(0);
+	buff = malloc(LIBUSB_CONTROL_SETUP_SIZE + len);
+	if (xfer == NULL || buff == NULL) {
+		free(buff);
+		if (xfer != NULL)
+			libusb_free_transfer(xfer);
+		return -ENOMEM;
+	}
+
+	libusb_fill_control_setup(buff, type, request, value, index, len);
+	if (len > 0)
+		memcpy(buff + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+
+	libusb_fill_control_transfer(xfer, q->usb, buff, usense_usb_queue_cb, q, timeout);
+
+	__atomic_add_fetch(&q->pending, 1, __ATOMIC_RELAXED);
+	err = usense_usb_submit(xfer);
+	if (err < 0) {
+		__atomic_sub_fetch(&q->pending, 1, __ATOMIC_RELAXED);
+		free(buff);
+		libusb_free_transfer(xfer);
+	}
+
+	return err;
+}
+
+int usense_usb_flush(struct usense_usb_queue *q)
+{
+	usense_usb_drain(q, 0);
+
+	return __atomic_exchange_n(&q->err, 0, __ATOMIC_RELAXED);
+}
+
+int usense_usb_interrupt(libusb_device_handle *usb, uint8_t endpoint,
+			 void *data, int len, unsigned int timeout)
+{
+	struct usense_usb_sync *sync;
+	struct libusb_transfer *xfer;
+
+	if (len < 0)
+		return -EINVAL;
+
+	xfer = libusb_alloc_transfer(0);
+	sync = usense_usb_sync_new(len);
+	if (xfer == NULL || sync == NULL) {
+		free(sync);
+		if (xfer != NULL)
+			libusb_free_transfer(xfer);
+		return -ENOMEM;
+	}
+
+	if ((endpoint & LIBUSB_ENDPOINT_IN) == 0 && len > 0)
+		memcpy(sync->buffer, data, len);
+
+	libusb_fill_interrupt_transfer(xfer, usb, endpoint, sync->buffer, len,
+				       usense_usb_sync_cb, sync, timeout);
+
+	return usense_usb_run(xfer, (endpoint & LIBUSB_ENDPOINT_IN) ? data : NULL);
+}
+
+int usense_usb_bulk(libusb_device_handle *usb, uint8_t endpoint,
+		    void *data, int len, unsigned int timeout)
+{
+	struct usense_usb_sync *sync;
+	struct libusb_transfer *xfer;
+
+	if (len < 0)
+		return -EINVAL;
+
+	xfer = libusb_alloc_transfer(0);
+	sync = usense_usb_sync_new(len);
+	if (xfer == NULL || sync == NULL) {
+		free(sync);
+		if (xfer != NULL)
+			libusb_free_transfer(xfer);
+		return -ENOMEM;
+	}
+
+	if ((endpoint & LIBUSB_ENDPOINT_IN) == 0 && len > 0)
+		memcpy(sync->buffer, data, len);
+
+	libusb_fill_bulk_transfer(xfer, usb, endpoint, sync->buffer, len,
+				  usense_usb_sync_cb, sync, timeout);
+
+	return usense_usb_run(xfer, (endpoint & LIBUSB_ENDPOINT_IN) ? data : NULL);
+}
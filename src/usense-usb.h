@@ -0,0 +1,179 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef USENSE_USB_H
+#define USENSE_USB_H
+
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <libusb.h>
+
+#include "usense-stats.h"
+
+/* USB helpers for the drivers
+ *
+ * All transfers are libusb-1.0 asynchronous transfers, completed by
+ * the one shared event loop. The blocking helpers below submit a
+ * transfer and run that loop until it is done, so transfers from other
+ * threads (or the monitor) are completed in the meantime.
+ *
+ * All return the transferred length, or -errno.
+ */
+
+/* USB backends
+ *
+ * USENSE_BACKEND picks one when the library is first used:
+ * "libusb" (the default) talks to real hardware, and "emul"
+ * emulates the supported sensors (see usense-emul.c).
+ *
+ * Each op follows the libusb call of the same name, and
+ * returns LIBUSB_ERROR_* codes. Emulated devices and handles
+ * are the backend's own objects, behind the libusb types.
+ */
+struct usense_usb_backend {
+	const char *name;
+	int (*init)(void);
+	ssize_t (*get_device_list)(libusb_device ***list);
+	void (*free_device_list)(libusb_device **list);
+	libusb_device *(*ref_device)(libusb_device *dev);
+	void (*unref_device)(libusb_device *dev);
+	int (*get_device_descriptor)(libusb_device *dev, struct libusb_device_descriptor *desc);
+	uint8_t (*get_bus_number)(libusb_device *dev);
+	uint8_t (*get_device_address)(libusb_device *dev);
+	int (*get_interfaces)(libusb_device *dev);	/* In the active config */
+	int (*open)(libusb_device *dev, libusb_device_handle **usb);
+	void (*close)(libusb_device_handle *usb);
+	int (*detach_kernel_driver)(libusb_device_handle *usb, int iface);
+	int (*claim_interface)(libusb_device_handle *usb, int iface);
+	int (*submit_transfer)(struct libusb_transfer *xfer);
+	int (*cancel_transfer)(struct libusb_transfer *xfer);
+	/* 'tv' NULL blocks, 'completed' may be NULL */
+	int (*handle_events)(struct timeval *tv, int *completed);
+	int (*get_pollfds)(struct pollfd *pfd, int max);
+	int (*get_next_timeout)(struct timeval *tv);
+	void (*delay)(unsigned int usec);
+};
+
+extern const struct usense_usb_backend usense_usb_emul;
+
+/* The libusb context, or NULL if it is not in use */
+libusb_context *usense_usb_context(void);
+int usense_usb_init(void);
+const char *usense_usb_backend(void);
+
+/* Device discovery, and opening, via the backend.
+ * All return -errno on failure.
+ */
+ssize_t usense_usb_device_list(libusb_device ***list);
+void usense_usb_free_device_list(libusb_device **list);
+libusb_device *usense_usb_ref(libusb_device *dev);
+void usense_usb_unref(libusb_device *dev);
+int usense_usb_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc);
+int usense_usb_bus(libusb_device *dev);
+int usense_usb_address(libusb_device *dev);
+int usense_usb_interfaces(libusb_device *dev);
+int usense_usb_open(libusb_device *dev, libusb_device_handle **usb);
+void usense_usb_close(libusb_device_handle *usb);
+int usense_usb_detach(libusb_device_handle *usb, int iface);
+int usense_usb_claim(libusb_device_handle *usb, int iface);
+
+/* Asynchronous transfers, from libusb_alloc_transfer() */
+int usense_usb_submit(struct libusb_transfer *xfer);
+int usense_usb_cancel(struct libusb_transfer *xfer);
+
+/* Transfer accounting
+ *
+ * Every transfer on a handle that has stats attached is
+ * counted. Blocking transfers also record their bytes,
+ * errors and latency; asynchronous ones are only counted,
+ * since their latency is up to the device.
+ *
+ * Closing the handle detaches the stats.
+ */
+struct usense_usb_stats {
+	pthread_mutex_t lock;
+	uint64_t transfers;
+	uint64_t errors;
+	uint64_t bytes;
+	struct usense_hist latency;
+};
+
+int usense_usb_account(libusb_device_handle *usb, struct usense_usb_stats *stats);
+
+/* Drivers' settling delays. The emulator runs these
+ * on its own clock, rather than sleeping.
+ */
+void usense_usb_delay(unsigned int usec);
+
+/* Map a LIBUSB_ERROR_* code, or a transfer's status, to -errno */
+int usense_usb_errno(int err);
+int usense_usb_status(const struct libusb_transfer *xfer);
+
+int usense_usb_control(libusb_device_handle *usb, uint8_t type, uint8_t request,
+		       uint16_t value, uint16_t index,
+		       void *data, uint16_t len, unsigned int timeout);
+int usense_usb_interrupt(libusb_device_handle *usb, uint8_t endpoint,
+			 void *data, int len, unsigned int timeout);
+int usense_usb_bulk(libusb_device_handle *usb, uint8_t endpoint,
+		    void *data, int len, unsigned int timeout);
+
+/* Queued control transfers
+ *
+ * For runs of OUT requests that nothing waits on, such as
+ * bit-banged line changes. Each is submitted straight away,
+ * and they complete in order on the default pipe, so only
+ * the last one costs a round trip. usense_usb_flush() waits
+ * for them all, and returns the first error since the last
+ * flush, if any.
+ */
+#define USENSE_USB_QUEUE_MAX	32	/* In flight, per queue */
+
+struct usense_usb_queue {
+	libusb_device_handle *usb;
+	int pending;		/* Submitted, not yet completed */
+	int err;		/* First error, or 0 */
+};
+
+int usense_usb_control_queue(struct usense_usb_queue *q, uint8_t type, uint8_t request,
+			     uint16_t value, uint16_t index,
+			     const void *data, uint16_t len, unsigned int timeout);
+int usense_usb_flush(struct usense_usb_queue *q);
+
+/* Run the event loop until '*completed' is set by a transfer
+ * callback, or 'timeout' ms have passed (0 = forever).
+ *
+ * Returns 0, or -ETIMEDOUT.
+ */
+int usense_usb_wait(int *completed, unsigned int timeout);
+
+/* Handle any ready events without blocking */
+int usense_usb_handle_events(void);
+
+/* Fill in up to 'max' pollfds for the event loop.
+ * Returns the number of fds libusb is using, or -errno.
+ */
+int usense_usb_pollfds(struct pollfd *pfd, int max);
+
+/* Time until libusb's next transfer timeout, in ms, or -1 */
+int usense_usb_timeout(void);
+
+#endif /* USENSE_USB_H */
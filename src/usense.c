@@ -24,11 +24,22 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
-#include <usb.h>
+#include <libusb.h>
 
 #include "usense.h"
+#include "usense-usb.h"
+#include "usense-shm.h"
+#include "usense-stats.h"
 #include "units.h"
 
 #ifndef ARRAY_SIZE
@@ -40,11 +51,53 @@
 	 ((obj *)((char *)(var) - offsetof(obj, field)))
 #endif
 
+/* Well known properties live in fixed slots
+ */
+enum usense_key {
+	USENSE_KEY_DEVICE,
+	USENSE_KEY_TYPE,
+	USENSE_KEY_UNITS,
+	USENSE_KEY_READING,
+	USENSE_KEY_NAME,
+	USENSE_KEY_CALIBRATE_ADD,
+	USENSE_KEY_CALIBRATE_MULT,
+	USENSE_KEY_USB_VENDOR,
+	USENSE_KEY_USB_PRODUCT,
+	USENSE_KEY_READING_MAX_AGE,
+	USENSE_KEY_READING_STALE,
+	USENSE_KEY_HISTORY_SIZE,
+	USENSE_KEY_MAX,
+	USENSE_KEY_OTHER = -1,	/* Driver specific property */
+};
+
+static const char *usense_key_name[USENSE_KEY_MAX] = {
+	[USENSE_KEY_DEVICE]		= "device",
+	[USENSE_KEY_TYPE]		= "type",
+	[USENSE_KEY_UNITS]		= "units",
+	[USENSE_KEY_READING]		= "reading",
+	[USENSE_KEY_NAME]		= "name",
+	[USENSE_KEY_CALIBRATE_ADD]	= "calibrate.add",
+	[USENSE_KEY_CALIBRATE_MULT]	= "calibrate.mult",
+	[USENSE_KEY_USB_VENDOR]		= "usb.vendor",
+	[USENSE_KEY_USB_PRODUCT]	= "usb.product",
+	[USENSE_KEY_READING_MAX_AGE]	= "reading.max_age_ms",
+	[USENSE_KEY_READING_STALE]	= "reading.stale_while_revalidate",
+	[USENSE_KEY_HISTORY_SIZE]	= "history.size",
+};
+
+static uint32_t usense_key_hash[USENSE_KEY_MAX];
+
 struct usense_prop {
+	struct usense_prop *hash_next;	/* Driver property hash chain */
+	struct usense_prop *next;	/* All properties, sorted by key */
+	uint32_t hash;
+	enum usense_key slot;
 	const char *key;
-	char *value;
+	char value[USENSE_PROP_MAX];
 };
 
+#define USENSE_PROP_HASH	16	/* Driver property hash buckets */
+
 /* Powers of 10 from 10^-16 to 10^15 */
 #define USENSE_UNITS_of(x)		((x) & ~0x1f)
 #define USENSE_UNITS_POW_10(x)		((uint32_t)(x) & 0x1f)
@@ -55,22 +108,141 @@ struct usense_prop {
 #define USENSE_UNITS_KELVIN		(3 << 5)
 #define USENSE_UNITS_FAHRENHEIT		(4 << 5)
 
+/* Lock-free access to single words shared between threads */
+#define USENSE_LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define USENSE_STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/* Largest 'history.size', 32MB worth per device */
+#define USENSE_HISTORY_MAX	(1 << 20)
+
+/* One sample in a device's history ring
+ */
+struct usense_history_entry {
+	uint64_t ns;		/* CLOCK_MONOTONIC of the sample */
+	struct timespec at;	/* ..and its CLOCK_REALTIME */
+	double raw;		/* Native units */
+};
+
+/* The converted reading, as published for lock-free readers
+ */
+struct usense_reading {
+	int valid;		/* Numeric, so 'value' and 'text' are good */
+	double value;		/* In the device's units */
+	uint64_t sampled_ns;	/* CLOCK_MONOTONIC of the sample */
+	struct timespec sampled_at;	/* ..and its CLOCK_REALTIME */
+	char text[32];		/* 'value', formatted */
+};
+
+/* Locking
+ *
+ * usense->lock covers the device table writers, the removed list,
+ * and the monitor's state. Each device's own lock covers its
+ * properties and update state, so one slow sensor never holds up
+ * another. When both are needed, take usense->lock first.
+ *
+ * Readers never lock the device table, nor the device's published
+ * reading.
+ */
 struct usense_device {
-	struct usense_device *next, **pprev;
-	enum { USENSE_MODE_READ, USENSE_MODE_UPDATE } mode;
-	char name[PATH_MAX];
+	struct usense_device *next;	/* Removed list */
+	struct usense *usense;
+	enum { USENSE_MODE_READ, USENSE_MODE_UPDATE, USENSE_MODE_REMOVED } mode;
+	int attaching;		/* Being attached, under usense->lock */
+	int refresh;		/* Monitor should refresh, under usense->lock */
+	int sampled;		/* Reading is kept fresh by the monitor */
+	int id;			/* Index in the device table */
+	uint32_t name_hash;
+	char name[USENSE_NAME_MAX];
 	const struct usense_probe *probe;
 	void *priv;
-	struct usense_prop *prop;	/* bsearch */
-	int props;
 	void *handle;	/* device type handle */
+	libusb_device_handle *usb;	/* Open USB handle, once attached */
+
+	/* Everything below is under 'lock' */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* Update completion */
+	struct usense_prop *slot[USENSE_KEY_MAX];	/* Well known */
+	struct usense_prop *hash[USENSE_PROP_HASH];	/* Driver specific */
+	struct usense_prop *props;	/* All, sorted by key */
+
+	/* Hardware update state */
+	int updating;		/* update() in progress */
+	pthread_t updater;	/* ..and the thread running it */
+	unsigned int update_seq;	/* Completed update() count */
+	int update_err;		/* ..and the last result */
+	uint64_t sampled_ns;	/* CLOCK_MONOTONIC of the last sample */
+	struct timespec sampled_at;	/* ..and its CLOCK_REALTIME */
+	unsigned int max_age_ms;	/* reading.max_age_ms */
+	int stale_ok;		/* reading.stale_while_revalidate */
+	unsigned int generation;	/* Property change count */
+	struct usense_stats stats;	/* Update counts, and.. */
+	struct usense_hist update_hist;	/* ..their latency */
+	struct usense_usb_stats usb_stats;	/* Transfers, on their own lock */
+
+	/* Compiled "reading" conversion */
+	unsigned int sample;	/* Raw reading generation */
+	int raw_valid;		/* Raw reading is numeric */
+	double raw;		/* ..in native units */
+	struct {
+		int valid;	/* Clear on units or calibrate.* change */
+		double scale;	/* reading = raw * scale + offset */
+		double offset;
+		int integer;	/* Milli, micro and nano units are integer */
+	} xform;
+
+	/* Published reading, a seqlock. Written under 'lock',
+	 * read with usense_reading_load().
+	 */
+	unsigned int pub_seq;		/* Odd while being written */
+	unsigned int pub_sample;	/* 'sample' that 'pub' was made from */
+	struct usense_reading pub;
+
+	/* Sample history, 'history.size' long */
+	struct usense_history_entry *ring;
+	unsigned int ring_size;
+	unsigned int ring_head;		/* Next to be written */
+	unsigned int ring_count;
+};
+
+/* The device table
+ *
+ * Tables are never changed once published. Adding or removing
+ * a device publishes a new copy, so readers need no lock. They
+ * do count themselves in, with usense_table_get(), so that an
+ * old table is only freed once no reader can still be using it.
+ */
+struct usense_table {
+	struct usense_table *retired;	/* Next one waiting to be freed */
+	int devs;			/* Entries in dev[] */
+	unsigned int mask;		/* name[] has mask + 1 entries */
+	struct usense_device **name;	/* By name hash, open addressed */
+	struct usense_device *dev[];	/* By id, NULL once removed */
 };
 
 struct usense {
 	int fd;		/* Reading FD */
-	struct usense_device *devices;
+	int notify_fd;	/* Writing FD */
+	int wake[2];	/* Monitor wakeup */
+	int uevent_fd;	/* Kernel hotplug events */
+	struct usense_table *table;	/* Current device table */
+	unsigned int epoch;		/* Of table readers, see usense_table_get() */
+	unsigned int readers[2];	/* ..in each epoch, by its low bit */
+	struct usense_table *retired;	/* Replaced during this epoch */
+	struct usense_table *grace;	/* ..and before it */
+	struct usense_device *removed;	/* Unplugged, freed on stop */
+
+	pthread_mutex_t lock;	/* Device table updates, monitor state */
+	pthread_cond_t cond;	/* Attach completion */
+	pthread_mutex_t scan_lock;	/* One rescan at a time */
+	pthread_t monitor;
+	int running;
+	int refresh;		/* Some device wants a refresh */
+	unsigned int interval;	/* Sampling period, in ms */
+	struct usense_shm *shm;	/* Published snapshot, or NULL */
+	unsigned int samples;	/* Completed updates, of all devices */
 };
 
+static pthread_mutex_t dev_probe_lock = PTHREAD_MUTEX_INITIALIZER;
 static const struct usense_probe **dev_probe;
 static int dev_probes;
 
@@ -82,42 +254,88 @@ extern const struct usense_probe _usense_probe_PCsensor_Temper;
  */
 int usense_probe_register(const struct usense_probe *probe)
 {
+	const struct usense_probe **tmp;
 	int i;
+
+	pthread_mutex_lock(&dev_probe_lock);
 	for (i = 0; i < dev_probes; i++) {
 		if (dev_probe[i] == probe) {
+			pthread_mutex_unlock(&dev_probe_lock);
 			return -EEXIST;
 		}
 	}
 
-	dev_probe = realloc(dev_probe, sizeof(*dev_probe) * (dev_probes + 1));
-	assert(dev_probe != NULL);
+	tmp = realloc(dev_probe, sizeof(*dev_probe) * (dev_probes + 1));
+	if (tmp == NULL) {
+		pthread_mutex_unlock(&dev_probe_lock);
+		return -ENOMEM;
+	}
+	dev_probe = tmp;
 	dev_probe[dev_probes++] = probe;
+	pthread_mutex_unlock(&dev_probe_lock);
+
+	return 0;
 }
 
 void usense_probe_unregister(const struct usense_probe *probe)
 {
 	int i;
+
+	pthread_mutex_lock(&dev_probe_lock);
 	for (i = 0; i < dev_probes; i++) {
 		if (dev_probe[i] == probe) {
 			break;
 		}
 	}
 
-	if (i == dev_probes) {
-		return;
+	if (i < dev_probes) {
+		memmove(&dev_probe[i], &dev_probe[i+1], sizeof(*dev_probe) * (dev_probes - i - 1));
+		dev_probes--;
+	}
+	pthread_mutex_unlock(&dev_probe_lock);
+}
+
+/* FNV-1a */
+static uint32_t usense_hash_of(const char *key)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*key != 0) {
+		hash ^= (uint8_t)*(key++);
+		hash *= 16777619U;
 	}
 
-	memcpy(&dev_probe[i], &dev_probe[i+1], sizeof(*dev_probe) * (dev_probes - i - 1));
-	dev_probes--;
+	return hash;
+}
+
+static pthread_once_t usense_key_once = PTHREAD_ONCE_INIT;
+
+static void usense_key_init(void)
+{
+	int i;
+
+	for (i = 0; i < USENSE_KEY_MAX; i++) {
+		usense_key_hash[i] = usense_hash_of(usense_key_name[i]);
+	}
 }
 
 static int usense_init(void)
 {
-	if (dev_probes == 0) {
+	int probes;
+
+	pthread_mutex_lock(&dev_probe_lock);
+	probes = dev_probes;
+	pthread_mutex_unlock(&dev_probe_lock);
+
+	if (probes == 0) {
 		usense_probe_register(&_usense_probe_gotemp);
 		usense_probe_register(&_usense_probe_TEMPer);
 		usense_probe_register(&_usense_probe_PCsensor_Temper);
 	}
+
+	pthread_once(&usense_key_once, usense_key_init);
+
+	return 0;
 }
 
 
@@ -137,40 +355,473 @@ static struct usense *usense_new(void)
 	usense_init();
 
 	usense = calloc(1, sizeof(*usense));
+	if (usense == NULL)
+		return NULL;
+
 	usense->fd = -1;
+	usense->notify_fd = -1;
+	usense->wake[0] = usense->wake[1] = -1;
+	usense->uevent_fd = -1;
+	usense->interval = USENSE_MONITOR_INTERVAL;
+	pthread_mutex_init(&usense->lock, NULL);
+	pthread_cond_init(&usense->cond, NULL);
+	pthread_mutex_init(&usense->scan_lock, NULL);
 
 	return usense;
 }
 
+static int usense_device_update(struct usense_device *dev);
+static void usense_notify(struct usense_device *dev, const char *key);
+static void usense_reading_publish(struct usense_device *dev);
+
+/* Use the current table, without usense->lock, until
+ * usense_table_put(). Don't block in between.
+ *
+ * Readers count themselves in the epoch they started in. Once
+ * nobody is left in the epoch before this one, the tables that
+ * were replaced before this one began can be freed.
+ */
+static struct usense_table *usense_table_get(struct usense *usense, unsigned int *epoch)
+{
+	unsigned int e;
+
+	for (;;) {
+		e = __atomic_load_n(&usense->epoch, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&usense->readers[e & 1], 1, __ATOMIC_SEQ_CST);
+		/* Moved on meanwhile? Then we might be missed. */
+		if (__atomic_load_n(&usense->epoch, __ATOMIC_SEQ_CST) == e)
+			break;
+		__atomic_fetch_sub(&usense->readers[e & 1], 1, __ATOMIC_SEQ_CST);
+	}
+
+	*epoch = e;
+	return __atomic_load_n(&usense->table, __ATOMIC_ACQUIRE);
+}
+
+static void usense_table_put(struct usense *usense, unsigned int epoch)
+{
+	__atomic_fetch_sub(&usense->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+}
+
+static struct usense_device *usense_table_find(struct usense_table *tbl, const char *name)
+{
+	struct usense_device *dev;
+	uint32_t hash;
+	unsigned int i;
+
+	if (tbl == NULL)
+		return NULL;
+
+	hash = usense_hash_of(name);
+	for (i = hash & tbl->mask; (dev = tbl->name[i]) != NULL; i = (i + 1) & tbl->mask) {
+		if (dev->name_hash == hash && strcmp(dev->name, name) == 0)
+			return dev;
+	}
+
+	return NULL;
+}
+
+static struct usense_device *usense_lookup(struct usense *usense, const char *name)
+{
+	struct usense_device *dev;
+	unsigned int epoch;
+
+	dev = usense_table_find(usense_table_get(usense, &epoch), name);
+	usense_table_put(usense, epoch);
+
+	return dev;
+}
+
+static void usense_table_free(struct usense_table *tbl)
+{
+	struct usense_table *next;
+
+	for (; tbl != NULL; tbl = next) {
+		next = tbl->retired;
+		free(tbl);
+	}
+}
+
+/* Free the tables nobody can still see, and start a new epoch.
+ * If readers from the last one are still about, try again at
+ * the next change.
+ *
+ * Called with usense->lock held.
+ */
+static void usense_table_reclaim(struct usense *usense)
+{
+	unsigned int e = usense->epoch;
+
+	if (__atomic_load_n(&usense->readers[(e + 1) & 1], __ATOMIC_SEQ_CST) != 0)
+		return;
+
+	usense_table_free(usense->grace);
+	usense->grace = usense->retired;
+	usense->retired = NULL;
+	__atomic_store_n(&usense->epoch, e + 1, __ATOMIC_SEQ_CST);
+}
+
+/* Publish a copy of the device table, with dev[id] replaced
+ *
+ * Called with usense->lock held.
+ */
+static int usense_table_set(struct usense *usense, int id, struct usense_device *dev)
+{
+	struct usense_table *old = usense->table, *tbl;
+	int i, devs = (old == NULL) ? 0 : old->devs;
+	unsigned int j, mask;
+
+	if (id >= devs)
+		devs = id + 1;
+
+	/* Keep the name index at most half full */
+	for (mask = 7; mask + 1 < devs * 2; mask = mask * 2 + 1);
+
+	tbl = calloc(1, sizeof(*tbl) + sizeof(tbl->dev[0]) * devs +
+			sizeof(tbl->name[0]) * (mask + 1));
+	if (tbl == NULL)
+		return -ENOMEM;
+
+	tbl->devs = devs;
+	tbl->mask = mask;
+	tbl->name = &tbl->dev[devs];
+
+	for (i = 0; i < devs; i++) {
+		if (i == id)
+			tbl->dev[i] = dev;
+		else if (old != NULL && i < old->devs)
+			tbl->dev[i] = old->dev[i];
+
+		if (tbl->dev[i] == NULL)
+			continue;
+
+		for (j = tbl->dev[i]->name_hash & mask; tbl->name[j] != NULL; j = (j + 1) & mask);
+		tbl->name[j] = tbl->dev[i];
+	}
+
+	__atomic_store_n(&usense->table, tbl, __ATOMIC_RELEASE);
+
+	if (old != NULL) {
+		old->retired = usense->retired;
+		usense->retired = old;
+	}
+	usense_table_reclaim(usense);
+
+	return 0;
+}
+
+static uint64_t usense_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Non-blocking, close-on-exec pipe
+ */
+static int usense_pipe(int fds[2])
+{
+	int i;
+
+	if (pipe(fds) < 0)
+		return -errno;
+
+	for (i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	return 0;
+}
+
+static void usense_monitor_wake(struct usense *usense)
+{
+	char c = 0;
+	ssize_t len;
+
+	if (usense->wake[1] >= 0) {
+		len = write(usense->wake[1], &c, 1);
+		(void)len;
+	}
+}
+
+static void usense_hotplug(struct usense *usense);
+
+/* Monitor thread - samples all opened devices
+ * once every 'interval' ms, refreshes stale
+ * readings on request, and tracks hotplug events.
+ */
+static void *usense_monitor(void *arg)
+{
+	struct usense *usense = arg;
+	struct usense_device *dev;
+	struct usense_table *tbl;
+	struct pollfd *pfd = NULL;
+	uint64_t deadline, now;
+	unsigned int interval;
+	int i, err, pfds = 0;
+
+	pthread_mutex_lock(&usense->lock);
+	deadline = usense_now_ns();
+	interval = usense->interval;
+	while (usense->running) {
+		if (!usense->refresh) {
+			int timeout = -1, usb_timeout, usb_fds;
+			char buff[64];
+
+			now = usense_now_ns();
+			if (usense->interval != 0)
+				timeout = (deadline > now) ? (deadline - now + 999999) / 1000000 : 0;
+
+			/* libusb's fds change as devices are opened and closed,
+			 * so fetch them every time around.
+			 */
+			usb_fds = usense_usb_pollfds(NULL, 0);
+			if (usb_fds < 0)
+				usb_fds = 0;
+			if (2 + usb_fds > pfds) {
+				struct pollfd *tmp;
+
+				tmp = realloc(pfd, sizeof(*pfd) * (2 + usb_fds));
+				if (tmp == NULL) {
+					usb_fds = pfds - 2;
+				} else {
+					pfd = tmp;
+					pfds = 2 + usb_fds;
+				}
+			}
+			if (usb_fds > 0)
+				usb_fds = usense_usb_pollfds(&pfd[2], usb_fds);
+			if (usb_fds < 0)
+				usb_fds = 0;
+
+			pfd[0].fd = usense->wake[0];
+			pfd[0].events = POLLIN;
+			pfd[1].fd = usense->uevent_fd;
+			pfd[1].events = POLLIN;
+			pfd[0].revents = pfd[1].revents = 0;
+
+			usb_timeout = usense_usb_timeout();
+			if (usb_timeout >= 0 && (timeout < 0 || usb_timeout < timeout))
+				timeout = usb_timeout;
+
+			pthread_mutex_unlock(&usense->lock);
+			poll(pfd, 2 + usb_fds, timeout);
+			if (pfd[0].revents & POLLIN) {
+				while (read(usense->wake[0], buff, sizeof(buff)) > 0);
+			}
+			if (pfd[1].revents & POLLIN) {
+				usense_hotplug(usense);
+			}
+
+			/* Complete USB transfers, and expire their timeouts */
+			for (i = 2; i < 2 + usb_fds && usb_timeout < 0; i++) {
+				if (pfd[i].revents)
+					usb_timeout = 0;
+			}
+			if (usb_timeout >= 0)
+				usense_usb_handle_events();
+			pthread_mutex_lock(&usense->lock);
+		}
+
+		/* Stale-while-revalidate refreshes */
+		if (usense->refresh) {
+			usense->refresh = 0;
+			/* The table can change while we're unlocked */
+			for (i = 0; (tbl = usense->table) != NULL && i < tbl->devs && usense->running; i++) {
+				dev = tbl->dev[i];
+				if (dev == NULL || !dev->refresh)
+					continue;
+
+				dev->refresh = 0;
+				pthread_mutex_unlock(&usense->lock);
+				usense_device_update(dev);
+				pthread_mutex_lock(&usense->lock);
+			}
+		}
+
+		/* New period? Start it now. */
+		now = usense_now_ns();
+		if (usense->interval != interval) {
+			interval = usense->interval;
+			deadline = now;
+		}
+
+		if (interval == 0)
+			continue;
+
+		if (now < deadline)
+			continue;
+
+		for (i = 0; (tbl = usense->table) != NULL && i < tbl->devs && usense->running; i++) {
+			dev = tbl->dev[i];
+			if (dev == NULL || USENSE_LOAD(dev->mode) != USENSE_MODE_READ)
+				continue;
+
+			pthread_mutex_unlock(&usense->lock);
+			err = usense_device_update(dev);
+			USENSE_STORE(dev->sampled, (err >= 0));
+			pthread_mutex_lock(&usense->lock);
+		}
+
+		/* Schedule from the previous deadline, so we
+		 * don't drift. If we've fallen behind, skip ahead.
+		 */
+		deadline += interval * 1000000ULL;
+		now = usense_now_ns();
+		if (now >= deadline)
+			deadline = now;
+	}
+	pthread_mutex_unlock(&usense->lock);
+
+	free(pfd);
+	return NULL;
+}
+
+/* Kernel uevents, for USB hotplug
+ */
+static int usense_uevent_open(void)
+{
+	struct sockaddr_nl nl;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -errno;
+
+	memset(&nl, 0, sizeof(nl));
+	nl.nl_family = AF_NETLINK;
+	nl.nl_pid = 0;
+	nl.nl_groups = 1;	/* Kernel events */
+
+	if (bind(fd, (struct sockaddr *)&nl, sizeof(nl)) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
 struct usense *usense_start(void)
 {
 	struct usense *usense;
+	int fds[2];
 
 	usense = usense_new();
+	if (usense == NULL)
+		return NULL;
+
+	/* Listen for hotplug before the first scan, so
+	 * we don't miss anything. Without it (ie in a container)
+	 * use usense_detect() to rescan.
+	 */
+	usense->uevent_fd = usense_uevent_open();
 
 	usense_detect(usense);
 
-	/* TODO */
+	/* Change records are written to a non-blocking pipe.
+	 * A record is smaller than PIPE_BUF, so writes are atomic.
+	 */
+	if (usense_pipe(fds) < 0) {
+		usense_stop(usense);
+		return NULL;
+	}
+	usense->fd = fds[0];
+	usense->notify_fd = fds[1];
+
+	if (usense_pipe(usense->wake) < 0) {
+		usense_stop(usense);
+		return NULL;
+	}
+
+	usense->running = 1;
+	if (pthread_create(&usense->monitor, NULL, usense_monitor, usense) != 0) {
+		usense->running = 0;
+		usense_stop(usense);
+		return NULL;
+	}
 
 	return usense;
 }
 
 static void usense_device_free(struct usense_device *dev)
 {
-	free(dev->prop);
+	struct usense_prop *prop, *tmp;
+
+	if (dev->priv != NULL && dev->probe->release != NULL)
+		dev->probe->release(dev->priv);
+
+	if (dev->probe->type == USENSE_PROBE_USB) {
+		if (dev->usb != NULL)
+			usense_usb_close(dev->usb);
+		if (dev->handle != NULL)
+			usense_usb_unref(dev->handle);
+	}
+
+	for (prop = dev->props; prop != NULL; prop = tmp) {
+		tmp = prop->next;
+		if (prop->slot == USENSE_KEY_OTHER)
+			free((char *)prop->key);
+		free(prop);
+	}
+	free(dev->ring);
+	pthread_cond_destroy(&dev->cond);
+	pthread_mutex_destroy(&dev->usb_stats.lock);
+	pthread_mutex_destroy(&dev->lock);
 	free(dev);
 }
 
 void usense_stop(struct usense *usense)
 {
 	struct usense_device *dev, *tmp;
+	struct usense_table *tbl;
+	int i;
 
-	for (dev = usense->devices; dev != NULL; ) {
-		tmp = dev->next;
+	if (usense->running) {
+		pthread_mutex_lock(&usense->lock);
+		USENSE_STORE(usense->running, 0);
+		pthread_mutex_unlock(&usense->lock);
+		usense_monitor_wake(usense);
+		pthread_join(usense->monitor, NULL);
+	}
+
+	if (usense->fd >= 0)
+		close(usense->fd);
+	if (usense->notify_fd >= 0)
+		close(usense->notify_fd);
+	if (usense->wake[0] >= 0)
+		close(usense->wake[0]);
+	if (usense->wake[1] >= 0)
+		close(usense->wake[1]);
+	if (usense->uevent_fd >= 0)
+		close(usense->uevent_fd);
+
+	tbl = usense->table;
+	for (i = 0; tbl != NULL && i < tbl->devs; i++) {
+		dev = tbl->dev[i];
+		if (dev == NULL)
+			continue;
 		usense_close(dev);
 		usense_device_free(dev);
+	}
+
+	free(tbl);
+	usense_table_free(usense->retired);
+	usense_table_free(usense->grace);
+
+	for (dev = usense->removed; dev != NULL; ) {
+		tmp = dev->next;
+		usense_device_free(dev);
 		dev = tmp;
 	}
+
+	usense_shm_destroy(usense->shm);
+
+	pthread_mutex_destroy(&usense->scan_lock);
+	pthread_cond_destroy(&usense->cond);
+	pthread_mutex_destroy(&usense->lock);
 	free(usense);
 }
 
@@ -179,49 +830,78 @@ static struct usense_device *usense_device_new(struct usense *usense, const char
 	struct usense_device *dev;
 
 	dev = calloc(1, sizeof(*dev));
+	if (dev == NULL)
+		return NULL;
 
+	dev->usense = usense;
 	dev->mode = USENSE_MODE_UPDATE;
-	dev->next = usense->devices;
+	pthread_mutex_init(&dev->lock, NULL);
+	pthread_cond_init(&dev->cond, NULL);
+	pthread_mutex_init(&dev->usb_stats.lock, NULL);
+
 	strncpy(dev->name, name, sizeof(dev->name));
 	dev->name[sizeof(dev->name)-1]=0;
-	dev->pprev = &usense->devices;
-	usense->devices = dev;
-	if (dev->next != NULL) {
-		dev->next->pprev = &dev->next;
-	}
+	dev->name_hash = usense_hash_of(dev->name);
+
 	dev->handle = handle;
 	dev->probe = probe;
 
 	usense_prop_set(dev, "calibrate.add", "0.0");
 	usense_prop_set(dev, "calibrate.mult", "1.0");
 	usense_prop_set(dev, "reading", "unknown");
+	usense_prop_set(dev, "reading.max_age_ms", "0");
+	usense_prop_set(dev, "reading.stale_while_revalidate", "0");
+	usense_prop_set(dev, "history.size", "0");
 	usense_prop_set(dev, "name", dev->name);
 
 	return dev;
 }
 
-static int usense_prop_cmp(const void *a, const void *b)
+/* Add a new device to the table, once its properties are set.
+ * On failure, the device is freed.
+ */
+static int usense_device_publish(struct usense_device *dev)
 {
-	const struct usense_prop *prop_a = a, *prop_b = b;
+	struct usense *usense = dev->usense;
+	struct usense_table *tbl;
+	int err, id;
+
+	/* Reuse an unplugged device's id, if there is one. Otherwise
+	 * each replug would grow the table, and use up another of the
+	 * shared readings' USENSE_SHM_ENTRIES.
+	 */
+	pthread_mutex_lock(&usense->lock);
+	tbl = usense->table;
+	for (id = 0; tbl != NULL && id < tbl->devs && tbl->dev[id] != NULL; id++);
+	dev->id = id;
+	err = usense_table_set(usense, dev->id, dev);
+	pthread_mutex_unlock(&usense->lock);
 
-	return strcmp(prop_a->key, prop_b->key);
+	if (err < 0)
+		usense_device_free(dev);
+
+	return err;
 }
 
-static int usense_check_for(struct usense_device *dev, const char *type, const char **arr, size_t len)
+static int usense_check_for(struct usense_device *dev, const char *type, const enum usense_key *arr, size_t len)
 {
-	char buff[USENSE_PROP_MAX];
-	int i;
+	int i, missing = -1;
 
 	/* Check for generics */
+	pthread_mutex_lock(&dev->lock);
 	for (i = 0; i < len; i++) {
-		int err;
-		err = usense_prop_get(dev, arr[i], buff, sizeof(buff));
-		if (err < 0) {
-			fprintf(stderr, "%s: Missing %s property '%s'\n",
-					dev->name, type, arr[i]);
-			return -EINVAL;
+		if (dev->slot[arr[i]] == NULL) {
+			missing = arr[i];
+			break;
 		}
 	}
+	pthread_mutex_unlock(&dev->lock);
+
+	if (missing >= 0) {
+		fprintf(stderr, "%s: Missing %s property '%s'\n",
+				dev->name, type, usense_key_name[missing]);
+		return -EINVAL;
+	}
 
 	return 0;
 }
@@ -255,6 +935,10 @@ static uint32_t units_is_valid(const char *type, const char *value)
 		  break;
 	}
 
+	/* Every copy of the units has room for this much */
+	if (strlen(value) >= USENSE_UNITS_MAX)
+		return 0;
+
 	for (i = 0; i < ARRAY_SIZE(valid); i++) {
 		if (strcmp(type, valid[i].type) == 0) {
 			int j;
@@ -272,18 +956,18 @@ static uint32_t units_is_valid(const char *type, const char *value)
 
 static int usense_prop_validate(struct usense_device *dev)
 {
-	const char *generic[] = {
-		"device",
-		"type",
-		"units",
-		"reading",
-		"name",
-		"calibrate.add",
-		"calibrate.mult",
+	const enum usense_key generic[] = {
+		USENSE_KEY_DEVICE,
+		USENSE_KEY_TYPE,
+		USENSE_KEY_UNITS,
+		USENSE_KEY_READING,
+		USENSE_KEY_NAME,
+		USENSE_KEY_CALIBRATE_ADD,
+		USENSE_KEY_CALIBRATE_MULT,
 	};
-	const char *type_usb[] = {
-		"usb.vendor",
-		"usb.product",
+	const enum usense_key type_usb[] = {
+		USENSE_KEY_USB_VENDOR,
+		USENSE_KEY_USB_PRODUCT,
 	};
 	int err;
 	char buff[USENSE_PROP_MAX];
@@ -318,393 +1002,1759 @@ static int usense_prop_validate(struct usense_device *dev)
 	return 0;
 }
 
-static struct usense_device *usense_probe_usb(struct usense *usense, struct usb_device *dev)
+static struct usense_device *usense_probe_usb(struct usense *usense, libusb_device *dev)
 {
-	int i,j;
+	int i;
+	const struct usense_probe *probe;
 	struct usense_device *udev = NULL;
-	char name[PATH_MAX];
+	struct libusb_device_descriptor desc;
+	char name[USENSE_NAME_MAX];
 
-	if (dev->config == NULL) {
+	if (usense_usb_descriptor(dev, &desc) < 0 ||
+	    desc.bNumConfigurations == 0) {
 		return NULL;
 	}
 
-	snprintf(name, sizeof(name), "usb:%s.%d", dev->bus->dirname, dev->devnum);
-	for (i = 0; i < dev_probes; i++) {
-		int err;
+	snprintf(name, sizeof(name), "usb:%03d.%d",
+		 usense_usb_bus(dev), usense_usb_address(dev));
 
+	/* Already known? Rescans are serialized by
+	 * usense->scan_lock, so this can't race an add.
+	 */
+	udev = usense_lookup(usense, name);
+	if (udev != NULL)
+		return udev;
+
+	pthread_mutex_lock(&dev_probe_lock);
+	for (i = 0; i < dev_probes; i++) {
 		if (dev_probe[i]->type != USENSE_PROBE_USB)
 			continue;
-		if (!dev_probe[i]->probe.usb.match(&dev->descriptor))
-			continue;
+		if (dev_probe[i]->probe.usb.match(&desc))
+			break;
+	}
+	probe = (i < dev_probes) ? dev_probe[i] : NULL;
+	pthread_mutex_unlock(&dev_probe_lock);
 
-		udev = usense_device_new(usense, name, dev_probe[i], dev);
+	if (probe != NULL) {
+		udev = usense_device_new(usense, name, probe, usense_usb_ref(dev));
+		if (udev == NULL) {
+			usense_usb_unref(dev);
+			return NULL;
+		}
 
 		/* Set the USB properties */
-		snprintf(name, sizeof(name), "%04x", dev->descriptor.idVendor);
+		snprintf(name, sizeof(name), "%04x", desc.idVendor);
 		usense_prop_set(udev, "usb.vendor", name);
-		snprintf(name, sizeof(name), "%04x", dev->descriptor.idProduct);
+		snprintf(name, sizeof(name), "%04x", desc.idProduct);
 		usense_prop_set(udev, "usb.product", name);
 
-		break;
+		if (usense_device_publish(udev) < 0)
+			return NULL;
+
+		/* Found by a rescan or a hotplug event. Nobody
+		 * is listening yet during the first scan.
+		 */
+		pthread_mutex_lock(&udev->lock);
+		usense_notify(udev, USENSE_CHANGE_ADD);
+		pthread_mutex_unlock(&udev->lock);
 	}
 
 	return udev;
 }
 
-static int usense_attach_usb(struct usense_device *udev)
-{
-	struct usb_device *dev = udev->handle;
-	struct usb_dev_handle *usb;
-	int j, err;
+/* Attaching a USB device
+ *
+ * Opening, detaching kernel drivers, and claiming interfaces
+ * never block. A busy interface is retried with exponential
+ * backoff, while the other devices carry on. Once a device's
+ * interfaces are claimed, the driver's attach() and validation
+ * run on a thread of their own, since they talk to the hardware.
+ */
+#define USENSE_CLAIM_BACKOFF	10	/* First retry, in ms */
+#define USENSE_CLAIM_BACKOFF_MAX	1000
+#define USENSE_CLAIM_TIMEOUT	5000	/* Give up after, in ms */
 
-	usb = usb_open(dev);
-	if (usb == NULL)
-		return -EPERM;
+struct usense_attach {
+	struct usense_device *dev;
+	enum {
+		USENSE_ATTACH_OPEN,
+		USENSE_ATTACH_CLAIM,
+		USENSE_ATTACH_DRIVER,
+		USENSE_ATTACH_DONE,
+	} state;
+	libusb_device_handle *usb;
+	int iface, ifaces;	/* Next interface to claim, of 'ifaces' */
+	unsigned int backoff;	/* Next retry delay, in ms */
+	uint64_t retry_ns;	/* CLOCK_MONOTONIC of the next claim */
+	uint64_t deadline_ns;	/* ..and of giving up */
+	pthread_t thread;
+	int threaded;
+	int err;
+};
 
-	for (j = 0; j < dev->config->bNumInterfaces; j++) {
-		int timeout = 5;
-		err = usb_detach_kernel_driver_np(usb, j);
-		if ((err == -ENOENT) || (err == -ENODATA))
-			err = 0;
-		else if (err < 0)
-			break;
-		do {
-			err = usb_claim_interface(usb, j);
-			if (err == -EBUSY) {
-				sleep(1);
-				timeout--;
-			}
-		} while (err == -EBUSY && timeout > 0);
-		if (err < 0)
-			break;
-	}
+static int usense_attach_open(struct usense_attach *at, uint64_t now)
+{
+	libusb_device *dev = at->dev->handle;
+	int err;
 
-	if (err < 0) {
-		usb_close(usb);
+	err = usense_usb_open(dev, &at->usb);
+	if (err < 0)
 		return err;
-	}
 
-	err = udev->probe->probe.usb.attach(udev, usb, &udev->priv);
-	if (err < 0) {
-		usb_close(usb);
+	err = usense_usb_interfaces(dev);
+	if (err < 0)
 		return err;
-	}
+	at->ifaces = err;
+
+	at->iface = 0;
+	at->backoff = USENSE_CLAIM_BACKOFF;
+	at->retry_ns = now;
+	at->deadline_ns = now + USENSE_CLAIM_TIMEOUT * 1000000ULL;
+	at->state = USENSE_ATTACH_CLAIM;
+
+	return 0;
+}
+
+/* Claim as many interfaces as we can without waiting
+ */
+static int usense_attach_claim(struct usense_attach *at, uint64_t now)
+{
+	int err;
+
+	while (at->iface < at->ifaces) {
+		if (now < at->retry_ns)
+			return 0;
+
+		err = usense_usb_detach(at->usb, at->iface);
+		if (err < 0 && err != -ENOENT && err != -ENOSYS)
+			return err;
+
+		err = usense_usb_claim(at->usb, at->iface);
+		if (err == -EBUSY) {
+			if (now >= at->deadline_ns)
+				return -EBUSY;
+			usense_device_retry(at->dev);
+			at->retry_ns = now + at->backoff * 1000000ULL;
+			at->backoff *= 2;
+			if (at->backoff > USENSE_CLAIM_BACKOFF_MAX)
+				at->backoff = USENSE_CLAIM_BACKOFF_MAX;
+			return 0;
+		}
+		if (err < 0)
+			return err;
+
+		at->iface++;
+		at->backoff = USENSE_CLAIM_BACKOFF;
+	}
+
+	at->state = USENSE_ATTACH_DRIVER;
+	return 0;
+}
+
+static void *usense_attach_driver(void *arg)
+{
+	struct usense_attach *at = arg;
+	struct usense_device *udev = at->dev;
+	uint64_t start;
+	char buff[24];
+	int err;
+
+	/* Count the driver's transfers from the start */
+	usense_usb_account(at->usb, &udev->usb_stats);
+
+	start = usense_now_ns();
+	err = udev->probe->probe.usb.attach(udev, at->usb, &udev->priv);
+	if (err < 0) {
+		at->err = err;
+		return NULL;
+	}
+	udev->usb = at->usb;
+	at->usb = NULL;
+
+	/* So slow drivers show up */
+	snprintf(buff, sizeof(buff), "%llu", (unsigned long long)(usense_now_ns() - start) / 1000);
+	usense_prop_set(udev, "attach.time_us", buff);
+
+	/* The monitor needs to poll the new handle's fd */
+	usense_monitor_wake(udev->usense);
 
 	/* Validate properties */
 	err = usense_prop_validate(udev);
-	if (err < 0)
-		return err;
+	if (err < 0) {
+		at->err = err;
+		return NULL;
+	}
 
-	udev->mode = USENSE_MODE_READ;
+	/* The driver's attach sampled the reading */
+	pthread_mutex_lock(&udev->lock);
+	USENSE_STORE(udev->mode, USENSE_MODE_READ);
+	udev->sampled_ns = usense_now_ns();
+	clock_gettime(CLOCK_REALTIME, &udev->sampled_at);
+	usense_reading_publish(udev);
+	pthread_mutex_unlock(&udev->lock);
 
-	return 0;
+	at->err = 0;
+	return NULL;
 }
 
-static int usb_is_initted = 0;
+/* Run the attach state machine for 'n' devices at once.
+ *
+ * Returns the number attached.
+ */
+static int usense_attach_usb(struct usense_attach *at, int n)
+{
+	uint64_t now, next;
+	int i, err, pending, attached = 0;
+
+	do {
+		now = usense_now_ns();
+		next = UINT64_MAX;
+		pending = 0;
+
+		for (i = 0; i < n; i++) {
+			err = 0;
+
+			if (at[i].state == USENSE_ATTACH_OPEN)
+				err = usense_attach_open(&at[i], now);
+
+			if (err == 0 && at[i].state == USENSE_ATTACH_CLAIM)
+				err = usense_attach_claim(&at[i], now);
+
+			if (err < 0) {
+				at[i].err = err;
+				at[i].state = USENSE_ATTACH_DONE;
+				continue;
+			}
+
+			if (at[i].state == USENSE_ATTACH_CLAIM) {
+				if (at[i].retry_ns < next)
+					next = at[i].retry_ns;
+				pending++;
+				continue;
+			}
+
+			if (at[i].state == USENSE_ATTACH_DRIVER) {
+				at[i].state = USENSE_ATTACH_DONE;
+				if (n > 1 && pthread_create(&at[i].thread, NULL,
+							    usense_attach_driver, &at[i]) == 0)
+					at[i].threaded = 1;
+				else
+					usense_attach_driver(&at[i]);
+			}
+		}
+
+		/* Sleep until the next claim retry */
+		if (pending > 0) {
+			struct timespec ts;
+
+			ts.tv_sec = next / 1000000000ULL;
+			ts.tv_nsec = next % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+	} while (pending > 0);
+
+	for (i = 0; i < n; i++) {
+		if (at[i].threaded)
+			pthread_join(at[i].thread, NULL);
+		if (at[i].usb != NULL)
+			usense_usb_close(at[i].usb);
+		if (at[i].err == 0)
+			attached++;
+	}
+
+	return attached;
+}
 
 /*
  * Rescan for new devices.
  */
 void usense_detect(struct usense *usense)
 {
-	struct usb_bus *busses, *bus;
-
-	if (!usb_is_initted) {
-		usb_init();
-		usb_is_initted = 1;
-	}
+	libusb_device **list;
+	ssize_t i, n;
 
-	usb_find_busses();
-	usb_find_devices();
+	if (usense_usb_init() < 0)
+		return;
 
-	busses = usb_get_busses();
+	pthread_mutex_lock(&usense->scan_lock);
+	n = usense_usb_device_list(&list);
+	if (n >= 0) {
+		for (i = 0; i < n; i++)
+			usense_probe_usb(usense, list[i]);
 
-	for (bus = busses; bus != NULL; bus = bus->next) {
-		struct usb_device *dev;
-		struct usb_dev_handle *usb;
-		for (dev = bus->devices; dev != NULL; dev = dev->next) {
-			usense_probe_usb(usense, dev);
-		}
+		usense_usb_free_device_list(list);
 	}
+	pthread_mutex_unlock(&usense->scan_lock);
 }
 
-/* Walk the device list.
+/* A device was unplugged
+ *
+ * The caller may still hold it open, so it is
+ * only freed by usense_stop().
  */
-const char *usense_next(struct usense *usense, const char *prev_name)
+static void usense_device_remove(struct usense *usense, const char *name)
 {
 	struct usense_device *dev;
 
-	if (prev_name == NULL) {
-		if (usense->devices == NULL)
-			return NULL;
-		else
-			return &usense->devices->name[0];
+	pthread_mutex_lock(&usense->lock);
+	dev = usense_table_find(usense->table, name);
+	if (dev != NULL && usense_table_set(usense, dev->id, NULL) == 0) {
+		dev->next = usense->removed;
+		usense->removed = dev;
+
+		pthread_mutex_lock(&dev->lock);
+		if (usense->shm != NULL && dev->mode == USENSE_MODE_READ)
+			usense_shm_update(usense->shm, dev->id, dev->name, NULL, NULL,
+					  0.0, 0, &dev->sampled_at, -ENODEV);
+		USENSE_STORE(dev->mode, USENSE_MODE_REMOVED);
+		usense_notify(dev, USENSE_CHANGE_REMOVE);
+		pthread_mutex_unlock(&dev->lock);
 	}
+	pthread_mutex_unlock(&usense->lock);
+}
+
+/* A device was plugged in. Only probe that one.
+ */
+static void usense_device_add(struct usense *usense, int busnum, int devnum)
+{
+	libusb_device **list;
+	ssize_t i, n;
 
-	dev = container_of(prev_name, struct usense_device, name);
+	if (usense_usb_init() < 0)
+		return;
 
-	if (dev->next == NULL)
-		return NULL;
+	pthread_mutex_lock(&usense->scan_lock);
+	n = usense_usb_device_list(&list);
+	if (n >= 0) {
+		for (i = 0; i < n; i++) {
+			if (usense_usb_bus(list[i]) == busnum &&
+			    usense_usb_address(list[i]) == devnum) {
+				usense_probe_usb(usense, list[i]);
+				break;
+			}
+		}
 
-	return &dev->next->name[0];
+		usense_usb_free_device_list(list);
+	}
+	pthread_mutex_unlock(&usense->scan_lock);
 }
 
-/*
- * fd to use with poll(2) for monitoring when device
- * properties have changed
+/* Drain the kernel uevent socket
+ *
+ * Messages are "action@devpath", followed by
+ * NUL separated KEY=value pairs.
  */
-int usense_monitor_fd(struct usense *usense)
+static void usense_hotplug(struct usense *usense)
 {
-	return usense->fd;
+	char buff[4096];
+	ssize_t len;
+
+	while ((len = recv(usense->uevent_fd, buff, sizeof(buff) - 1, 0)) > 0) {
+		const char *action = NULL, *subsystem = NULL, *devtype = NULL;
+		int busnum = -1, devnum = -1;
+		char *cp, name[64];
+
+		buff[len] = 0;
+		for (cp = buff; cp < buff + len; cp += strlen(cp) + 1) {
+			if (strncmp(cp, "ACTION=", 7) == 0)
+				action = cp + 7;
+			else if (strncmp(cp, "SUBSYSTEM=", 10) == 0)
+				subsystem = cp + 10;
+			else if (strncmp(cp, "DEVTYPE=", 8) == 0)
+				devtype = cp + 8;
+			else if (strncmp(cp, "BUSNUM=", 7) == 0)
+				busnum = atoi(cp + 7);
+			else if (strncmp(cp, "DEVNUM=", 7) == 0)
+				devnum = atoi(cp + 7);
+		}
+
+		if (action == NULL || subsystem == NULL || devtype == NULL ||
+		    strcmp(subsystem, "usb") != 0 ||
+		    strcmp(devtype, "usb_device") != 0 ||
+		    busnum < 0 || devnum < 0)
+			continue;
+
+		if (strcmp(action, "add") == 0) {
+			usense_device_add(usense, busnum, devnum);
+		} else if (strcmp(action, "remove") == 0) {
+			snprintf(name, sizeof(name), "usb:%03d.%d", busnum, devnum);
+			usense_device_remove(usense, name);
+		}
+	}
 }
 
-/************** Open a device ****************
+/* Walk the device list, in id order.
  */
-struct usense_device *usense_open(struct usense *usense, const char *device_name)
+const char *usense_next(struct usense *usense, const char *prev_name)
 {
+	struct usense_table *tbl;
 	struct usense_device *dev;
+	const char *name = NULL;
+	unsigned int epoch;
+	int i = 0;
 
-	if (usense == NULL)
-		return NULL;
+	if (prev_name != NULL) {
+		dev = container_of(prev_name, struct usense_device, name);
+		i = dev->id + 1;
+	}
 
-	for (dev = usense->devices; dev != NULL; dev = dev->next) {
-		if (strcmp(dev->name, device_name) == 0)
+	tbl = usense_table_get(usense, &epoch);
+	for (; tbl != NULL && i < tbl->devs; i++) {
+		if (tbl->dev[i] != NULL) {
+			name = &tbl->dev[i]->name[0];
 			break;
+		}
 	}
-	
-	if (dev == NULL)
-		return NULL;
+	usense_table_put(usense, epoch);
 
-	if (dev->probe->type == USENSE_PROBE_USB)
-		return (usense_attach_usb(dev) == 0) ? dev : NULL;
-	else
-		return NULL;
+	return name;
 }
 
-
-void usense_close(struct usense_device *dev)
+int usense_device_id(struct usense_device *dev)
 {
-#if 0
-	if (dev->probe->type == USENSE_PROBE_USB)
-		usense_detach_usb(dev);
-#endif
+	return dev->id;
 }
 
-/************** General get/set **************/
-
-const char *usense_device_name(struct usense_device *dev)
+unsigned int usense_generation(struct usense *usense)
 {
-	return dev->name;
+	return __atomic_load_n(&usense->samples, __ATOMIC_ACQUIRE);
 }
 
-/* We know 'power' can only be from -16 to 15,
- * so we use this instead of having to link in the
- * full -lm math library.
- */
-static inline double power10(int power)
+int usense_device_stats(struct usense_device *dev, struct usense_stats *stats)
 {
-	double x = 1.0;
-	while (power < 0) {
-		x /= 10.0;
-		power++;
-	}
-	while (power > 0) {
-		x *= 10.0;
-		power--;
-	}
+	pthread_mutex_lock(&dev->lock);
+	*stats = dev->stats;
+	pthread_mutex_unlock(&dev->lock);
 
-	return x;
+	pthread_mutex_lock(&dev->usb_stats.lock);
+	stats->transfers = dev->usb_stats.transfers;
+	stats->transfer_errors = dev->usb_stats.errors;
+	stats->bytes = dev->usb_stats.bytes;
+	pthread_mutex_unlock(&dev->usb_stats.lock);
+
+	return 0;
 }
 
+int usense_device_update_le(struct usense_device *dev, const uint64_t *le_ns,
+			    uint64_t *count, int n)
+{
+	pthread_mutex_lock(&dev->lock);
+	usense_hist_cumulative(&dev->update_hist, le_ns, count, n);
+	pthread_mutex_unlock(&dev->lock);
+
+	return 0;
+}
 
-static void convert_reading(struct usense_device *dev, const char *val, char *buff, size_t len)
+void usense_device_retry(struct usense_device *dev)
 {
-	uint32_t units;
-	char ubuff[USENSE_PROP_MAX];
-	char tbuff[USENSE_PROP_MAX];
-	char abuff[USENSE_PROP_MAX];
-	char mbuff[USENSE_PROP_MAX];
-	char *tmp;
-	int err,n;
-	double reading, d, offset_add, offset_mult;
+	pthread_mutex_lock(&dev->lock);
+	dev->stats.retries++;
+	pthread_mutex_unlock(&dev->lock);
+}
 
-	err = sscanf(val, "%lg%n", &reading, &n);
-	if (err != 1 || n != strlen(val)) {
-		/* Evidently the device knows better than we do.
-		 */
-		strncpy(buff, val, len);
-		return;
-	}
+static void usense_stats_reset(struct usense_device *dev)
+{
+	pthread_mutex_lock(&dev->lock);
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	memset(&dev->update_hist, 0, sizeof(dev->update_hist));
+	pthread_mutex_unlock(&dev->lock);
+
+	pthread_mutex_lock(&dev->usb_stats.lock);
+	dev->usb_stats.transfers = 0;
+	dev->usb_stats.errors = 0;
+	dev->usb_stats.bytes = 0;
+	memset(&dev->usb_stats.latency, 0, sizeof(dev->usb_stats.latency));
+	pthread_mutex_unlock(&dev->usb_stats.lock);
+}
 
-	err = usense_prop_get(dev, "type", tbuff, sizeof(tbuff));
-	assert(err > 0);
+/* The 'stats.*' properties
+ *
+ * Computed when read, so they are never stored,
+ * and never show up in the property walk.
+ */
+static const struct usense_hist_prop {
+	const char *name;
+	double pct;		/* Or.. */
+	enum { HIST_PCT, HIST_COUNT, HIST_MIN, HIST_MEAN, HIST_MAX } what;
+} usense_hist_prop[] = {
+	{ "count", 0, HIST_COUNT },
+	{ "min_us", 0, HIST_MIN },
+	{ "mean_us", 0, HIST_MEAN },
+	{ "max_us", 0, HIST_MAX },
+	{ "p50_us", 50.0, HIST_PCT },
+	{ "p90_us", 90.0, HIST_PCT },
+	{ "p99_us", 99.0, HIST_PCT },
+	{ "p999_us", 99.9, HIST_PCT },
+};
 
-	err = usense_prop_get(dev, "units", ubuff, sizeof(ubuff));
-	assert(err > 0);
+static int usense_hist_get(const struct usense_hist *hist, const char *name, char *buff, size_t len)
+{
+	const struct usense_hist_prop *hp;
+	double us = 0.0;
+	size_t i;
 
-	offset_add = 0.0;
-	err = usense_prop_get(dev, "calibrate.add", abuff, sizeof(abuff));
-	if (err > 0) {
-		d = strtod(abuff, &tmp);
-		if (tmp != abuff && *tmp == 0)
-			offset_add = d;
+	for (i = 0; i < ARRAY_SIZE(usense_hist_prop); i++) {
+		if (strcmp(usense_hist_prop[i].name, name) == 0)
+			break;
 	}
+	if (i == ARRAY_SIZE(usense_hist_prop))
+		return -ENOENT;
+	hp = &usense_hist_prop[i];
 
-	offset_mult = 1.0;
-	err = usense_prop_get(dev, "calibrate.mult", abuff, sizeof(abuff));
-	if (err > 0) {
-		d = strtod(abuff, &tmp);
-		if (tmp != abuff && *tmp == 0)
-			offset_mult = d;
+	switch (hp->what) {
+	case HIST_COUNT:
+		return snprintf(buff, len, "%llu", (unsigned long long)hist->count);
+	case HIST_MIN:
+		us = hist->min / 1000.0;
+		break;
+	case HIST_MEAN:
+		us = hist->count ? (double)hist->sum / hist->count / 1000.0 : 0.0;
+		break;
+	case HIST_MAX:
+		us = hist->max / 1000.0;
+		break;
+	case HIST_PCT:
+		us = usense_hist_percentile(hist, hp->pct) / 1000.0;
+		break;
 	}
 
-	units = units_is_valid(tbuff, ubuff);
-	assert(units != 0);
+	return snprintf(buff, len, "%.1f", us);
+}
+
+static int usense_stats_get(struct usense_device *dev, const char *key, char *buff, size_t len)
+{
+	struct usense_stats stats;
+	unsigned long long val;
+	int err;
 
-	reading = (reading + offset_add) * offset_mult;
+	key += strlen("stats.");
 
-	switch (USENSE_UNITS_of(units)) {
-	case USENSE_UNITS_KELVIN:     break;	/* Kelvin is temp native */
-	case USENSE_UNITS_CELSIUS:    reading = K_TO_C(reading); break;
-	case USENSE_UNITS_FAHRENHEIT: reading = K_TO_F(reading); break;
-	default:
-		assert(USENSE_UNITS_of(units) == USENSE_UNITS_UNITLESS );
-		break;
+	if (strncmp(key, "update.", 7) == 0) {
+		pthread_mutex_lock(&dev->lock);
+		err = usense_hist_get(&dev->update_hist, key + 7, buff, len);
+		pthread_mutex_unlock(&dev->lock);
+		return err;
 	}
 
-	n = USENSE_UNITS_POW_10_of(units);
-	reading /= power10(n);
+	if (strncmp(key, "transfer.", 9) == 0) {
+		pthread_mutex_lock(&dev->usb_stats.lock);
+		err = usense_hist_get(&dev->usb_stats.latency, key + 9, buff, len);
+		pthread_mutex_unlock(&dev->usb_stats.lock);
+		return err;
+	}
 
-	/* MilliUnits and MicroUnits are integer */
-	if (n < -1)
-		snprintf(buff, len, "%lld", (long long int)reading);
+	usense_device_stats(dev, &stats);
+	if (strcmp(key, "updates") == 0)
+		val = stats.updates;
+	else if (strcmp(key, "errors") == 0)
+		val = stats.errors;
+	else if (strcmp(key, "retries") == 0)
+		val = stats.retries;
+	else if (strcmp(key, "transfers") == 0)
+		val = stats.transfers;
+	else if (strcmp(key, "transfer_errors") == 0)
+		val = stats.transfer_errors;
+	else if (strcmp(key, "bytes") == 0)
+		val = stats.bytes;
 	else
-		snprintf(buff, len, "%g", reading);
-}
+		return -ENOENT;
 
+	return snprintf(buff, len, "%llu", val);
+}
 
-/* Get property from device
- * (always returns in UTF8z format)
+/*
+ * fd to use with poll(2) for monitoring when device
+ * properties have changed
  */
-int usense_prop_get(struct usense_device *dev, const char *key, char *buff, size_t len)
+int usense_monitor_fd(struct usense *usense)
 {
-	struct usense_prop *prop, match;
+	return usense->fd;
+}
 
-	match.key = key;
-	prop = bsearch(&match, dev->prop, dev->props, sizeof(*prop), usense_prop_cmp);
+int usense_monitor_read(struct usense *usense, struct usense_change *change, int max)
+{
+	ssize_t len;
 
-	if (prop == NULL) {
-		return -ENOENT;
-	}
+	if (usense->fd < 0)
+		return -EBADF;
 
-	if (len < 1) {
+	if (max <= 0)
 		return 0;
-	}
 
-	if (strcmp(key, "reading") == 0) {
-		dev->probe->update(dev, dev->priv);
-		convert_reading(dev, prop->value, buff, len);
-	} else {
-		strncpy(buff, prop->value, len);
-	}
-	buff[len - 1] = 0;
+	len = read(usense->fd, change, sizeof(*change) * max);
+	if (len < 0)
+		return (errno == EAGAIN) ? 0 : -errno;
 
-	return strlen(buff);
+	return len / sizeof(*change);
 }
 
-int usense_prop_set(struct usense_device *dev, const char *key, const char *value)
+void usense_monitor_interval(struct usense *usense, unsigned int msec)
 {
-	struct usense_prop *prop, match;
-	int writable = 0;
+	pthread_mutex_lock(&usense->lock);
+	USENSE_STORE(usense->interval, msec);
+	pthread_mutex_unlock(&usense->lock);
+	usense_monitor_wake(usense);
+}
 
-	if (key == NULL || value == NULL || strlen(value) >= USENSE_PROP_MAX) {
-		return -EINVAL;
-	}
+int usense_pollfds(struct usense *usense, struct pollfd *pfd, int max)
+{
+	return usense_usb_pollfds(pfd, max);
+}
 
-	/* If it's 'units', validate it.
-	 */
-	if (strcmp(key,"units") == 0) {
-		int err;
-		uint32_t units;
-		char buff[USENSE_PROP_MAX];
+int usense_handle_events(struct usense *usense)
+{
+	return usense_usb_handle_events();
+}
 
-		err = usense_prop_get(dev, "type", buff, sizeof(buff));
-		assert(err > 0);
+/* Queue a change record for the monitor fd
+ *
+ * Called with dev->lock held. If the reader has
+ * fallen behind and the pipe is full, the record is dropped.
+ */
+static void usense_notify(struct usense_device *dev, const char *key)
+{
+	struct usense *usense = dev->usense;
+	struct usense_change change;
+	ssize_t len;
 
-		units = units_is_valid(buff, value);
-		if (units == 0) {
-			return -EINVAL;
-		}
+	dev->generation++;
 
-		writable = 1;
-	}
-	
-	if ((strcmp(key,"calibrate.add") == 0) ||
-            (strcmp(key,"calibrate.mult") == 0))
-		writable = 1;
+	if (usense->notify_fd < 0)
+		return;
 
-	/* Does the device says it's writable? */
-	if (!writable
-	    && dev->probe->on_prop_set != NULL
-	    && dev->mode != USENSE_MODE_UPDATE) {
-		int err;
+	memset(&change, 0, sizeof(change));
+	strncpy(change.device, dev->name, sizeof(change.device) - 1);
+	strncpy(change.prop, key, sizeof(change.prop) - 1);
+	change.generation = dev->generation;
 
-		err = dev->probe->on_prop_set(dev, dev->priv, key, value);
-		if (err < 0) {
-			return -EINVAL;
-		}
-		writable = 1;
-	}
+	len = write(usense->notify_fd, &change, sizeof(change));
+	(void)len;
+}
 
-	if (!writable && dev->mode != USENSE_MODE_UPDATE) {
-		return -EROFS;
-	}
+/* Run the driver's update()
+ *
+ * Callers that arrive while an update is in flight
+ * share its result, rather than issuing another.
+ */
+static int usense_device_update(struct usense_device *dev)
+{
+	uint64_t start, now;
+	unsigned int seq;
+	int err;
 
-	match.key = key;
-	prop = bsearch(&match, dev->prop, dev->props, sizeof(*prop), usense_prop_cmp);
-	if (prop == NULL) {
-		dev->prop = realloc(dev->prop, sizeof(*prop) * (dev->props+1));
-		prop = &dev->prop[dev->props++];
-		prop->key = strdup(key);
-		prop->value = strdup(value);
-		qsort(dev->prop, dev->props, sizeof(*prop), usense_prop_cmp);
-		return 1;
+	pthread_mutex_lock(&dev->lock);
+	if (dev->mode == USENSE_MODE_REMOVED) {
+		pthread_mutex_unlock(&dev->lock);
+		return -ENODEV;
 	}
-
-	if (strcmp(prop->value, value) != 0) {
-		free(prop->value);
-		prop->value = strdup(value);
-		return 1;
+	if (dev->updating) {
+		seq = dev->update_seq;
+		while (dev->update_seq == seq)
+			pthread_cond_wait(&dev->cond, &dev->lock);
+		err = dev->update_err;
+		pthread_mutex_unlock(&dev->lock);
+		return err;
+	}
+	dev->updating = 1;
+	dev->updater = pthread_self();
+	pthread_mutex_unlock(&dev->lock);
+
+	start = usense_now_ns();
+	err = dev->probe->update(dev, dev->priv);
+	now = usense_now_ns();
+
+	pthread_mutex_lock(&dev->lock);
+	dev->updating = 0;
+	dev->update_seq++;
+	dev->update_err = err;
+	dev->stats.updates++;
+	dev->stats.latency_ns += now - start;
+	usense_hist_add(&dev->update_hist, now - start);
+	if (err < 0)
+		dev->stats.errors++;
+	if (err >= 0) {
+		dev->sampled_ns = now;
+		clock_gettime(CLOCK_REALTIME, &dev->sampled_at);
 	}
+	usense_reading_publish(dev);
+	pthread_cond_broadcast(&dev->cond);
+	pthread_mutex_unlock(&dev->lock);
 
-	return 0;
+	__atomic_add_fetch(&dev->usense->samples, 1, __ATOMIC_RELEASE);
+
+	return err;
 }
 
-/* Property walking
+/* Make sure the reading is no older than 'reading.max_age_ms'
+ *
+ * With no maximum age set, the monitor's latest sample will
+ * do, if it is sampling the device. A maximum age holds
+ * either way. With 'reading.stale_while_revalidate', a stale
+ * reading is returned as-is, and the monitor refreshes it.
  */
-const char *usense_prop_first(struct usense_device *dev)
+static int usense_reading_refresh(struct usense_device *dev)
 {
-	if (dev->props == 0) {
-		return NULL;
+	struct usense *usense = dev->usense;
+	uint64_t now = usense_now_ns();
+	uint64_t sampled_ns;
+	unsigned int max_age_ms;
+	int running;
+
+	/* Lock-free, unless we have to do something about it */
+	sampled_ns = USENSE_LOAD(dev->pub.sampled_ns);
+	max_age_ms = USENSE_LOAD(dev->max_age_ms);
+	running = USENSE_LOAD(usense->running);
+
+	if (sampled_ns != 0 && (now - sampled_ns) <= max_age_ms * 1000000ULL)
+		return 0;
+
+	if (max_age_ms == 0 && USENSE_LOAD(dev->sampled) && running &&
+	    USENSE_LOAD(usense->interval) != 0)
+		return 0;
+
+	if (USENSE_LOAD(dev->stale_ok) && sampled_ns != 0 && running) {
+		pthread_mutex_lock(&usense->lock);
+		if (!dev->refresh) {
+			dev->refresh = 1;
+			usense->refresh = 1;
+			usense_monitor_wake(usense);
+		}
+		pthread_mutex_unlock(&usense->lock);
+		return 0;
 	}
 
-	return dev->prop[0].key;
+	return usense_device_update(dev);
 }
 
-const char *usense_prop_next(struct usense_device *dev, const char *curr_prop)
+/************** Open a device ****************
+ */
+/* Attach every device in dev[] that isn't already.
+ *
+ * Devices another thread is attaching are waited for,
+ * after ours are done. Returns the number now attached.
+ */
+static int usense_attach_all(struct usense *usense, struct usense_device **dev, int n)
 {
-	struct usense_prop *prop, match;
+	struct usense_attach *at;
+	int i, count = 0, attached = 0;
 
-	match.key = curr_prop;
-	prop = bsearch(&match, dev->prop, dev->props, sizeof(*prop), usense_prop_cmp);
-	if (prop == NULL) {
-		return NULL;
+	at = calloc(n, sizeof(*at));
+	if (at == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&usense->lock);
+	for (i = 0; i < n; i++) {
+		if (dev[i]->attaching || USENSE_LOAD(dev[i]->mode) != USENSE_MODE_UPDATE ||
+		    dev[i]->probe->type != USENSE_PROBE_USB)
+			continue;
+		dev[i]->attaching = 1;
+		at[count++].dev = dev[i];
 	}
+	pthread_mutex_unlock(&usense->lock);
 
-	prop++;
-	if ((prop - dev->prop) >= dev->props) {
-		return NULL;
+	if (count > 0)
+		usense_attach_usb(at, count);
+
+	pthread_mutex_lock(&usense->lock);
+	for (i = 0; i < count; i++)
+		at[i].dev->attaching = 0;
+	pthread_cond_broadcast(&usense->cond);
+
+	for (i = 0; i < n; i++) {
+		while (dev[i]->attaching)
+			pthread_cond_wait(&usense->cond, &usense->lock);
+		if (USENSE_LOAD(dev[i]->mode) == USENSE_MODE_READ)
+			attached++;
 	}
+	pthread_mutex_unlock(&usense->lock);
 
-	return prop->key;
+	free(at);
+
+	return attached;
+}
+
+static struct usense_device *usense_attach(struct usense_device *dev)
+{
+	if (dev == NULL)
+		return NULL;
+
+	return (usense_attach_all(dev->usense, &dev, 1) == 1) ? dev : NULL;
+}
+
+struct usense_device *usense_open(struct usense *usense, const char *device_name)
+{
+	if (usense == NULL)
+		return NULL;
+
+	return usense_attach(usense_lookup(usense, device_name));
+}
+
+struct usense_device *usense_find(struct usense *usense, const char *device_name)
+{
+	struct usense_device *dev;
+
+	if (usense == NULL)
+		return NULL;
+
+	dev = usense_lookup(usense, device_name);
+	if (dev == NULL || USENSE_LOAD(dev->mode) != USENSE_MODE_READ)
+		return NULL;
+
+	return dev;
+}
+
+struct usense_device *usense_open_id(struct usense *usense, int id)
+{
+	struct usense_device *dev = NULL;
+	struct usense_table *tbl;
+	unsigned int epoch;
+
+	if (usense == NULL)
+		return NULL;
+
+	tbl = usense_table_get(usense, &epoch);
+	if (tbl != NULL && id >= 0 && id < tbl->devs)
+		dev = tbl->dev[id];
+	usense_table_put(usense, epoch);
+
+	return usense_attach(dev);
+}
+
+int usense_open_all(struct usense *usense)
+{
+	struct usense_device **dev;
+	struct usense_table *tbl;
+	unsigned int epoch;
+	int i, n = 0, err;
+
+	if (usense == NULL)
+		return -EINVAL;
+
+	tbl = usense_table_get(usense, &epoch);
+	if (tbl == NULL) {
+		usense_table_put(usense, epoch);
+		return 0;
+	}
+
+	dev = calloc(tbl->devs, sizeof(*dev));
+	if (dev == NULL) {
+		usense_table_put(usense, epoch);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < tbl->devs; i++) {
+		if (tbl->dev[i] != NULL)
+			dev[n++] = tbl->dev[i];
+	}
+	usense_table_put(usense, epoch);
+
+	err = usense_attach_all(usense, dev, n);
+	free(dev);
+
+	return err;
+}
+
+void usense_close(struct usense_device *dev)
+{
+#if 0
+	if (dev->probe->type == USENSE_PROBE_USB)
+		usense_detach_usb(dev);
+#endif
+}
+
+/************** General get/set **************/
+
+const char *usense_device_name(struct usense_device *dev)
+{
+	return dev->name;
+}
+
+/* We know 'power' can only be from -16 to 15,
+ * so we use this instead of having to link in the
+ * full -lm math library.
+ */
+static inline double power10(int power)
+{
+	double x = 1.0;
+	while (power < 0) {
+		x /= 10.0;
+		power++;
+	}
+	while (power > 0) {
+		x *= 10.0;
+		power--;
+	}
+
+	return x;
+}
+
+
+/* Intern a property name
+ *
+ * Returns the well known slot, or USENSE_KEY_OTHER.
+ */
+static enum usense_key usense_key_of(const char *key, uint32_t *hashp)
+{
+	uint32_t hash;
+	int i;
+
+	hash = usense_hash_of(key);
+	if (hashp != NULL)
+		*hashp = hash;
+
+	for (i = 0; i < USENSE_KEY_MAX; i++) {
+		if (usense_key_hash[i] == hash &&
+		    strcmp(usense_key_name[i], key) == 0)
+			return i;
+	}
+
+	return USENSE_KEY_OTHER;
+}
+
+/* Look up a property
+ *
+ * Called with dev->lock held.
+ */
+static struct usense_prop *usense_prop_find(struct usense_device *dev, const char *key)
+{
+	struct usense_prop *prop;
+	enum usense_key slot;
+	uint32_t hash;
+
+	slot = usense_key_of(key, &hash);
+	if (slot != USENSE_KEY_OTHER)
+		return dev->slot[slot];
+
+	for (prop = dev->hash[hash % USENSE_PROP_HASH]; prop != NULL; prop = prop->hash_next) {
+		if (prop->hash == hash && strcmp(prop->key, key) == 0)
+			return prop;
+	}
+
+	return NULL;
+}
+
+static inline const char *usense_prop_value(struct usense_device *dev, enum usense_key slot)
+{
+	return (dev->slot[slot] == NULL) ? NULL : dev->slot[slot]->value;
+}
+
+static double usense_prop_double(struct usense_device *dev, enum usense_key slot, double def)
+{
+	const char *val;
+	char *tmp;
+	double d;
+
+	val = usense_prop_value(dev, slot);
+	if (val == NULL)
+		return def;
+
+	d = strtod(val, &tmp);
+	if (tmp == val || *tmp != 0)
+		return def;
+
+	return d;
+}
+
+/* Fold calibration, unit conversion, and the power of
+ * ten prefix into one affine transform.
+ *
+ * Called with dev->lock held.
+ */
+static void usense_xform_compile(struct usense_device *dev)
+{
+	uint32_t units;
+	const char *type, *ubuff;
+	double add, mult, scale, offset;
+	int n;
+
+	type = usense_prop_value(dev, USENSE_KEY_TYPE);
+	assert(type != NULL);
+
+	ubuff = usense_prop_value(dev, USENSE_KEY_UNITS);
+	assert(ubuff != NULL);
+
+	add = usense_prop_double(dev, USENSE_KEY_CALIBRATE_ADD, 0.0);
+	mult = usense_prop_double(dev, USENSE_KEY_CALIBRATE_MULT, 1.0);
+
+	units = units_is_valid(type, ubuff);
+	assert(units != 0);
+
+	switch (USENSE_UNITS_of(units)) {
+	case USENSE_UNITS_CELSIUS:
+		scale = 1.0;
+		offset = K_TO_C(0.0);
+		break;
+	case USENSE_UNITS_FAHRENHEIT:
+		scale = K_TO_F(1.0) - K_TO_F(0.0);
+		offset = K_TO_F(0.0);
+		break;
+	case USENSE_UNITS_KELVIN:	/* Kelvin is temp native */
+		scale = 1.0;
+		offset = 0.0;
+		break;
+	default:
+		assert(USENSE_UNITS_of(units) == USENSE_UNITS_UNITLESS );
+		scale = 1.0;
+		offset = 0.0;
+		break;
+	}
+
+	/* ((raw + add) * mult) * scale + offset, over 10^n */
+	n = USENSE_UNITS_POW_10_of(units);
+	dev->xform.scale = mult * scale * power10(-n);
+	dev->xform.offset = (add * mult * scale + offset) * power10(-n);
+	dev->xform.integer = (n < -1);
+	dev->xform.valid = 1;
+}
+
+/* Compile the transform, if 'type' and 'units' allow it
+ *
+ * Called with dev->lock held.
+ */
+static int usense_xform_ready(struct usense_device *dev)
+{
+	const char *type, *units;
+
+	if (dev->xform.valid)
+		return 0;
+
+	type = usense_prop_value(dev, USENSE_KEY_TYPE);
+	units = usense_prop_value(dev, USENSE_KEY_UNITS);
+	if (type == NULL || units == NULL || units_is_valid(type, units) == 0)
+		return -EINVAL;
+
+	usense_xform_compile(dev);
+	return 0;
+}
+
+/* Add a sample to the history, dropping the oldest
+ *
+ * Called with dev->lock held.
+ */
+static void usense_history_push(struct usense_device *dev)
+{
+	struct usense_history_entry *ent;
+
+	if (dev->ring_size == 0)
+		return;
+
+	ent = &dev->ring[dev->ring_head];
+	ent->ns = dev->sampled_ns;
+	ent->at = dev->sampled_at;
+	ent->raw = dev->raw;
+
+	dev->ring_head = (dev->ring_head + 1) % dev->ring_size;
+	if (dev->ring_count < dev->ring_size)
+		dev->ring_count++;
+}
+
+/* Mirror a published reading into the shared memory snapshot
+ *
+ * Called with dev->lock held.
+ */
+static void usense_shm_sync(struct usense_device *dev, const struct usense_reading *r)
+{
+	struct usense_shm *shm = __atomic_load_n(&dev->usense->shm, __ATOMIC_ACQUIRE);
+	int status;
+
+	if (shm == NULL || dev->mode != USENSE_MODE_READ)
+		return;
+
+	if (dev->update_err < 0)
+		status = dev->update_err;
+	else
+		status = r->valid ? 0 : -EIO;
+
+	usense_shm_update(shm, dev->id, dev->name,
+			  usense_prop_value(dev, USENSE_KEY_UNITS),
+			  r->valid ? r->text : usense_prop_value(dev, USENSE_KEY_READING),
+			  r->value, r->sampled_ns, &r->sampled_at, status);
+}
+
+/* Publish the converted reading for lock-free readers
+ *
+ * Called with dev->lock held.
+ */
+static void usense_reading_publish(struct usense_device *dev)
+{
+	struct usense_reading r;
+	unsigned int seq;
+	size_t i;
+
+	memset(&r, 0, sizeof(r));
+	r.sampled_ns = dev->sampled_ns;
+	r.sampled_at = dev->sampled_at;
+
+	/* A new sample? Keep it. */
+	if (dev->raw_valid && r.sampled_ns != 0 && r.sampled_ns != dev->pub.sampled_ns)
+		usense_history_push(dev);
+
+	/* Otherwise, evidently the device knows better than we do,
+	 * and readers fall back to the raw property.
+	 */
+	if (dev->raw_valid && usense_xform_ready(dev) == 0) {
+		r.valid = 1;
+		r.value = dev->raw * dev->xform.scale + dev->xform.offset;
+
+		/* Only format each sample once */
+		if (dev->pub.valid && dev->pub_sample == dev->sample)
+			memcpy(r.text, dev->pub.text, sizeof(r.text));
+		else if (dev->xform.integer)	/* MilliUnits and MicroUnits are integer */
+			snprintf(r.text, sizeof(r.text), "%lld", (long long int)r.value);
+		else
+			snprintf(r.text, sizeof(r.text), "%g", r.value);
+	}
+
+	seq = dev->pub_seq;
+	__atomic_store_n(&dev->pub_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&dev->pub.valid, r.valid, __ATOMIC_RELAXED);
+	__atomic_store(&dev->pub.value, &r.value, __ATOMIC_RELAXED);
+	__atomic_store_n(&dev->pub.sampled_ns, r.sampled_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&dev->pub.sampled_at.tv_sec, r.sampled_at.tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&dev->pub.sampled_at.tv_nsec, r.sampled_at.tv_nsec, __ATOMIC_RELAXED);
+	for (i = 0; i < sizeof(r.text); i++)
+		__atomic_store_n(&dev->pub.text[i], r.text[i], __ATOMIC_RELAXED);
+
+	__atomic_store_n(&dev->pub_seq, seq + 2, __ATOMIC_RELEASE);
+	dev->pub_sample = dev->sample;
+
+	usense_shm_sync(dev, &r);
+}
+
+/* Copy out the published reading, without locking
+ */
+static void usense_reading_load(struct usense_device *dev, struct usense_reading *r)
+{
+	unsigned int seq;
+	size_t i;
+
+	do {
+		seq = __atomic_load_n(&dev->pub_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		r->valid = __atomic_load_n(&dev->pub.valid, __ATOMIC_RELAXED);
+		__atomic_load(&dev->pub.value, &r->value, __ATOMIC_RELAXED);
+		r->sampled_ns = __atomic_load_n(&dev->pub.sampled_ns, __ATOMIC_RELAXED);
+		r->sampled_at.tv_sec = __atomic_load_n(&dev->pub.sampled_at.tv_sec, __ATOMIC_RELAXED);
+		r->sampled_at.tv_nsec = __atomic_load_n(&dev->pub.sampled_at.tv_nsec, __ATOMIC_RELAXED);
+		for (i = 0; i < sizeof(r->text); i++)
+			r->text[i] = __atomic_load_n(&dev->pub.text[i], __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || __atomic_load_n(&dev->pub_seq, __ATOMIC_RELAXED) != seq);
+
+	r->text[sizeof(r->text) - 1] = 0;
+}
+
+
+/* Get property from device
+ * (always returns in UTF8z format)
+ *
+ * "reading" is served from the published copy, without locking.
+ */
+int usense_prop_get(struct usense_device *dev, const char *key, char *buff, size_t len)
+{
+	struct usense_reading r;
+	struct usense_prop *prop;
+	int err;
+
+	if (strncmp(key, "stats.", 6) == 0) {
+		if (len < 1)
+			return 0;
+		buff[0] = 0;
+		err = usense_stats_get(dev, key, buff, len);
+		return (err < 0) ? err : (int)strlen(buff);
+	}
+
+	if (len > 0 && usense_key_of(key, NULL) == USENSE_KEY_READING) {
+		usense_reading_refresh(dev);
+		usense_reading_load(dev, &r);
+		if (r.valid) {
+			strncpy(buff, r.text, len);
+			buff[len - 1] = 0;
+			return strlen(buff);
+		}
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	prop = usense_prop_find(dev, key);
+	if (prop != NULL && len > 0) {
+		strncpy(buff, prop->value, len);
+		buff[len - 1] = 0;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	if (prop == NULL) {
+		return -ENOENT;
+	}
+
+	if (len < 1) {
+		return 0;
+	}
+
+	return strlen(buff);
+}
+
+/* Add a new property
+ *
+ * Called with dev->lock held.
+ */
+static struct usense_prop *usense_prop_new(struct usense_device *dev, const char *key)
+{
+	struct usense_prop *prop, **pprev;
+
+	prop = calloc(1, sizeof(*prop));
+	if (prop == NULL)
+		return NULL;
+
+	prop->slot = usense_key_of(key, &prop->hash);
+	if (prop->slot == USENSE_KEY_OTHER) {
+		prop->key = strdup(key);
+		if (prop->key == NULL) {
+			free(prop);
+			return NULL;
+		}
+		prop->hash_next = dev->hash[prop->hash % USENSE_PROP_HASH];
+		dev->hash[prop->hash % USENSE_PROP_HASH] = prop;
+	} else {
+		prop->key = usense_key_name[prop->slot];
+		dev->slot[prop->slot] = prop;
+	}
+
+	/* Keep the walk order sorted */
+	for (pprev = &dev->props; *pprev != NULL; pprev = &(*pprev)->next) {
+		if (strcmp((*pprev)->key, prop->key) > 0)
+			break;
+	}
+	prop->next = *pprev;
+	*pprev = prop;
+
+	return prop;
+}
+
+/* A new raw sample - parse it once
+ *
+ * Called with dev->lock held.
+ */
+static void usense_reading_parse(struct usense_device *dev, const char *val)
+{
+	char *tmp;
+
+	dev->raw = strtod(val, &tmp);
+	dev->raw_valid = (tmp != val && *tmp == 0);
+
+	/* Never 0, which marks the output cache stale */
+	if (++dev->sample == 0)
+		dev->sample = 1;
+}
+
+/* Resize the history, keeping the newest samples
+ *
+ * Called with dev->lock held.
+ */
+static int usense_history_resize(struct usense_device *dev, unsigned int size)
+{
+	struct usense_history_entry *ring = NULL;
+	unsigned int i, n, old;
+
+	if (size > 0) {
+		ring = calloc(size, sizeof(*ring));
+		if (ring == NULL)
+			return -ENOMEM;
+	}
+
+	/* Oldest kept first */
+	n = (dev->ring_count < size) ? dev->ring_count : size;
+	for (i = 0; i < n; i++) {
+		old = (dev->ring_head + dev->ring_size - n + i) % dev->ring_size;
+		ring[i] = dev->ring[old];
+	}
+
+	free(dev->ring);
+	dev->ring = ring;
+	dev->ring_size = size;
+	dev->ring_head = (size > 0) ? n % size : 0;
+	dev->ring_count = n;
+
+	return 0;
+}
+
+/* Called with dev->lock held.
+ */
+static int usense_prop_store(struct usense_device *dev, struct usense_prop *prop, const char *key, const char *value)
+{
+	int err;
+
+	if (prop == NULL) {
+		prop = usense_prop_new(dev, key);
+		if (prop == NULL)
+			return -ENOMEM;
+	} else if (strcmp(prop->value, value) == 0) {
+		return 0;
+	}
+
+	if (prop->slot == USENSE_KEY_HISTORY_SIZE) {
+		err = usense_history_resize(dev, strtoul(value, NULL, 0));
+		if (err < 0)
+			return err;
+	}
+
+	strcpy(prop->value, value);
+
+	switch (prop->slot) {
+	case USENSE_KEY_READING:
+		usense_reading_parse(dev, value);
+		/* usense_device_update() publishes when it's done */
+		if (!dev->updating)
+			usense_reading_publish(dev);
+		break;
+	case USENSE_KEY_TYPE:
+	case USENSE_KEY_UNITS:
+	case USENSE_KEY_CALIBRATE_ADD:
+	case USENSE_KEY_CALIBRATE_MULT:
+		dev->xform.valid = 0;
+		dev->pub_sample = 0;
+		usense_reading_publish(dev);
+		break;
+	case USENSE_KEY_READING_MAX_AGE:
+		USENSE_STORE(dev->max_age_ms, strtoul(value, NULL, 0));
+		break;
+	case USENSE_KEY_READING_STALE:
+		USENSE_STORE(dev->stale_ok, (strtol(value, NULL, 0) != 0));
+		break;
+	default:
+		break;
+	}
+
+	if (dev->mode == USENSE_MODE_READ)
+		usense_notify(dev, prop->key);
+
+	return 1;
+}
+
+int usense_prop_set(struct usense_device *dev, const char *key, const char *value)
+{
+	struct usense_prop *prop;
+	enum usense_key slot;
+	int writable = 0;
+	int err;
+
+	if (key == NULL || value == NULL || strlen(value) >= USENSE_PROP_MAX) {
+		return -EINVAL;
+	}
+
+	/* Only the library keeps these */
+	if (strncmp(key, "stats.", 6) == 0) {
+		if (strcmp(key, "stats.reset") != 0)
+			return -EROFS;
+		usense_stats_reset(dev);
+		return 0;
+	}
+
+	slot = usense_key_of(key, NULL);
+
+	pthread_mutex_lock(&dev->lock);
+
+	/* The driver may set anything while attaching,
+	 * or from within its update()
+	 */
+	if (dev->mode == USENSE_MODE_UPDATE ||
+	    (dev->updating && pthread_equal(dev->updater, pthread_self())))
+		writable = 1;
+
+	/* If it's 'units', validate it.
+	 */
+	if (slot == USENSE_KEY_UNITS) {
+		uint32_t units;
+		const char *type;
+
+		type = usense_prop_value(dev, USENSE_KEY_TYPE);
+		assert(type != NULL);
+
+		units = units_is_valid(type, value);
+		if (units == 0) {
+			pthread_mutex_unlock(&dev->lock);
+			return -EINVAL;
+		}
+
+		writable = 1;
+	}
+	
+	if (slot == USENSE_KEY_CALIBRATE_ADD ||
+	    slot == USENSE_KEY_CALIBRATE_MULT)
+		writable = 1;
+
+	if (slot == USENSE_KEY_READING_MAX_AGE ||
+	    slot == USENSE_KEY_READING_STALE ||
+	    slot == USENSE_KEY_HISTORY_SIZE) {
+		unsigned long ul;
+		char *tmp;
+
+		ul = strtoul(value, &tmp, 0);
+		if (tmp == value || *tmp != 0 || value[0] == '-' ||
+		    (slot == USENSE_KEY_HISTORY_SIZE && ul > USENSE_HISTORY_MAX)) {
+			pthread_mutex_unlock(&dev->lock);
+			return -EINVAL;
+		}
+
+		writable = 1;
+	}
+
+	pthread_mutex_unlock(&dev->lock);
+
+	/* Does the device says it's writable? */
+	if (!writable && dev->probe->on_prop_set != NULL) {
+		err = dev->probe->on_prop_set(dev, dev->priv, key, value);
+		if (err < 0) {
+			return -EINVAL;
+		}
+		writable = 1;
+	}
+
+	if (!writable) {
+		return -EROFS;
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	if (slot == USENSE_KEY_OTHER)
+		prop = usense_prop_find(dev, key);
+	else
+		prop = dev->slot[slot];
+	err = usense_prop_store(dev, prop, key, value);
+	pthread_mutex_unlock(&dev->lock);
+
+	return err;
+}
+
+/* Property walking
+ */
+const char *usense_prop_first(struct usense_device *dev)
+{
+	const char *key = NULL;
+
+	pthread_mutex_lock(&dev->lock);
+	if (dev->props != NULL) {
+		key = dev->props->key;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return key;
+}
+
+const char *usense_prop_next(struct usense_device *dev, const char *curr_prop)
+{
+	struct usense_prop *prop;
+	const char *key = NULL;
+
+	pthread_mutex_lock(&dev->lock);
+	prop = usense_prop_find(dev, curr_prop);
+	if (prop != NULL && prop->next != NULL) {
+		key = prop->next->key;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return key;
+}
+
+const char *usense_prop_iter(struct usense_device *dev, void **cursor, char *buff, size_t len)
+{
+	struct usense_prop *prop;
+
+	/* Properties are never removed, so the cursor stays valid */
+	pthread_mutex_lock(&dev->lock);
+	prop = *cursor;
+	prop = (prop == NULL) ? dev->props : prop->next;
+	pthread_mutex_unlock(&dev->lock);
+
+	*cursor = prop;
+	if (prop == NULL)
+		return NULL;
+
+	if (buff != NULL)
+		usense_prop_get(dev, prop->key, buff, len);
+
+	return prop->key;
+}
+
+int usense_prop_snapshot(struct usense_device *dev, char *buff, size_t len)
+{
+	struct usense_reading r;
+	struct usense_prop *prop;
+	const char *value;
+	size_t pos = 0;
+	int n;
+
+	usense_reading_refresh(dev);
+
+	pthread_mutex_lock(&dev->lock);
+	usense_reading_load(dev, &r);
+	for (prop = dev->props; prop != NULL; prop = prop->next) {
+		if (prop->slot == USENSE_KEY_READING && r.valid)
+			value = r.text;
+		else
+			value = prop->value;
+
+		n = snprintf(buff + pos, (pos < len) ? len - pos : 0, "%s=%s\n", prop->key, value);
+		pos += n;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	if (pos >= len)
+		return -ENOSPC;
+
+	return pos;
+}
+
+/************** Sample history **************/
+
+/* Fold the newest samples, back to 'count' of them or
+ * 'since_ns', whichever comes first.
+ */
+static int usense_history_fold(struct usense_device *dev, unsigned int count, uint64_t since_ns, struct usense_history *hist)
+{
+	const struct usense_history_entry *ent = NULL;
+	double min = 0.0, max = 0.0, sum = 0.0, tmp;
+	unsigned int i, n = 0;
+
+	memset(hist, 0, sizeof(*hist));
+
+	pthread_mutex_lock(&dev->lock);
+	for (i = 0; i < dev->ring_count && i < count; i++) {
+		ent = &dev->ring[(dev->ring_head + dev->ring_size - 1 - i) % dev->ring_size];
+		if (ent->ns < since_ns)
+			break;
+
+		if (n == 0) {
+			min = max = ent->raw;
+			hist->last = ent->raw;
+			hist->last_at = ent->at;
+		} else if (ent->raw < min) {
+			min = ent->raw;
+		} else if (ent->raw > max) {
+			max = ent->raw;
+		}
+		sum += ent->raw;
+		hist->first_at = ent->at;
+		n++;
+	}
+
+	if (n > 0 && usense_xform_ready(dev) < 0) {
+		pthread_mutex_unlock(&dev->lock);
+		return -EINVAL;
+	}
+
+	/* The history is in native units, so convert the
+	 * aggregates to the current ones.
+	 */
+	if (n > 0) {
+		hist->min = min * dev->xform.scale + dev->xform.offset;
+		hist->max = max * dev->xform.scale + dev->xform.offset;
+		hist->mean = (sum / n) * dev->xform.scale + dev->xform.offset;
+		hist->last = hist->last * dev->xform.scale + dev->xform.offset;
+		if (hist->min > hist->max) {	/* Negative calibrate.mult */
+			tmp = hist->min;
+			hist->min = hist->max;
+			hist->max = tmp;
+		}
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	hist->count = n;
+	return n;
+}
+
+int usense_history_last(struct usense_device *dev, int count, struct usense_history *hist)
+{
+	if (count < 0)
+		return -EINVAL;
+
+	return usense_history_fold(dev, count, 0, hist);
+}
+
+int usense_history_window(struct usense_device *dev, unsigned int msec, struct usense_history *hist)
+{
+	uint64_t now = usense_now_ns(), span = msec * 1000000ULL;
+
+	return usense_history_fold(dev, UINT_MAX, (now > span) ? now - span : 0, hist);
+}
+
+int usense_history_read(struct usense_device *dev, struct usense_sample *sample, int max)
+{
+	const struct usense_history_entry *ent;
+	unsigned int i, n;
+
+	if (max < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&dev->lock);
+	n = (dev->ring_count < (unsigned int)max) ? dev->ring_count : (unsigned int)max;
+	if (n > 0 && usense_xform_ready(dev) < 0) {
+		pthread_mutex_unlock(&dev->lock);
+		return -EINVAL;
+	}
+
+	/* Oldest first */
+	for (i = 0; i < n; i++) {
+		ent = &dev->ring[(dev->ring_head + dev->ring_size - n + i) % dev->ring_size];
+		sample[i].dev = dev;
+		sample[i].value = ent->raw * dev->xform.scale + dev->xform.offset;
+		sample[i].timestamp = ent->at;
+		sample[i].sampled_ns = ent->ns;
+		sample[i].status = 0;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	return n;
+}
+
+/************** Shared memory snapshot **************/
+
+int usense_shm_publish(struct usense *usense, const char *path)
+{
+	struct usense_table *tbl;
+	struct usense_device *dev;
+	struct usense_shm *shm;
+	int i;
+
+	if (path == NULL)
+		path = USENSE_SHM_PATH;
+
+	pthread_mutex_lock(&usense->lock);
+	if (usense->shm != NULL) {
+		pthread_mutex_unlock(&usense->lock);
+		return -EBUSY;
+	}
+
+	shm = usense_shm_create(path, USENSE_SHM_ENTRIES);
+	if (shm == NULL) {
+		i = -errno;
+		pthread_mutex_unlock(&usense->lock);
+		return i;
+	}
+	__atomic_store_n(&usense->shm, shm, __ATOMIC_RELEASE);
+
+	/* Fill in what we already have */
+	tbl = usense->table;
+	for (i = 0; tbl != NULL && i < tbl->devs; i++) {
+		dev = tbl->dev[i];
+		if (dev == NULL)
+			continue;
+
+		pthread_mutex_lock(&dev->lock);
+		usense_reading_publish(dev);
+		pthread_mutex_unlock(&dev->lock);
+	}
+	pthread_mutex_unlock(&usense->lock);
+
+	return 0;
+}
+
+/************** Bulk sampling **************/
+
+int usense_read_cached(struct usense_device *dev, struct usense_sample *sample)
+{
+	struct usense_reading r;
+
+	sample->dev = dev;
+	usense_reading_load(dev, &r);
+	if (!r.valid) {
+		sample->status = -EIO;
+		return -EIO;
+	}
+
+	sample->value = r.value;
+	sample->timestamp = r.sampled_at;
+	sample->sampled_ns = r.sampled_ns;
+	sample->status = 0;
+
+	return 0;
+}
+
+static void *usense_read_one(void *arg)
+{
+	struct usense_sample *sample = arg;
+	struct usense_reading r;
+	int err;
+
+	err = usense_reading_refresh(sample->dev);
+
+	usense_reading_load(sample->dev, &r);
+	if (!r.valid) {
+		sample->status = (err < 0) ? err : -EIO;
+	} else {
+		sample->value = r.value;
+		sample->timestamp = r.sampled_at;
+		sample->sampled_ns = r.sampled_ns;
+		sample->status = (err < 0) ? err : 0;
+	}
+
+	return NULL;
+}
+
+int usense_read(struct usense *usense, struct usense_sample *sample, int count)
+{
+	pthread_t *thread;
+	int i, *started;
+
+	if (count <= 0)
+		return 0;
+
+	thread = calloc(count, sizeof(*thread));
+	started = calloc(count, sizeof(*started));
+	if (thread == NULL || started == NULL) {
+		free(thread);
+		free(started);
+		return -ENOMEM;
+	}
+
+	/* Each device has its own handle, so their
+	 * transactions can overlap.
+	 */
+	for (i = 0; i < count; i++) {
+		sample[i].status = -ENODEV;
+		sample[i].value = 0.0;
+		memset(&sample[i].timestamp, 0, sizeof(sample[i].timestamp));
+		sample[i].sampled_ns = 0;
+		if (sample[i].dev == NULL || USENSE_LOAD(sample[i].dev->mode) != USENSE_MODE_READ)
+			continue;
+
+		/* Last one, or no threads to spare? Do it here. */
+		if (i == count - 1 ||
+		    pthread_create(&thread[i], NULL, usense_read_one, &sample[i]) != 0) {
+			usense_read_one(&sample[i]);
+			continue;
+		}
+		started[i] = 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (started[i])
+			pthread_join(thread[i], NULL);
+	}
+
+	free(thread);
+	free(started);
+
+	return count;
+}
+
+int usense_read_all(struct usense *usense, struct usense_sample *sample, int max)
+{
+	struct usense_table *tbl;
+	struct usense_device *dev;
+	unsigned int epoch;
+	int i, n = 0;
+
+	tbl = usense_table_get(usense, &epoch);
+	for (i = 0; tbl != NULL && i < tbl->devs && n < max; i++) {
+		dev = tbl->dev[i];
+		if (dev != NULL && USENSE_LOAD(dev->mode) == USENSE_MODE_READ)
+			sample[n++].dev = dev;
+	}
+	usense_table_put(usense, epoch);
+
+	return usense_read(usense, sample, n);
 }
@@ -21,12 +21,17 @@
 #ifndef USENSE_H
 #define USENSE_H
 
-#include <usb.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <libusb.h>
 
 struct usense;
 struct usense_device;
 
 #define USENSE_PROP_MAX		256	/* Maximum property length, including ASCIIz */
+#define USENSE_NAME_MAX		32	/* Maximum device name length, including ASCIIz */
+#define USENSE_UNITS_MAX	16	/* Maximum 'units' length (ie mFahrenheit), including ASCIIz */
 
 struct usense_probe {
 	enum {
@@ -38,11 +43,13 @@ struct usense_probe {
 	union {
 		struct {	/* USB probe functions */
 			/* Does it look like one? 0 = no, 1 = yes */
-			int (*match)(struct usb_device_descriptor *desc);
+			int (*match)(struct libusb_device_descriptor *desc);
 
 			/* Set up '*priv' to point to any drive data you need.
+			 *
+			 * 'usb' stays open until after release().
 			 */
-			int (*attach)(struct usense_device *dev, struct usb_dev_handle *usb, void **priv);
+			int (*attach)(struct usense_device *dev, libusb_device_handle *usb, void **priv);
 		} usb;
 		struct {	/* Serial probe functions */
 			/* Does it look like one? 0 = no, 1 = yes */
@@ -88,12 +95,20 @@ void usense_probe_unregister(const struct usense_probe *ops);
  *
  *  usb:<bus>.<device>
  *
+ *
+ * Everything here is thread-safe. Devices have their own locks,
+ * so one slow device never holds up another, and readings are
+ * read without taking any lock at all.
  */
 struct usense *usense_start(void);
 void usense_stop(struct usense *usense);
 
 /*
  * Rescan for new devices.
+ *
+ * Devices are also added and removed as they are
+ * hotplugged, while the monitor is running. Either way,
+ * a new device queues a USENSE_CHANGE_ADD record.
  */
 void usense_detect(struct usense *usense);
 
@@ -102,15 +117,118 @@ void usense_detect(struct usense *usense);
  */
 const char *usense_next(struct usense *usense, const char *prev_name);
 
+/* Devices have a stable integer id, assigned in
+ * the order they were detected, starting at 0. Once
+ * a device is unplugged, its id goes to the next one
+ * plugged in.
+ */
+int usense_device_id(struct usense_device *dev);
+
+/* Runtime statistics, since the device was found
+ * or 'stats.reset' was last set.
+ *
+ * They are also readable as properties, which are computed
+ * when read and never listed by the property walk:
+ *
+ *  stats.updates, stats.errors, stats.retries,
+ *  stats.transfers, stats.transfer_errors, stats.bytes
+ *
+ * and the latency of update() and of each USB transfer:
+ *
+ *  stats.update.{count,min_us,mean_us,max_us,p50_us,p90_us,p99_us,p999_us}
+ *  stats.transfer.{..the same}
+ *
+ * Setting 'stats.reset' (to anything) zeroes them all.
+ */
+struct usense_stats {
+	uint64_t updates;	/* Hardware reads */
+	uint64_t errors;	/* ..that failed */
+	uint64_t latency_ns;	/* Total time spent in them */
+	uint64_t retries;	/* Operations tried again */
+	uint64_t transfers;	/* USB transfers */
+	uint64_t transfer_errors;	/* ..that failed */
+	uint64_t bytes;		/* ..and what the rest moved */
+};
+
+int usense_device_stats(struct usense_device *dev, struct usense_stats *stats);
+
+/* How many updates took at most each of le_ns[0..n-1], which
+ * must be ascending; UINT64_MAX counts them all. From the
+ * same histogram as stats.update.*, so to within 6.25%.
+ */
+int usense_device_update_le(struct usense_device *dev, const uint64_t *le_ns,
+			    uint64_t *count, int n);
+
+/* For drivers: count an operation that had to be tried again */
+void usense_device_retry(struct usense_device *dev);
+
+/* Changes whenever any device is sampled, so callers
+ * can tell when anything they derived is out of date.
+ */
+unsigned int usense_generation(struct usense *usense);
+
 /*
  * fd to use with poll(2) for monitoring when device
  * properties have changed
+ *
+ * Opened devices are sampled in the background, and
+ * every property change queues a change record.
  */
 int usense_monitor_fd(struct usense *usense);
 
+struct usense_change {
+	char device[64];		/* Device name (ie usb:003.2) */
+	char prop[64];			/* Property that changed */
+	unsigned int generation;	/* Per-device change count */
+};
+
+/* Hotplug records use these in place of a property name */
+#define USENSE_CHANGE_ADD	"+"
+#define USENSE_CHANGE_REMOVE	"-"
+
+/* Read up to 'max' pending change records.
+ * Returns the number of records read, 0 if
+ * none are pending, or -errno.
+ */
+int usense_monitor_read(struct usense *usense, struct usense_change *change, int max);
+
+/* Background sampling period, in milliseconds.
+ * 0 disables background sampling.
+ */
+#define USENSE_MONITOR_INTERVAL	1000
+
+void usense_monitor_interval(struct usense *usense, unsigned int msec);
+
+/* USB transfers are asynchronous, and completed by one event
+ * loop. The monitor thread runs it, but if you have your own
+ * poll(2) loop, you can run it from there too.
+ *
+ * usense_pollfds() fills in up to 'max' pollfds, and returns
+ * how many are needed. When any are ready, call
+ * usense_handle_events(), which never blocks.
+ */
+int usense_pollfds(struct usense *usense, struct pollfd *pfd, int max);
+int usense_handle_events(struct usense *usense);
+
 /************** Open and close devices ****************
+ *
+ * Opening an already opened device is cheap.
  */
 struct usense_device *usense_open(struct usense *usense, const char *device_name);
+struct usense_device *usense_open_id(struct usense *usense, int id);
+
+/* An already opened device, or NULL. Never attaches,
+ * so it never waits for the hardware.
+ */
+struct usense_device *usense_find(struct usense *usense, const char *device_name);
+
+/* Open every detected device at once.
+ *
+ * Devices are attached concurrently, so this takes about as
+ * long as the slowest one. Returns the number of opened devices,
+ * or -errno.
+ */
+int usense_open_all(struct usense *usense);
 
 void usense_close(struct usense_device *dev);
 
@@ -145,5 +263,197 @@ int usense_prop_set(struct usense_device *dev, const char *prop, const char *val
 const char *usense_prop_first(struct usense_device *dev);
 const char *usense_prop_next(struct usense_device *dev, const char *curr_prop);
 
+/* Property cursor, O(1) per step
+ *
+ * Start with *cursor = NULL. Returns the next key,
+ * or NULL at the end. If 'buff' is not NULL, the value
+ * is copied there, as with usense_prop_get().
+ */
+const char *usense_prop_iter(struct usense_device *dev, void **cursor, char *buff, size_t len);
+
+/* Serialize all properties into 'buff' as "key=value\n" lines,
+ * with at most one hardware read.
+ *
+ * Returns the length, or -ENOSPC if 'buff' is too small.
+ */
+int usense_prop_snapshot(struct usense_device *dev, char *buff, size_t len);
+
+/************** Bulk sampling **************/
+
+struct usense_sample {
+	struct usense_device *dev;	/* Device to sample */
+	double value;			/* Reading, in the device's 'units' */
+	struct timespec timestamp;	/* CLOCK_REALTIME of the sample */
+	uint64_t sampled_ns;		/* ..and its CLOCK_MONOTONIC, in ns */
+	int status;			/* 0, or -errno */
+};
+
+/* Sample several devices concurrently
+ *
+ * usense_read() samples the 'count' devices in sample[].dev
+ * usense_read_all() samples every opened device, up to 'max'
+ *
+ * Both return the number of samples filled in, or -errno.
+ * Wall time is that of the slowest device.
+ */
+int usense_read(struct usense *usense, struct usense_sample *sample, int count);
+int usense_read_all(struct usense *usense, struct usense_sample *sample, int max);
+
+/* The newest sample, without touching the hardware.
+ * Returns its status.
+ */
+int usense_read_cached(struct usense_device *dev, struct usense_sample *sample);
+
+/************** Sample history **************
+ *
+ * Each device keeps its newest 'history.size' samples in memory
+ * (0, the default, keeps none). Values are in the current 'units'.
+ */
+struct usense_history {
+	int count;			/* Samples aggregated */
+	double min, max, mean;
+	double last;			/* The newest sample */
+	struct timespec first_at;	/* CLOCK_REALTIME of the oldest.. */
+	struct timespec last_at;	/* ..and newest samples */
+};
+
+/* Aggregate the newest 'count' samples, or the samples
+ * from the last 'msec' milliseconds.
+ *
+ * Neither allocates, and both only visit the samples they
+ * aggregate. Return the number aggregated, or -errno.
+ */
+int usense_history_last(struct usense_device *dev, int count, struct usense_history *hist);
+int usense_history_window(struct usense_device *dev, unsigned int msec, struct usense_history *hist);
+
+/* Copy out up to 'max' of the newest samples, oldest first.
+ * Returns the number copied, or -errno.
+ */
+int usense_history_read(struct usense_device *dev, struct usense_sample *sample, int max);
+
+/************** Shared memory snapshot **************
+ *
+ * A daemon can publish every opened device's latest reading
+ * into a memory-mapped file. Any number of other processes can
+ * then read it, with no syscalls and no USB access.
+ */
+#define USENSE_SHM_PATH	"/run/usense/readings"
+
+/* Publish to 'path' (NULL for USENSE_SHM_PATH) until usense_stop() */
+int usense_shm_publish(struct usense *usense, const char *path);
+
+struct usense_shm;
+
+struct usense_shm_reading {
+	char device[USENSE_NAME_MAX];	/* Device name (ie usb:003.2) */
+	char units[USENSE_UNITS_MAX];	/* As the 'units' property */
+	char reading[32];		/* As the 'reading' property */
+	double value;			/* Reading, in 'units' */
+	struct timespec timestamp;	/* CLOCK_REALTIME of the sample */
+	int status;			/* 0, or -errno */
+};
+
+/* Map the snapshot (NULL for USENSE_SHM_PATH) read-only.
+ * Returns NULL, with errno set, on failure.
+ */
+struct usense_shm *usense_shm_open(const char *path);
+
+/* Device ids in use are below this */
+int usense_shm_devices(struct usense_shm *shm);
+
+/* Returns 0, -ENOENT if 'id' was never published, or -EINVAL */
+int usense_shm_read(struct usense_shm *shm, int id, struct usense_shm_reading *r);
+
+void usense_shm_close(struct usense_shm *shm);
+
+/************** usensed client **************
+ *
+ * usensed owns the devices, and answers requests on a Unix
+ * socket. Requests are one line each:
+ *
+ *   list			All device names
+ *   get <device> <prop>	A property
+ *   set <device> <prop> <value>
+ *   snapshot <device>		All properties, as "key=value"
+ *   subscribe [<device>]	Change records, from now on
+ *
+ * <device> is a name or an id. Replies come in order, so any
+ * number of requests can be sent at once. A reply is one of:
+ *
+ *   +<value>			Success
+ *   *<n>			Success, with <n> lines following
+ *   -<errno> <message>		Failure
+ *
+ * Change records (">device prop generation") can arrive at any
+ * time after 'subscribe', but never inside a reply.
+ */
+#define USENSE_SOCKET_PATH	"/run/usense/socket"
+
+struct usense_client;
+
+/* Returns NULL, with errno set, if usensed isn't running */
+struct usense_client *usense_client_connect(const char *path);
+void usense_client_close(struct usense_client *client);
+
+/* For poll(2), ie while subscribed */
+int usense_client_fd(struct usense_client *client);
+
+/* Queue a request, printf(3) style, without the newline.
+ * Queued requests are sent by usense_client_flush(), or
+ * by the next usense_client_reply().
+ */
+int usense_client_request(struct usense_client *client, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+int usense_client_flush(struct usense_client *client);
+
+/* Wait for the next reply. Returns the number of lines that
+ * follow it, for usense_client_line(), or -errno.
+ *
+ * The value of a '+' reply, or the message of a '-' reply, is
+ * copied to 'buff'. Change records that arrive first are held
+ * for usense_client_change().
+ */
+int usense_client_reply(struct usense_client *client, char *buff, size_t len);
+int usense_client_line(struct usense_client *client, char *buff, size_t len);
+
+/* Wait for the next change record */
+int usense_client_change(struct usense_client *client, struct usense_change *change);
+
+/************** Binary stream format **************
+ *
+ * 'usense --stream' writes a header, one descriptor per
+ * device, and then one record per device per period, all in
+ * host byte order. Check 'magic' to tell which that is.
+ */
+#define USENSE_STREAM_MAGIC	0x54534e55	/* "UNST" */
+#define USENSE_STREAM_VERSION	2
+
+struct usense_stream_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;	/* sizeof(struct usense_stream_header) */
+	uint16_t device_size;	/* sizeof(struct usense_stream_device) */
+	uint16_t record_size;	/* sizeof(struct usense_stream_record) */
+	uint32_t devices;	/* Descriptors that follow */
+	uint32_t interval_ms;	/* Sampling period */
+	uint32_t reserved;
+};
+
+struct usense_stream_device {
+	uint32_t id;		/* As usense_device_id() */
+	uint32_t reserved;
+	char name[USENSE_NAME_MAX];	/* ie usb:003.2 */
+	char device[16];	/* ie gotemp */
+	char units[USENSE_UNITS_MAX];
+};
+
+struct usense_stream_record {
+	uint32_t id;
+	int32_t status;		/* 0, or -errno */
+	uint64_t mono_ns;	/* CLOCK_MONOTONIC of the sample */
+	uint64_t real_ns;	/* CLOCK_REALTIME of the sample */
+	double value;		/* In 'units' */
+};
+
 
 #endif /* USENSE_H */
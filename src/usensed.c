@@ -0,0 +1,1297 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* usensed - owns the devices, and serves them over a Unix socket
+ *
+ * See 'usensed client' in usense.h for the protocol.
+ *
+ * With '-m [addr:]port', it also serves every device's reading
+ * over HTTP, in the Prometheus text exposition format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+
+#include "usense.h"
+
+#define CLIENT_LINE_MAX	(USENSE_PROP_MAX + 256)
+#define CLIENT_OUT_MAX	(1 << 20)	/* Slow subscribers are dropped past this */
+
+#define METRICS_DEVS_MAX	256
+
+/* usense_update_seconds buckets: Prometheus' defaults, from 1ms */
+static const uint64_t update_le_ns[] = {
+	1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+	100000000, 250000000, 500000000, 1000000000, 2500000000ULL,
+	5000000000ULL, 10000000000ULL, UINT64_MAX,
+};
+#define UPDATE_BUCKETS	(sizeof(update_le_ns) / sizeof(update_le_ns[0]))
+
+/* A rendered HTTP response. Scrapers share it, and
+ * keep it alive until they have sent all of it.
+ */
+struct page {
+	int refs;
+	unsigned int generation;	/* usense_generation() it was made from */
+	size_t len;
+	char text[];
+};
+
+/* Text waiting to be sent */
+struct out {
+	char *text;
+	size_t len, size;
+	int full;		/* Past CLIENT_OUT_MAX, or out of memory */
+};
+
+struct client {
+	struct client *next;
+	int fd;
+
+	/* Socket clients have a worker thread, which answers their
+	 * requests in order. Only it waits for the hardware, so a
+	 * slow device never holds up the poll loop or other clients.
+	 */
+	struct usense *usense;
+	pthread_t thread;
+	int worker;		/* The thread was started */
+	struct out reply;	/* The worker's reply in progress */
+
+	pthread_mutex_t lock;	/* For everything below */
+	pthread_cond_t cond;	/* More requests, or dead */
+	int dead;
+	int eof;		/* The peer has sent its last request */
+	int exited;		/* The worker is done */
+	char in[CLIENT_LINE_MAX];	/* Requests not yet answered */
+	size_t in_len;
+	struct out out;		/* Replies not yet sent */
+	int subscribed;
+	char filter[USENSE_NAME_MAX];	/* Empty for all devices */
+
+	/* HTTP scrapers get one response, then are closed.
+	 * They have no worker; the poll loop serves them.
+	 */
+	int http;
+	int status;		/* To reply with, once the request line is read */
+	size_t line_len;	/* Of the header line being skipped */
+	int done;		/* Replied */
+	struct page *page;
+	size_t page_sent;
+};
+
+struct metrics {
+	struct usense *usense;
+	struct page *page;
+};
+
+/* A device that was plugged in, waiting to be opened */
+struct plugged {
+	struct plugged *next;
+	struct usense_change change;	/* Its USENSE_CHANGE_ADD */
+};
+
+/* Opening a device talks to the hardware, and a rescan reads
+ * every descriptor, so both are left to a thread of their own.
+ */
+struct attacher {
+	struct usense *usense;
+	pthread_t thread;
+	pthread_mutex_t lock;	/* For everything below */
+	pthread_cond_t cond;	/* More to do, or stop */
+	struct plugged *pending, **tail;
+	int rescan;
+	int stop;
+};
+
+static const char *program;
+static int wake[2] = { -1, -1 };	/* Workers wake the poll loop with this */
+
+static void poll_wake(void)
+{
+	char c = 0;
+	ssize_t len;
+
+	len = write(wake[1], &c, 1);
+	(void)len;
+}
+
+/* Room for at least 'need' bytes */
+static int out_grow(struct out *o, size_t need)
+{
+	size_t size;
+	char *tmp;
+
+	size = o->size ? o->size * 2 : 4096;
+	while (size < need)
+		size *= 2;
+	if (size > CLIENT_OUT_MAX) {
+		o->full = 1;
+		return -ENOSPC;
+	}
+	tmp = realloc(o->text, size);
+	if (tmp == NULL) {
+		o->full = 1;
+		return -ENOMEM;
+	}
+	o->text = tmp;
+	o->size = size;
+
+	return 0;
+}
+
+static void out_vprintf(struct out *o, const char *fmt, va_list ap)
+{
+	va_list aq;
+	int n;
+
+	if (o->full)
+		return;
+
+	for (;;) {
+		va_copy(aq, ap);
+		n = vsnprintf(o->text + o->len, o->size - o->len, fmt, aq);
+		va_end(aq);
+		if (n < 0)
+			return;
+
+		if (o->len + n < o->size)
+			break;
+
+		if (out_grow(o, o->len + n + 1) < 0)
+			return;
+	}
+
+	o->len += n;
+}
+
+static void out_printf(struct out *o, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void out_printf(struct out *o, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	out_vprintf(o, fmt, ap);
+	va_end(ap);
+}
+
+static void out_append(struct out *o, const char *text, size_t len)
+{
+	if (o->full || len == 0)
+		return;
+
+	if (o->len + len > o->size && out_grow(o, o->len + len) < 0)
+		return;
+
+	memcpy(o->text + o->len, text, len);
+	o->len += len;
+}
+
+static void reply(struct client *cl, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Only the worker replies, so this needs no lock */
+static void reply(struct client *cl, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	out_vprintf(&cl->reply, fmt, ap);
+	va_end(ap);
+}
+
+static void reply_err(struct client *cl, int err)
+{
+	reply(cl, "-%d %s\n", -err, strerror(-err));
+}
+
+/* Hand a whole reply over to the poll loop. Change records
+ * are queued between replies, never inside one.
+ */
+static void client_post(struct client *cl)
+{
+	int idle;
+
+	pthread_mutex_lock(&cl->lock);
+	idle = (cl->out.len == 0);
+	out_append(&cl->out, cl->reply.text, cl->reply.len);
+	if (cl->reply.full || cl->out.full)
+		cl->dead = 1;
+	pthread_mutex_unlock(&cl->lock);
+
+	cl->reply.len = 0;
+	cl->reply.full = 0;
+
+	/* Otherwise the poll loop already knows there is more to send */
+	if (idle)
+		poll_wake();
+}
+
+static void page_put(struct page *page)
+{
+	if (page != NULL && --page->refs == 0)
+		free(page);
+}
+
+static void client_flush(struct client *cl)
+{
+	ssize_t n;
+
+	pthread_mutex_lock(&cl->lock);
+	while (cl->out.len > 0 && !cl->dead) {
+		n = send(cl->fd, cl->out.text, cl->out.len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				cl->dead = 1;
+			pthread_mutex_unlock(&cl->lock);
+			return;
+		}
+		cl->out.len -= n;
+		memmove(cl->out.text, cl->out.text + n, cl->out.len);
+	}
+	pthread_mutex_unlock(&cl->lock);
+
+	while (cl->page != NULL && cl->page_sent < cl->page->len && !cl->dead) {
+		n = send(cl->fd, cl->page->text + cl->page_sent,
+			 cl->page->len - cl->page_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				cl->dead = 1;
+			return;
+		}
+		cl->page_sent += n;
+	}
+
+	if (cl->http && cl->done && cl->out.len == 0)
+		cl->dead = 1;
+}
+
+/* Call with cl->lock held */
+static int client_pending(const struct client *cl)
+{
+	return cl->out.len > 0 || (cl->page != NULL && cl->page_sent < cl->page->len);
+}
+
+/* What to poll the client for. Nothing at all, rather than
+ * only POLLHUP, while its worker is still busy.
+ */
+static short client_events(struct client *cl)
+{
+	short events = 0;
+
+	pthread_mutex_lock(&cl->lock);
+	if (!cl->dead && !cl->eof && cl->in_len < sizeof(cl->in))
+		events |= POLLIN;
+	if (!cl->dead && client_pending(cl))
+		events |= POLLOUT;
+	pthread_mutex_unlock(&cl->lock);
+
+	return events;
+}
+
+/* By name, or by id */
+static struct usense_device *device_of(struct usense *usense, const char *name)
+{
+	struct usense_device *dev = NULL;
+	char *cp;
+	int id;
+
+	id = strtol(name, &cp, 0);
+	if (*cp == 0)
+		dev = usense_open_id(usense, id);
+	if (dev == NULL)
+		dev = usense_open(usense, name);
+
+	return dev;
+}
+
+static void do_list(struct usense *usense, struct client *cl)
+{
+	const char *name;
+	int n = 0;
+
+	for (name = usense_next(usense, NULL); name != NULL; name = usense_next(usense, name))
+		n++;
+
+	/* Devices can come and go while we walk, so
+	 * the count and the lines must agree.
+	 */
+	reply(cl, "*%d\n", n);
+	for (name = usense_next(usense, NULL); name != NULL && n > 0; name = usense_next(usense, name), n--)
+		reply(cl, "%s\n", name);
+	for (; n > 0; n--)
+		reply(cl, "\n");
+}
+
+static void do_snapshot(struct client *cl, struct usense_device *dev)
+{
+	char buff[16384], *line, *nl;
+	int err, n = 0;
+
+	err = usense_prop_snapshot(dev, buff, sizeof(buff));
+	if (err < 0) {
+		reply_err(cl, err);
+		return;
+	}
+
+	for (line = buff; (nl = strchr(line, '\n')) != NULL; line = nl + 1)
+		n++;
+
+	reply(cl, "*%d\n%s", n, buff);
+}
+
+static void request(struct usense *usense, struct client *cl, char *line)
+{
+	struct usense_device *dev = NULL;
+	char *cmd, *name, *prop, *value;
+	char buff[USENSE_PROP_MAX];
+	int err;
+
+	cmd = strtok_r(line, " ", &value);
+	if (cmd == NULL) {
+		reply_err(cl, -EINVAL);
+		return;
+	}
+
+	if (strcmp(cmd, "list") == 0) {
+		do_list(usense, cl);
+		return;
+	}
+
+	if (strcmp(cmd, "subscribe") != 0 && strcmp(cmd, "snapshot") != 0 &&
+	    strcmp(cmd, "get") != 0 && strcmp(cmd, "set") != 0) {
+		reply_err(cl, -EINVAL);
+		return;
+	}
+
+	name = strtok_r(NULL, " ", &value);
+
+	if (name != NULL)
+		dev = device_of(usense, name);
+
+	/* Queued along with the switch, so no change
+	 * record can get ahead of the reply.
+	 */
+	if (strcmp(cmd, "subscribe") == 0 && (name == NULL || dev != NULL)) {
+		pthread_mutex_lock(&cl->lock);
+		cl->subscribed = 1;
+		cl->filter[0] = 0;
+		if (dev != NULL) {
+			strncpy(cl->filter, usense_device_name(dev), sizeof(cl->filter) - 1);
+			cl->filter[sizeof(cl->filter) - 1] = 0;
+		}
+		out_printf(&cl->out, "+\n");
+		pthread_mutex_unlock(&cl->lock);
+		poll_wake();
+		return;
+	}
+
+	if (dev == NULL) {
+		reply_err(cl, -ENODEV);
+		return;
+	}
+
+	if (strcmp(cmd, "snapshot") == 0) {
+		do_snapshot(cl, dev);
+		return;
+	}
+
+	prop = strtok_r(NULL, " ", &value);
+	if (prop == NULL) {
+		reply_err(cl, -EINVAL);
+		return;
+	}
+
+	if (strcmp(cmd, "get") == 0) {
+		err = usense_prop_get(dev, prop, buff, sizeof(buff));
+		if (err < 0)
+			reply_err(cl, err);
+		else
+			reply(cl, "+%s\n", buff);
+	} else {
+		err = usense_prop_set(dev, prop, value);
+		if (err < 0)
+			reply_err(cl, err);
+		else
+			reply(cl, "+\n");
+	}
+}
+
+/* Answer the client's requests, one at a time, in order */
+static void *client_worker(void *arg)
+{
+	struct client *cl = arg;
+	char line[CLIENT_LINE_MAX];
+	size_t len;
+	char *nl;
+
+	pthread_mutex_lock(&cl->lock);
+	while (!cl->dead) {
+		nl = memchr(cl->in, '\n', cl->in_len);
+		if (nl == NULL) {
+			if (cl->eof)
+				break;
+			pthread_cond_wait(&cl->cond, &cl->lock);
+			continue;
+		}
+
+		len = nl - cl->in;
+		memcpy(line, cl->in, len);
+		line[len] = 0;
+		cl->in_len -= len + 1;
+		memmove(cl->in, nl + 1, cl->in_len);
+		pthread_mutex_unlock(&cl->lock);
+
+		request(cl->usense, cl, line);
+		client_post(cl);
+
+		pthread_mutex_lock(&cl->lock);
+	}
+	cl->exited = 1;
+	pthread_mutex_unlock(&cl->lock);
+
+	poll_wake();
+
+	return NULL;
+}
+
+/* Queue what the client sent for its worker. Requests already
+ * sent are still answered after the peer shuts down its end.
+ */
+static void client_input(struct client *cl)
+{
+	ssize_t n;
+
+	pthread_mutex_lock(&cl->lock);
+	if (cl->eof || cl->in_len == sizeof(cl->in)) {
+		pthread_mutex_unlock(&cl->lock);
+		return;
+	}
+
+	n = recv(cl->fd, cl->in + cl->in_len, sizeof(cl->in) - cl->in_len, MSG_DONTWAIT);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+		pthread_mutex_unlock(&cl->lock);
+		return;
+	}
+
+	if (n == 0) {
+		cl->eof = 1;
+	} else if (n < 0) {
+		cl->dead = 1;
+	} else {
+		cl->in_len += n;
+
+		/* No newline in a whole buffer? */
+		if (cl->in_len == sizeof(cl->in) && memchr(cl->in, '\n', cl->in_len) == NULL)
+			cl->dead = 1;
+	}
+	pthread_cond_signal(&cl->cond);
+	pthread_mutex_unlock(&cl->lock);
+}
+
+/************** Hotplug **************/
+
+static void *attacher_run(void *arg)
+{
+	struct attacher *at = arg;
+	struct plugged *p;
+
+	pthread_mutex_lock(&at->lock);
+	while (!at->stop) {
+		if (at->rescan) {
+			at->rescan = 0;
+			pthread_mutex_unlock(&at->lock);
+			usense_detect(at->usense);
+			pthread_mutex_lock(&at->lock);
+			continue;
+		}
+
+		p = at->pending;
+		if (p == NULL) {
+			pthread_cond_wait(&at->cond, &at->lock);
+			continue;
+		}
+		at->pending = p->next;
+		if (at->pending == NULL)
+			at->tail = &at->pending;
+		pthread_mutex_unlock(&at->lock);
+
+		/* Gone again already? Then this just fails. */
+		usense_open(at->usense, p->change.device);
+		free(p);
+
+		pthread_mutex_lock(&at->lock);
+	}
+	pthread_mutex_unlock(&at->lock);
+
+	return NULL;
+}
+
+static int attacher_start(struct attacher *at, struct usense *usense)
+{
+	at->usense = usense;
+	at->pending = NULL;
+	at->tail = &at->pending;
+	at->rescan = 0;
+	at->stop = 0;
+	pthread_mutex_init(&at->lock, NULL);
+	pthread_cond_init(&at->cond, NULL);
+
+	return -pthread_create(&at->thread, NULL, attacher_run, at);
+}
+
+/* Open the device 'change' added, soon */
+static void attacher_open(struct attacher *at, const struct usense_change *change)
+{
+	struct plugged *p;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return;
+	p->change = *change;
+
+	pthread_mutex_lock(&at->lock);
+	*at->tail = p;
+	at->tail = &p->next;
+	pthread_cond_signal(&at->cond);
+	pthread_mutex_unlock(&at->lock);
+}
+
+/* Look for new devices soon */
+static void attacher_rescan(struct attacher *at)
+{
+	pthread_mutex_lock(&at->lock);
+	at->rescan = 1;
+	pthread_cond_signal(&at->cond);
+	pthread_mutex_unlock(&at->lock);
+}
+
+static void attacher_stop(struct attacher *at)
+{
+	struct plugged *p;
+
+	pthread_mutex_lock(&at->lock);
+	at->stop = 1;
+	pthread_cond_signal(&at->cond);
+	pthread_mutex_unlock(&at->lock);
+
+	pthread_join(at->thread, NULL);
+
+	while ((p = at->pending) != NULL) {
+		at->pending = p->next;
+		free(p);
+	}
+	pthread_cond_destroy(&at->cond);
+	pthread_mutex_destroy(&at->lock);
+}
+
+static void broadcast(struct usense *usense, struct attacher *at, struct client *clients)
+{
+	struct usense_change change[16];
+	struct client *cl;
+	int i, n;
+
+	while ((n = usense_monitor_read(usense, change, 16)) > 0) {
+		/* usense_open_all() only opened what was there at the start */
+		for (i = 0; i < n; i++) {
+			if (strcmp(change[i].prop, USENSE_CHANGE_ADD) == 0)
+				attacher_open(at, &change[i]);
+		}
+
+		for (cl = clients; cl != NULL; cl = cl->next) {
+			pthread_mutex_lock(&cl->lock);
+			for (i = 0; i < n && cl->subscribed; i++) {
+				if (cl->filter[0] == 0 || strcmp(cl->filter, change[i].device) == 0)
+					out_printf(&cl->out, ">%s %s %u\n", change[i].device,
+						   change[i].prop, change[i].generation);
+			}
+			if (cl->out.full)
+				cl->dead = 1;
+			pthread_mutex_unlock(&cl->lock);
+		}
+	}
+}
+
+/************** Metrics **************/
+
+/* Label values escape '\', '"' and newlines */
+static void label(FILE *f, const char *key, const char *value, int last)
+{
+	fprintf(f, "%s=\"", key);
+	for (; *value != 0; value++) {
+		if (*value == '\\' || *value == '"')
+			fprintf(f, "\\%c", *value);
+		else if (*value == '\n')
+			fprintf(f, "\\n");
+		else
+			fputc(*value, f);
+	}
+	fprintf(f, "\"%s", last ? "" : ",");
+}
+
+/* 'le' is a histogram bucket's, or NULL */
+static void device_labels(FILE *f, struct usense_device *dev, int all, const char *le)
+{
+	char buff[USENSE_PROP_MAX];
+
+	fputc('{', f);
+	label(f, "device", usense_device_name(dev), !all && le == NULL);
+	if (all) {
+		if (usense_prop_get(dev, "type", buff, sizeof(buff)) < 0)
+			buff[0] = 0;
+		label(f, "type", buff, 0);
+		if (usense_prop_get(dev, "units", buff, sizeof(buff)) < 0)
+			buff[0] = 0;
+		label(f, "units", buff, le == NULL);
+	}
+	if (le != NULL)
+		label(f, "le", le, 1);
+	fputc('}', f);
+}
+
+/* Everything comes from what the devices have already
+ * published; none of this touches the hardware.
+ */
+static struct page *metrics_render(struct metrics *m, unsigned int generation)
+{
+	struct usense_sample cached[METRICS_DEVS_MAX];
+	struct usense_stats stats[METRICS_DEVS_MAX];
+	struct usense_device *dev;
+	struct page *page;
+	const char *name;
+	char *body = NULL, bound[32];
+	uint64_t le[UPDATE_BUCKETS];
+	size_t len = 0;
+	int i, j, n, devs = 0;
+	FILE *f;
+
+	f = open_memstream(&body, &len);
+	if (f == NULL)
+		return NULL;
+
+	/* Only the opened devices. Attaching the rest is for clients. */
+	for (name = usense_next(m->usense, NULL); name != NULL && devs < METRICS_DEVS_MAX;
+	     name = usense_next(m->usense, name)) {
+		dev = usense_find(m->usense, name);
+		if (dev != NULL)
+			usense_read_cached(dev, &cached[devs++]);
+	}
+
+	fprintf(f, "# HELP usense_reading Latest reading, in the device's units.\n"
+		   "# TYPE usense_reading gauge\n");
+	for (i = 0; i < devs; i++) {
+		if (cached[i].status < 0)
+			continue;
+		fprintf(f, "usense_reading");
+		device_labels(f, cached[i].dev, 1, NULL);
+		fprintf(f, " %.15g\n", cached[i].value);
+	}
+
+	fprintf(f, "# HELP usense_reading_timestamp_seconds When the reading was taken.\n"
+		   "# TYPE usense_reading_timestamp_seconds gauge\n");
+	for (i = 0; i < devs; i++) {
+		if (cached[i].status < 0)
+			continue;
+		fprintf(f, "usense_reading_timestamp_seconds");
+		device_labels(f, cached[i].dev, 0, NULL);
+		fprintf(f, " %lld.%03ld\n", (long long)cached[i].timestamp.tv_sec,
+			cached[i].timestamp.tv_nsec / 1000000);
+	}
+
+	for (i = 0; i < devs; i++)
+		usense_device_stats(cached[i].dev, &stats[i]);
+
+	fprintf(f, "# HELP usense_updates_total Hardware reads.\n"
+		   "# TYPE usense_updates_total counter\n");
+	for (i = 0; i < devs; i++) {
+		fprintf(f, "usense_updates_total");
+		device_labels(f, cached[i].dev, 0, NULL);
+		fprintf(f, " %llu\n", (unsigned long long)stats[i].updates);
+	}
+
+	fprintf(f, "# HELP usense_update_errors_total Hardware reads that failed.\n"
+		   "# TYPE usense_update_errors_total counter\n");
+	for (i = 0; i < devs; i++) {
+		fprintf(f, "usense_update_errors_total");
+		device_labels(f, cached[i].dev, 0, NULL);
+		fprintf(f, " %llu\n", (unsigned long long)stats[i].errors);
+	}
+
+	fprintf(f, "# HELP usense_update_seconds How long hardware reads take.\n"
+		   "# TYPE usense_update_seconds histogram\n");
+	for (i = 0; i < devs; i++) {
+		usense_device_update_le(cached[i].dev, update_le_ns, le, UPDATE_BUCKETS);
+		for (j = 0; j < UPDATE_BUCKETS; j++) {
+			if (update_le_ns[j] == UINT64_MAX)
+				snprintf(bound, sizeof(bound), "+Inf");
+			else
+				snprintf(bound, sizeof(bound), "%g", update_le_ns[j] / 1e9);
+			fprintf(f, "usense_update_seconds_bucket");
+			device_labels(f, cached[i].dev, 0, bound);
+			fprintf(f, " %llu\n", (unsigned long long)le[j]);
+		}
+		fprintf(f, "usense_update_seconds_sum");
+		device_labels(f, cached[i].dev, 0, NULL);
+		fprintf(f, " %.9f\n", stats[i].latency_ns / 1e9);
+		fprintf(f, "usense_update_seconds_count");
+		device_labels(f, cached[i].dev, 0, NULL);
+		fprintf(f, " %llu\n", (unsigned long long)le[UPDATE_BUCKETS - 1]);
+	}
+
+	if (fclose(f) != 0) {
+		free(body);
+		return NULL;
+	}
+
+	page = malloc(sizeof(*page) + len + 128);
+	if (page == NULL) {
+		free(body);
+		return NULL;
+	}
+
+	n = sprintf(page->text, "HTTP/1.1 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Content-Length: %zu\r\n"
+		    "Connection: close\r\n\r\n", len);
+	memcpy(page->text + n, body, len);
+	page->len = n + len;
+	page->refs = 1;
+	page->generation = generation;
+	free(body);
+
+	return page;
+}
+
+/* The current page. The monitor does the sampling, so
+ * scrapers never wait for the hardware, however many ask.
+ */
+static struct page *metrics_page(struct metrics *m)
+{
+	unsigned int generation;
+	struct page *page;
+
+	/* Readings fetched for other clients count too */
+	generation = usense_generation(m->usense);
+	if (m->page == NULL || m->page->generation != generation) {
+		page = metrics_render(m, generation);
+		if (page != NULL) {
+			page_put(m->page);
+			m->page = page;
+		}
+	}
+
+	if (m->page != NULL)
+		m->page->refs++;
+
+	return m->page;
+}
+
+static void http_reply(struct metrics *m, struct client *cl)
+{
+	static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\n"
+		"Content-Length: 0\r\nConnection: close\r\n\r\n";
+	static const char not_found[] = "HTTP/1.1 404 Not Found\r\n"
+		"Content-Length: 0\r\nConnection: close\r\n\r\n";
+	static const char unavailable[] = "HTTP/1.1 503 Service Unavailable\r\n"
+		"Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+	cl->done = 1;
+
+	switch (cl->status) {
+	case 200:
+		cl->page = metrics_page(m);
+		if (cl->page == NULL)
+			out_append(&cl->out, unavailable, sizeof(unavailable) - 1);
+		break;
+	case 404:
+		out_append(&cl->out, not_found, sizeof(not_found) - 1);
+		break;
+	default:
+		out_append(&cl->out, bad_request, sizeof(bad_request) - 1);
+		break;
+	}
+}
+
+/* Skip header lines. Returns 1 at the blank line that ends them. */
+static int http_skip(struct client *cl, const char *p, size_t n)
+{
+	for (; n > 0; p++, n--) {
+		if (*p == '\n') {
+			if (cl->line_len == 0)
+				return 1;
+			cl->line_len = 0;
+		} else if (*p != '\r') {
+			cl->line_len++;
+		}
+	}
+
+	return 0;
+}
+
+/* Only the request line is kept. The headers, however long,
+ * are read and dropped.
+ */
+static void http_input(struct metrics *m, struct client *cl)
+{
+	char *nl;
+	ssize_t n;
+
+	if (cl->done || cl->status != 0) {
+		/* Anything more is ignored, until the peer hangs up */
+		n = recv(cl->fd, cl->in, sizeof(cl->in), MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+			cl->dead = 1;
+		else if (n > 0 && !cl->done && http_skip(cl, cl->in, n))
+			http_reply(m, cl);
+		return;
+	}
+
+	n = recv(cl->fd, cl->in + cl->in_len, sizeof(cl->in) - cl->in_len, MSG_DONTWAIT);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (n <= 0) {
+		cl->dead = 1;
+		return;
+	}
+	cl->in_len += n;
+
+	nl = memchr(cl->in, '\n', cl->in_len);
+	if (nl == NULL) {
+		/* Too long to be a request for us */
+		if (cl->in_len == sizeof(cl->in)) {
+			cl->status = 400;
+			cl->in_len = 0;
+			http_reply(m, cl);
+		}
+		return;
+	}
+
+	if (strncmp(cl->in, "GET /metrics ", 13) == 0 ||
+	    strncmp(cl->in, "GET /metrics?", 13) == 0)
+		cl->status = 200;
+	else
+		cl->status = 404;
+
+	cl->line_len = 0;
+	if (http_skip(cl, nl + 1, cl->in + cl->in_len - (nl + 1)))
+		http_reply(m, cl);
+	cl->in_len = 0;
+}
+
+/* [addr:]port, ie 9000 or 127.0.0.1:9000 */
+static int listen_http(const char *spec)
+{
+	struct addrinfo hints, *ai, *res;
+	char host[256], *port;
+	int fd = -1, on = 1;
+
+	if (strlen(spec) >= sizeof(host)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(host, spec);
+	port = strrchr(host, ':');
+	if (port != NULL)
+		*port++ = 0;
+	else
+		port = host;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo((port == host || host[0] == 0) ? NULL : host, port, &hints, &res) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un sun;
+	char dir[sizeof(sun.sun_path)], *cp;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	/* ie /run/usense */
+	strcpy(dir, path);
+	cp = strrchr(dir, '/');
+	if (cp != NULL && cp != dir) {
+		*cp = 0;
+		mkdir(dir, 0755);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	/* Left over from a previous run? */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    chmod(path, 0666) < 0 ||
+	    listen(fd, 16) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage:\n"
+			"%s [-m [addr:]port] [-i msec] [socket]\n"
+			"\n"
+			"  -m  Serve Prometheus metrics over HTTP, at /metrics\n"
+			"  -i  Sample every device this often, in ms (%d, 0 for never)\n",
+			program, USENSE_MONITOR_INTERVAL);
+}
+
+/* Accept everything pending on 'lfd' */
+static int accept_all(struct usense *usense, int lfd, struct client **clients, int http)
+{
+	struct client *cl;
+	int fd, n = 0;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		cl = calloc(1, sizeof(*cl));
+		if (cl == NULL) {
+			close(fd);
+			continue;
+		}
+		cl->fd = fd;
+		cl->http = http;
+		cl->usense = usense;
+		pthread_mutex_init(&cl->lock, NULL);
+		pthread_cond_init(&cl->cond, NULL);
+
+		if (!http) {
+			if (pthread_create(&cl->thread, NULL, client_worker, cl) != 0) {
+				pthread_cond_destroy(&cl->cond);
+				pthread_mutex_destroy(&cl->lock);
+				close(fd);
+				free(cl);
+				continue;
+			}
+			cl->worker = 1;
+		}
+
+		cl->next = *clients;
+		*clients = cl;
+		n++;
+	}
+
+	return n;
+}
+
+/* Can it be freed? A dead client's worker is told to stop,
+ * and it is reaped once that has finished its request.
+ */
+static int client_done(struct client *cl)
+{
+	int done;
+
+	pthread_mutex_lock(&cl->lock);
+	if (cl->worker) {
+		if (cl->dead && !cl->exited)
+			pthread_cond_signal(&cl->cond);
+		done = cl->exited && (cl->dead || !client_pending(cl));
+	} else {
+		done = cl->dead;
+	}
+	pthread_mutex_unlock(&cl->lock);
+
+	return done;
+}
+
+static void client_free(struct client *cl)
+{
+	if (cl->worker) {
+		pthread_mutex_lock(&cl->lock);
+		cl->dead = 1;
+		pthread_cond_signal(&cl->cond);
+		pthread_mutex_unlock(&cl->lock);
+		pthread_join(cl->thread, NULL);
+	}
+
+	close(cl->fd);
+	page_put(cl->page);
+	free(cl->reply.text);
+	free(cl->out.text);
+	pthread_cond_destroy(&cl->cond);
+	pthread_mutex_destroy(&cl->lock);
+	free(cl);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = USENSE_SOCKET_PATH, *http = NULL;
+	const char *cp;
+	char readings[PATH_MAX];
+	struct metrics *m;
+	struct attacher at;
+	struct usense *usense;
+	struct client *clients = NULL, *cl, **pcl;
+	struct pollfd *pfd = NULL, *tmp;
+	sigset_t sigs;
+	unsigned int interval = USENSE_MONITOR_INTERVAL;
+	int i, n, c, lfd, hfd = -1, sfd, err, nclients = 0, running = 1;
+
+	program = argv[0];
+
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return EXIT_FAILURE;
+
+	while ((c = getopt(argc, argv, "m:i:h")) != -1) {
+		switch (c) {
+		case 'm':
+			http = optarg;
+			break;
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		path = argv[optind];
+
+	/* Before any threads start, so only the signalfd sees these */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	sfd = signalfd(-1, &sigs, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (sfd < 0) {
+		fprintf(stderr, "%s: signalfd: %s\n", program, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	if (pipe(wake) < 0) {
+		fprintf(stderr, "%s: pipe: %s\n", program, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(wake[i], F_SETFL, O_NONBLOCK);
+		fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	usense = usense_start();
+	if (usense == NULL) {
+		fprintf(stderr, "%s: Can't create a new usense monitor\n", program);
+		return EXIT_FAILURE;
+	}
+
+	usense_monitor_interval(usense, interval);
+	usense_open_all(usense);
+
+	err = attacher_start(&at, usense);
+	if (err < 0) {
+		fprintf(stderr, "%s: Can't start a thread: %s\n", program, strerror(-err));
+		usense_stop(usense);
+		return EXIT_FAILURE;
+	}
+
+	/* Scripts that only want readings can use the snapshot. It
+	 * goes next to the socket, so ie /run/usense/readings.
+	 */
+	cp = strrchr(path, '/');
+	snprintf(readings, sizeof(readings), "%.*sreadings",
+		 (cp != NULL) ? (int)(cp + 1 - path) : 0, path);
+	err = usense_shm_publish(usense, readings);
+	if (err < 0)
+		fprintf(stderr, "%s: Can't publish to %s: %s\n", program, readings, strerror(-err));
+
+	m->usense = usense;
+
+	lfd = listen_on(path);
+	if (lfd < 0) {
+		fprintf(stderr, "%s: Can't listen on %s: %s\n", program, path, strerror(errno));
+		attacher_stop(&at);
+		usense_stop(usense);
+		return EXIT_FAILURE;
+	}
+
+	if (http != NULL) {
+		hfd = listen_http(http);
+		if (hfd < 0) {
+			fprintf(stderr, "%s: Can't listen on %s: %s\n", program, http, strerror(errno));
+			unlink(path);
+			attacher_stop(&at);
+			usense_stop(usense);
+			return EXIT_FAILURE;
+		}
+	}
+
+	while (running) {
+		tmp = realloc(pfd, sizeof(*pfd) * (5 + nclients));
+		if (tmp == NULL)
+			break;
+		pfd = tmp;
+
+		pfd[0].fd = sfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = lfd;
+		pfd[1].events = POLLIN;
+		pfd[2].fd = usense_monitor_fd(usense);
+		pfd[2].events = POLLIN;
+		pfd[3].fd = hfd;	/* Ignored by poll() when -1 */
+		pfd[3].events = POLLIN;
+		pfd[4].fd = wake[0];
+		pfd[4].events = POLLIN;
+		for (i = 5, cl = clients; cl != NULL; cl = cl->next, i++) {
+			pfd[i].events = client_events(cl);
+			pfd[i].fd = pfd[i].events ? cl->fd : -1;
+		}
+		n = i;
+
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* SIGHUP rescans, for when there are no hotplug
+		 * events (ie in a container)
+		 */
+		if (pfd[0].revents & POLLIN) {
+			struct signalfd_siginfo si;
+
+			while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+				if (si.ssi_signo == SIGHUP)
+					attacher_rescan(&at);
+				else
+					running = 0;
+			}
+		}
+
+		if (pfd[2].revents & POLLIN)
+			broadcast(usense, &at, clients);
+
+		/* Workers have replies, or have finished */
+		if (pfd[4].revents & POLLIN) {
+			char buff[64];
+
+			while (read(wake[0], buff, sizeof(buff)) > 0);
+		}
+
+		for (i = 5, cl = clients; cl != NULL; cl = cl->next, i++) {
+			if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if (cl->http)
+					http_input(m, cl);
+				else
+					client_input(cl);
+			}
+			client_flush(cl);
+		}
+
+		/* Reap the ones that are done */
+		for (pcl = &clients; *pcl != NULL; ) {
+			cl = *pcl;
+			if (!client_done(cl)) {
+				pcl = &cl->next;
+				continue;
+			}
+			*pcl = cl->next;
+			client_free(cl);
+			nclients--;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			nclients += accept_all(usense, lfd, &clients, 0);
+		if (pfd[3].revents & POLLIN)
+			nclients += accept_all(usense, hfd, &clients, 1);
+	}
+
+	unlink(path);
+	close(lfd);
+	close(sfd);
+	if (hfd >= 0)
+		close(hfd);
+
+	while (clients != NULL) {
+		cl = clients;
+		clients = cl->next;
+		client_free(cl);
+	}
+	close(wake[0]);
+	close(wake[1]);
+	free(pfd);
+	page_put(m->page);
+	free(m);
+
+	attacher_stop(&at);
+	usense_stop(usense);
+
+	return EXIT_SUCCESS;
+}
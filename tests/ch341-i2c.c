@@ -0,0 +1,159 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* The CH341's I2C engine: the stream commands built for
+ * short and long transactions, against the emulated LM75.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "usense-usb.h"
+#include "i2c.h"
+#include "i2c-ch341.h"
+#include "check.h"
+
+#define LM75		0x4f
+#define LM75_TOS	3
+
+static struct usense_usb_stats stats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static libusb_device_handle *open_ch341(void)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *usb = NULL;
+	libusb_device **list;
+	ssize_t i, n;
+
+	CHECK(usense_usb_init() == 0);
+	n = usense_usb_device_list(&list);
+	CHECK(n > 0);
+
+	for (i = 0; i < n; i++) {
+		CHECK(usense_usb_descriptor(list[i], &desc) == 0);
+		if (desc.idVendor == 0x1a86 && desc.idProduct == CH341_I2C_PRODUCT) {
+			CHECK(usense_usb_open(list[i], &usb) == 0);
+			break;
+		}
+	}
+	usense_usb_free_device_list(list);
+
+	CHECK(usb != NULL);
+	CHECK(usense_usb_claim(usb, 0) == 0);
+	CHECK(usense_usb_account(usb, &stats) == 0);
+
+	return usb;
+}
+
+/* Point at 'reg', then read 'len' bytes of it back */
+static int read_reg(struct i2c_adapter *adap, uint16_t addr, uint8_t reg, uint8_t *buf, int len)
+{
+	struct i2c_msg msgs[2] = {
+		{ .addr = addr, .len = 1, .buf = &reg },
+		{ .addr = addr, .flags = I2C_M_RD, .len = len, .buf = buf },
+	};
+
+	return adap->algo->master_xfer(adap, msgs, 2);
+}
+
+static uint64_t transfers(void)
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&stats.lock);
+	n = stats.transfers;
+	pthread_mutex_unlock(&stats.lock);
+
+	return n;
+}
+
+int main(void)
+{
+	uint8_t tos[3] = { LM75_TOS, 0x4b, 0x80 };
+	uint8_t buf[300];
+	struct i2c_msg msg = { .addr = LM75, .len = sizeof(tos), .buf = tos };
+	struct i2c_adapter adap = { .retries = 1 };
+	libusb_device_handle *usb;
+	uint64_t before;
+	int i;
+
+	check_emul("ch341a");
+	setenv("USENSE_CH341_I2C", "1", 1);
+
+	usb = open_ch341();
+	CHECK(i2c_ch341_add_bus(&adap, usb) == 0);
+
+	/* A short write, and a short read back */
+	CHECK(adap.algo->master_xfer(&adap, &msg, 1) == 1);
+	memset(buf, 0, sizeof(buf));
+	CHECK(read_reg(&adap, LM75, LM75_TOS, buf, 2) == 2);
+	CHECK(buf[0] == 0x4b && buf[1] == 0x80);
+
+	/* A read longer than one IN command, or one packet, is
+	 * still one bulk write and its reads.
+	 */
+	memset(buf, 0, sizeof(buf));
+	before = transfers();
+	CHECK(read_reg(&adap, LM75, LM75_TOS, buf, 40) == 2);
+	CHECK(transfers() - before <= 3);
+	for (i = 0; i < 40; i++)
+		CHECK(buf[i] == tos[1 + i % 2]);
+
+	/* All the engine can return at once: the two address
+	 * ACKs, and 254 bytes.
+	 */
+	memset(buf, 0, sizeof(buf));
+	CHECK(read_reg(&adap, LM75, LM75_TOS, buf, 254) == 2);
+	for (i = 0; i < 254; i++)
+		CHECK(buf[i] == tos[1 + i % 2]);
+
+	/* More than that, or more commands than fit in the
+	 * packets, is refused before anything is sent.
+	 */
+	before = transfers();
+	CHECK(read_reg(&adap, LM75, LM75_TOS, buf, 255) == -E2BIG);
+	msg.len = 250;
+	msg.buf = buf;
+	CHECK(adap.algo->master_xfer(&adap, &msg, 1) == -E2BIG);
+	CHECK(transfers() == before);
+
+	/* Nothing at 0x48: NAKed, and retried */
+	before = transfers();
+	CHECK(read_reg(&adap, 0x48, LM75_TOS, buf, 2) == -EREMOTEIO);
+	CHECK(transfers() - before == 2 * (adap.retries + 1));
+
+	/* The LM75 is still fine after all that */
+	memset(buf, 0, sizeof(buf));
+	CHECK(read_reg(&adap, LM75, LM75_TOS, buf, 2) == 2);
+	CHECK(buf[0] == 0x4b && buf[1] == 0x80);
+
+	i2c_ch341_del_bus(&adap);
+	usense_usb_account(usb, NULL);
+	usense_usb_close(usb);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* The reading cache: reading.max_age_ms and
+ * reading.stale_while_revalidate, on an emulated PCsensor
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "usense.h"
+#include "check.h"
+
+static uint64_t updates(struct usense_device *dev)
+{
+	struct usense_stats stats;
+
+	CHECK(usense_device_stats(dev, &stats) == 0);
+	return stats.updates;
+}
+
+static void reading(struct usense_device *dev)
+{
+	char buff[USENSE_PROP_MAX];
+
+	CHECK(usense_prop_get(dev, "reading", buff, sizeof(buff)) >= 0);
+}
+
+/* Wait up to a second for the device to be updated */
+static int updated(struct usense_device *dev, uint64_t since)
+{
+	uint64_t deadline = check_now_ms() + 1000;
+
+	while (updates(dev) == since) {
+		if (check_now_ms() >= deadline)
+			return 0;
+		usleep(1000);
+	}
+
+	return 1;
+}
+
+int main(void)
+{
+	struct usense *usense;
+	struct usense_device *dev;
+	uint64_t n, start;
+	int i;
+
+	/* Real time, so an update takes a while: 11 transfers */
+	check_emul("pcsensor");
+	setenv("USENSE_EMUL_CLOCK", "real", 1);
+	setenv("USENSE_EMUL_LATENCY_US", "2000", 1);
+
+	usense = usense_start();
+	CHECK(usense != NULL);
+
+	/* Nothing is sampled in the background, until we ask */
+	usense_monitor_interval(usense, 0);
+
+	dev = usense_open(usense, "usb:001.1");
+	CHECK(dev != NULL);
+
+	/* No maximum age: every read goes to the hardware */
+	n = updates(dev);
+	reading(dev);
+	reading(dev);
+	CHECK(updates(dev) == n + 2);
+
+	/* Reads within the maximum age share one sample */
+	CHECK(usense_prop_set(dev, "reading.max_age_ms", "200") >= 0);
+	reading(dev);
+	n = updates(dev);
+	for (i = 0; i < 10; i++)
+		reading(dev);
+	CHECK(updates(dev) == n);
+
+	/* ..until it is too old */
+	usleep(250000);
+	reading(dev);
+	CHECK(updates(dev) == n + 1);
+
+	/* A stale reading comes back at once, and the
+	 * monitor fetches a fresh one behind it.
+	 */
+	CHECK(usense_prop_set(dev, "reading.max_age_ms", "50") >= 0);
+	CHECK(usense_prop_set(dev, "reading.stale_while_revalidate", "1") >= 0);
+	usleep(100000);
+	n = updates(dev);
+	start = check_now_ms();
+	reading(dev);
+	CHECK(check_now_ms() - start < 10);
+	CHECK(updates(dev) == n);
+	CHECK(updated(dev, n));
+
+	/* Once the monitor samples the device, its sample is
+	 * used while no maximum age is set..
+	 */
+	CHECK(usense_prop_set(dev, "reading.stale_while_revalidate", "0") >= 0);
+	CHECK(usense_prop_set(dev, "reading.max_age_ms", "0") >= 0);
+	n = updates(dev);
+	usense_monitor_interval(usense, 60000);
+	CHECK(updated(dev, n));
+	n = updates(dev);
+	reading(dev);
+	reading(dev);
+	CHECK(updates(dev) == n);
+
+	/* ..but a maximum age still holds */
+	CHECK(usense_prop_set(dev, "reading.max_age_ms", "50") >= 0);
+	usleep(100000);
+	reading(dev);
+	CHECK(updates(dev) == n + 1);
+
+	usense_stop(usense);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* The shared memory snapshot: what usense_shm_read() gets back
+ * matches what was published, even while it is being rewritten.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "usense.h"
+#include "check.h"
+
+#define READERS		2
+#define RUN_MS		300
+
+static struct usense_shm *shm;
+static int stop;
+
+/* Is the record one that was really published? The units, the
+ * value and its text are written together, so a torn read
+ * would pair them up wrongly.
+ */
+static int consistent(const struct usense_shm_reading *r)
+{
+	const char *units = r->units;
+	double c, scale = 1.0;
+
+	if (r->status != 0)
+		return 0;
+
+	if (units[0] == 'm') {
+		scale = 1e-3;
+		units++;
+	}
+
+	if (strcmp(units, "C") == 0 || strcmp(units, "Celsius") == 0)
+		c = r->value * scale;
+	else if (strcmp(units, "F") == 0 || strcmp(units, "Fahrenheit") == 0)
+		c = (r->value * scale - 32.0) * 5.0 / 9.0;
+	else if (strcmp(units, "K") == 0 || strcmp(units, "Kelvin") == 0)
+		c = r->value * scale - 273.15;
+	else
+		return 0;
+
+	/* The emulated sensors are at 22C, give or take */
+	if (c < 15.0 || c > 30.0)
+		return 0;
+
+	return fabs(strtod(r->reading, NULL) - r->value) < 0.001;
+}
+
+static void *reader(void *arg)
+{
+	struct usense_shm_reading r;
+	long bad = 0;
+	int id;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		for (id = 0; id < usense_shm_devices(shm); id++) {
+			CHECK(usense_shm_read(shm, id, &r) == 0);
+			if (!consistent(&r))
+				bad++;
+		}
+	}
+
+	return (void *)bad;
+}
+
+int main(void)
+{
+	/* Including the longest, which must not be cut short */
+	static const char *units[] = { "C", "Fahrenheit", "mKelvin" };
+	char dir[] = "/tmp/usense-shm-XXXXXX", path[64];
+	struct usense_shm_reading r;
+	struct usense_sample sample;
+	struct usense_device *dev;
+	struct usense *usense;
+	pthread_t thread[READERS];
+	uint64_t deadline;
+	void *bad;
+	int i;
+
+	check_emul("pcsensor,gotemp");
+
+	CHECK(mkdtemp(dir) != NULL);
+	snprintf(path, sizeof(path), "%s/readings", dir);
+
+	usense = usense_start();
+	CHECK(usense != NULL);
+	usense_monitor_interval(usense, 0);
+	CHECK(usense_open_all(usense) == 2);
+
+	CHECK(usense_shm_publish(usense, path) == 0);
+	shm = usense_shm_open(path);
+	CHECK(shm != NULL);
+	CHECK(usense_shm_devices(shm) == 2);
+
+	/* Read back what each device has published */
+	for (i = 0; i < 2; i++) {
+		dev = usense_open_id(usense, i);
+		CHECK(dev != NULL);
+		CHECK(usense_read(usense, &(struct usense_sample){ .dev = dev }, 1) == 1);
+		CHECK(usense_read_cached(dev, &sample) == 0);
+
+		CHECK(usense_shm_read(shm, i, &r) == 0);
+		CHECK(strcmp(r.device, usense_device_name(dev)) == 0);
+		CHECK(strcmp(r.units, "C") == 0);
+		CHECK(r.status == 0);
+		CHECK(r.value == sample.value);
+		CHECK(r.timestamp.tv_sec == sample.timestamp.tv_sec &&
+		      r.timestamp.tv_nsec == sample.timestamp.tv_nsec);
+	}
+	CHECK(usense_shm_read(shm, 2, &r) == -ENOENT);
+
+	/* Now keep rewriting both records, while readers check
+	 * that every one they see is whole.
+	 */
+	usense_monitor_interval(usense, 1);
+	for (i = 0; i < READERS; i++)
+		CHECK(pthread_create(&thread[i], NULL, reader, NULL) == 0);
+
+	dev = usense_open_id(usense, 0);
+	deadline = check_now_ms() + RUN_MS;
+	for (i = 0; check_now_ms() < deadline; i++)
+		CHECK(usense_prop_set(dev, "units", units[i % 3]) >= 0);
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < READERS; i++) {
+		CHECK(pthread_join(thread[i], &bad) == 0);
+		CHECK(bad == NULL);
+	}
+
+	/* Stopping marks every record as gone */
+	usense_stop(usense);
+	CHECK(usense_shm_read(shm, 0, &r) == 0);
+	CHECK(r.status == -ENODEV);
+
+	usense_shm_close(shm);
+	unlink(path);
+	rmdir(dir);
+
+	return EXIT_SUCCESS;
+}
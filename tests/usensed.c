@@ -0,0 +1,216 @@
+/*
+ * Copyright 2009, Jason S. McMullan
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/* usensed, over its socket: every request, many at once, the
+ * change records of a subscriber, and a device plugged in later.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "usense.h"
+#include "check.h"
+
+#define PIPELINE	200
+#define PLUG_MS		1000	/* When the third device appears */
+
+static pid_t usensed;
+
+static struct usense_client *connect_to(const char *path)
+{
+	struct usense_client *client;
+	uint64_t deadline = check_now_ms() + 5000;
+
+	/* Until it has opened the devices, and is listening */
+	while ((client = usense_client_connect(path)) == NULL) {
+		CHECK(check_now_ms() < deadline);
+		CHECK(waitpid(usensed, NULL, WNOHANG) == 0);
+		usleep(10000);
+	}
+
+	return client;
+}
+
+int main(void)
+{
+	char dir[] = "/tmp/usense-usensed-XXXXXX";
+	char path[64], readings[64], buff[USENSE_PROP_MAX];
+	char name[2][64], driver[2][64];
+	struct usense_client *client, *sub, *all;
+	struct usense_shm_reading r;
+	uint64_t deadline, hup = 0;
+	struct usense_change change;
+	struct usense_shm *shm;
+	int i, n, status, units = 0;
+
+	snprintf(buff, sizeof(buff), "pcsensor,gotemp,pcsensor@%d", PLUG_MS);
+	check_emul(buff);
+
+	CHECK(mkdtemp(dir) != NULL);
+	snprintf(path, sizeof(path), "%s/socket", dir);
+	snprintf(readings, sizeof(readings), "%s/readings", dir);
+
+	usensed = fork();
+	CHECK(usensed >= 0);
+	if (usensed == 0) {
+		/* Don't outlive a failed CHECK() */
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		execl(USENSED, "usensed", "-i", "0", path, (char *)NULL);
+		_exit(127);
+	}
+
+	client = connect_to(path);
+
+	/* list */
+	CHECK(usense_client_request(client, "list") == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == 2);
+	for (i = 0; i < 2; i++)
+		CHECK(usense_client_line(client, name[i], sizeof(name[i])) > 0);
+	CHECK(strcmp(name[0], name[1]) != 0);
+
+	/* get, by name and by id */
+	CHECK(usense_client_request(client, "get %s type", name[0]) == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == 0);
+	CHECK(strcmp(buff, "temp") == 0);
+	for (i = 0; i < 2; i++) {
+		CHECK(usense_client_request(client, "get %d device", i) == 0);
+		CHECK(usense_client_reply(client, driver[i], sizeof(driver[i])) == 0);
+	}
+	CHECK(strcmp(driver[0], driver[1]) != 0);
+
+	/* set, then read it back */
+	CHECK(usense_client_request(client, "set %s units F", name[0]) == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == 0);
+	CHECK(usense_client_request(client, "get %s units", name[0]) == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == 0);
+	CHECK(strcmp(buff, "F") == 0);
+	CHECK(usense_client_request(client, "get %s reading", name[0]) == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == 0);
+	CHECK(strtod(buff, NULL) > 59.0 && strtod(buff, NULL) < 95.0);
+
+	/* snapshot */
+	CHECK(usense_client_request(client, "snapshot %s", name[0]) == 0);
+	n = usense_client_reply(client, buff, sizeof(buff));
+	CHECK(n > 0);
+	for (i = 0; n > 0; n--) {
+		CHECK(usense_client_line(client, buff, sizeof(buff)) > 0);
+		CHECK(strchr(buff, '=') != NULL);
+		if (strcmp(buff, "units=F") == 0)
+			i++;
+	}
+	CHECK(i == 1);
+
+	/* Errors */
+	CHECK(usense_client_request(client, "get usb:999.9 reading") == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == -ENODEV);
+	CHECK(usense_client_request(client, "get %s", name[0]) == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == -EINVAL);
+	CHECK(usense_client_request(client, "frobnicate") == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == -EINVAL);
+
+	/* Many at once, which must come back in order */
+	for (i = 0; i < PIPELINE; i++)
+		CHECK(usense_client_request(client, "get %d device", i % 2) == 0);
+	CHECK(usense_client_flush(client) == 0);
+	for (i = 0; i < PIPELINE; i++) {
+		CHECK(usense_client_reply(client, buff, sizeof(buff)) == 0);
+		CHECK(strcmp(buff, driver[i % 2]) == 0);
+	}
+
+	/* A subscriber sees the changes made by another client,
+	 * and only those of the device it asked for.
+	 */
+	sub = connect_to(path);
+	CHECK(usense_client_request(sub, "subscribe %s", name[0]) == 0);
+	CHECK(usense_client_reply(sub, buff, sizeof(buff)) == 0);
+
+	CHECK(usense_client_request(client, "set %s units K", name[1]) == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == 0);
+	CHECK(usense_client_request(client, "set %s units K", name[0]) == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == 0);
+
+	do {
+		CHECK(usense_client_change(sub, &change) == 0);
+		CHECK(strcmp(change.device, name[0]) == 0);
+		if (strcmp(change.prop, "units") == 0)
+			units++;
+	} while (units == 0);
+
+	/* Replies still work once subscribed */
+	CHECK(usense_client_request(sub, "get %s units", name[0]) == 0);
+	CHECK(usense_client_reply(sub, buff, sizeof(buff)) == 0);
+	CHECK(strcmp(buff, "K") == 0);
+
+	/* The readings are published next to the socket */
+	shm = usense_shm_open(readings);
+	CHECK(shm != NULL);
+	CHECK(usense_shm_devices(shm) == 2);
+
+	/* A device plugged in later is opened and published,
+	 * though nobody has asked for it. The emulator makes no
+	 * hotplug events, so SIGHUP has usensed look for it.
+	 */
+	all = connect_to(path);
+	CHECK(usense_client_request(all, "subscribe") == 0);
+	CHECK(usense_client_reply(all, buff, sizeof(buff)) == 0);
+
+	deadline = check_now_ms() + PLUG_MS + 5000;
+	while (usense_shm_devices(shm) < 3 || usense_shm_read(shm, 2, &r) < 0 || r.status != 0) {
+		CHECK(check_now_ms() < deadline);
+		if (check_now_ms() >= hup) {
+			CHECK(kill(usensed, SIGHUP) == 0);
+			hup = check_now_ms() + 100;
+		}
+		usleep(10000);
+	}
+	CHECK(strcmp(r.device, name[0]) != 0 && strcmp(r.device, name[1]) != 0);
+	CHECK(strcmp(r.units, "C") == 0);
+	usense_shm_close(shm);
+
+	do {
+		CHECK(usense_client_change(all, &change) == 0);
+	} while (strcmp(change.device, r.device) != 0 ||
+		 strcmp(change.prop, USENSE_CHANGE_ADD) != 0);
+
+	CHECK(usense_client_request(client, "list") == 0);
+	CHECK(usense_client_reply(client, buff, sizeof(buff)) == 3);
+	for (i = 0; i < 3; i++)
+		CHECK(usense_client_line(client, buff, sizeof(buff)) > 0);
+
+	usense_client_close(all);
+	usense_client_close(sub);
+	usense_client_close(client);
+
+	CHECK(kill(usensed, SIGTERM) == 0);
+	CHECK(waitpid(usensed, &status, 0) == usensed);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+	CHECK(access(path, F_OK) < 0);
+
+	unlink(readings);
+	rmdir(dir);
+
+	return EXIT_SUCCESS;
+}